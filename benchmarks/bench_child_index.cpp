@@ -0,0 +1,82 @@
+/* Child lookup cost in PathTrie against node fan-out.
+ *
+ * Compares ChildIndex with the linear scan over a vector of
+ * (label, child) pairs that PathTrie used before. Half of the lookups hit
+ * an existing child and half miss, as in get_path_trie. Build and run from
+ * the repository root:
+ *
+ *     g++ -O3 -std=c++14 -I ctcdecode/src benchmarks/bench_child_index.cpp \
+ *         -o bench_child_index && ./bench_child_index
+ *
+ * Output is one tab-separated row per fan-out: fan_out, linear_ns, index_ns.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "child_index.h"
+
+namespace {
+
+const int VOCAB_SIZE = 8192;
+const size_t NUM_LOOKUPS = 1 << 22;
+
+// keeps the compiler from dropping the lookups
+volatile size_t sink;
+
+template <typename Lookup>
+double ns_per_lookup(const std::vector<int> &queries, Lookup lookup) {
+  size_t found = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < NUM_LOOKUPS; ++i) {
+    found += lookup(queries[i % queries.size()]) != 0;
+  }
+  auto end = std::chrono::steady_clock::now();
+  sink = found;
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         NUM_LOOKUPS;
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng(42);
+  std::vector<int> labels(VOCAB_SIZE);
+  std::iota(labels.begin(), labels.end(), 0);
+
+  std::printf("fan_out\tlinear_ns\tindex_ns\n");
+  for (size_t fan_out = 1; fan_out <= VOCAB_SIZE / 2; fan_out *= 2) {
+    std::shuffle(labels.begin(), labels.end(), rng);
+
+    std::vector<std::pair<int, size_t>> linear;
+    ChildIndex<size_t> index;
+    for (size_t i = 0; i < fan_out; ++i) {
+      linear.emplace_back(labels[i], i + 1);
+      index.insert(labels[i], i + 1);
+    }
+
+    // present and absent labels, interleaved
+    std::vector<int> queries;
+    std::uniform_int_distribution<size_t> present(0, fan_out - 1);
+    std::uniform_int_distribution<size_t> absent(fan_out, VOCAB_SIZE - 1);
+    for (size_t i = 0; i < 4096; ++i) {
+      queries.push_back(labels[i % 2 ? present(rng) : absent(rng)]);
+    }
+
+    double linear_ns = ns_per_lookup(queries, [&linear](int label) -> size_t {
+      for (const auto &child : linear) {
+        if (child.first == label) return child.second;
+      }
+      return 0;
+    });
+    double index_ns = ns_per_lookup(
+        queries, [&index](int label) { return index.find(label); });
+
+    std::printf("%zu\t%.2f\t%.2f\n", fan_out, linear_ns, index_ns);
+  }
+  return 0;
+}
@@ -0,0 +1,457 @@
+/* Throughput of the decoder hot paths on seeded synthetic logits.
+ *
+ * Frames are the log_softmax of Gaussian noise with a peak added to one label
+ * per frame: the blank on a --blank fraction of the frames, a random other
+ * label on the rest. --peak sets how far the peak stands out, from flat
+ * frames at 0 to confident ones at 10 and above. Labels are the blank, a
+ * space, an apostrophe and the letters, then made up ones up to --vocab.
+ * The language model is tests/test.arpa, any ARPA or binary KenLM file given
+ * with --lm, or with --lm=generate a random word ARPA of --lm_words words
+ * written to a temporary file.
+ *
+ * Rows, timed over --frames frames each, are:
+ *     prune      get_pruned_log_probs on each frame (reported with beam 1)
+ *     trie       PathTrie expansion of the pruned labels of every prefix of
+ *                the beam on each frame, then removal of the prefixes that
+ *                fall out of the beam
+ *     lm_query   Scorer::get_log_cond_prob on beam n-grams of lm words per
+ *                frame
+ *     next       DecoderState::next without a Scorer
+ *     next_lm    DecoderState::next with a Scorer
+ *     decode     DecoderState::decode after next, per frame of the stream
+ *     decode_lm  the same with a Scorer
+ *     batch      ctc_beam_search_decoder_batch of --batch items of --frames
+ *                frames each, for 1, 2, 4, ... up to the number of cores
+ *                as num_processes
+ *
+ * Build and run from the repository root, with the third party sources in
+ * place as for setup.py (benchmarks/build.sh compiles the extension sources
+ * and libraries with the same flags, without the Python binding):
+ *
+ *     benchmarks/build.sh bench_decoder
+ *     ./bench_decoder [--vocab=29] [--frames=2000] [--beam=100] \
+ *         [--cutoff_top_n=40] [--peak=6] [--blank=0.6] [--seed=1] \
+ *         [--batch=16] [--min_seconds=0.5] \
+ *         [--lm=tests/test.arpa|generate|PATH] [--lm_words=20000]
+ *
+ * Output is one tab-separated row per benchmark (and number of threads):
+ * benchmark, vocab, beam, threads, frames, seconds, frames_per_sec,
+ * ns_per_frame_beam. seconds is the time of one run over frames frames.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "ctc_beam_search_decoder.h"
+#include "decoder_utils.h"
+#include "path_trie.h"
+#include "scorer.h"
+
+namespace {
+
+struct Options {
+  size_t vocab = 29;
+  size_t frames = 2000;
+  size_t beam = 100;
+  size_t cutoff_top_n = 40;
+  double peak = 6.0;
+  double blank = 0.6;
+  unsigned seed = 1;
+  size_t batch = 16;
+  double min_seconds = 0.5;
+  std::string lm = "tests/test.arpa";
+  size_t lm_words = 20000;
+};
+
+const size_t BLANK_ID = 0;
+const size_t NUM_NGRAMS = 1 << 14;
+
+// keeps the compiler from dropping the results
+volatile double sink;
+
+bool parse_option(const char *arg, Options *options) {
+  std::string s(arg);
+  size_t eq = s.find('=');
+  if (s.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+    return false;
+  }
+  std::string key = s.substr(2, eq - 2), value = s.substr(eq + 1);
+  if (key == "vocab") options->vocab = std::stoul(value);
+  else if (key == "frames") options->frames = std::stoul(value);
+  else if (key == "beam") options->beam = std::stoul(value);
+  else if (key == "cutoff_top_n") options->cutoff_top_n = std::stoul(value);
+  else if (key == "peak") options->peak = std::stod(value);
+  else if (key == "blank") options->blank = std::stod(value);
+  else if (key == "seed") options->seed = std::stoul(value);
+  else if (key == "batch") options->batch = std::stoul(value);
+  else if (key == "min_seconds") options->min_seconds = std::stod(value);
+  else if (key == "lm") options->lm = value;
+  else if (key == "lm_words") options->lm_words = std::stoul(value);
+  else return false;
+  return true;
+}
+
+// blank, space, apostrophe and letters, then made up labels
+std::vector<std::string> make_vocabulary(size_t size) {
+  std::vector<std::string> vocabulary = {"_", " ", "'"};
+  for (char c = 'a'; c <= 'z'; ++c) {
+    vocabulary.push_back(std::string(1, c));
+  }
+  for (size_t i = vocabulary.size(); i < size; ++i) {
+    vocabulary.push_back("#" + std::to_string(i));
+  }
+  vocabulary.resize(size);
+  return vocabulary;
+}
+
+// num_frames x vocab_size log probabilities, row after row
+std::vector<float> synthetic_logits(const Options &options, size_t num_frames,
+                                    unsigned seed) {
+  std::mt19937 rng(seed);
+  std::normal_distribution<double> noise(0.0, 1.0);
+  std::bernoulli_distribution is_blank(options.blank);
+  std::uniform_int_distribution<size_t> label(1, options.vocab - 1);
+
+  std::vector<float> logits(num_frames * options.vocab);
+  std::vector<double> frame(options.vocab);
+  for (size_t t = 0; t < num_frames; ++t) {
+    for (auto &x : frame) x = noise(rng);
+    frame[is_blank(rng) ? BLANK_ID : label(rng)] += options.peak;
+    double max_x = *std::max_element(frame.begin(), frame.end());
+    double sum = 0.0;
+    for (auto x : frame) sum += std::exp(x - max_x);
+    for (size_t v = 0; v < options.vocab; ++v) {
+      logits[t * options.vocab + v] = frame[v] - max_x - std::log(sum);
+    }
+  }
+  return logits;
+}
+
+ProbsView view_of(const std::vector<float> &logits, size_t vocab_size) {
+  ProbsView view;
+  view.data = logits.data();
+  view.num_time_steps = logits.size() / vocab_size;
+  view.vocab_size = vocab_size;
+  view.time_stride = vocab_size;
+  view.vocab_stride = 1;
+  return view;
+}
+
+// random word ARPA of up to trigrams over the letters, whose n-grams all
+// have their prefix and suffix (n-1)-grams as KenLM expects
+std::string generate_arpa(size_t num_words, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> length(2, 8), letter(0, 25);
+  std::uniform_real_distribution<double> log_prob(-5.0, -1.0),
+      backoff(-1.0, 0.0);
+
+  std::set<std::string> unique;
+  while (unique.size() < num_words) {
+    std::string word(length(rng), 'a');
+    for (auto &c : word) c = 'a' + letter(rng);
+    unique.insert(word);
+  }
+  std::vector<std::string> words(unique.begin(), unique.end());
+  std::uniform_int_distribution<size_t> any_word(0, words.size() - 1);
+
+  std::set<std::pair<size_t, size_t>> bigrams;
+  while (bigrams.size() < 4 * num_words) {
+    bigrams.emplace(any_word(rng), any_word(rng));
+  }
+  std::vector<std::vector<size_t>> successors(words.size());
+  for (const auto &bigram : bigrams) {
+    successors[bigram.first].push_back(bigram.second);
+  }
+  std::vector<std::pair<size_t, size_t>> bigram_list(bigrams.begin(),
+                                                     bigrams.end());
+  std::set<std::vector<size_t>> trigrams;
+  for (size_t tries = 0; tries < 4 * num_words; ++tries) {
+    const auto &bigram = bigram_list[rng() % bigram_list.size()];
+    const auto &next = successors[bigram.second];
+    if (!next.empty()) {
+      trigrams.insert({bigram.first, bigram.second, next[rng() % next.size()]});
+    }
+  }
+
+  char path[] = "/tmp/bench_decoder_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return "";
+  }
+  close(fd);
+  std::ofstream out(path);
+  out << "\\data\\\n"
+      << "ngram 1=" << words.size() + 3 << "\n"
+      << "ngram 2=" << bigrams.size() << "\n"
+      << "ngram 3=" << trigrams.size() << "\n\n\\1-grams:\n"
+      << "-1.0\t</s>\n-99\t<s>\t-0.5\n-6.0\t<unk>\t0\n";
+  for (const auto &word : words) {
+    out << log_prob(rng) << "\t" << word << "\t" << backoff(rng) << "\n";
+  }
+  out << "\n\\2-grams:\n";
+  for (const auto &bigram : bigrams) {
+    out << log_prob(rng) << "\t" << words[bigram.first] << " "
+        << words[bigram.second] << "\t" << backoff(rng) << "\n";
+  }
+  out << "\n\\3-grams:\n";
+  for (const auto &trigram : trigrams) {
+    out << log_prob(rng) << "\t" << words[trigram[0]] << " "
+        << words[trigram[1]] << " " << words[trigram[2]] << "\n";
+  }
+  out << "\n\\end\\\n";
+  return path;
+}
+
+// the words of the 1-grams of an ARPA file, none for a binary model
+std::vector<std::string> arpa_words(const std::string &path) {
+  std::vector<std::string> words;
+  std::ifstream in(path);
+  std::string line;
+  bool in_unigrams = false;
+  while (std::getline(in, line)) {
+    if (line == "\\1-grams:") {
+      in_unigrams = true;
+    } else if (in_unigrams) {
+      if (line.empty() || line[0] == '\\') break;
+      std::istringstream fields(line);
+      std::string log_prob, word;
+      fields >> log_prob >> word;
+      if (word != "<s>" && word != "</s>" && word != "<unk>") {
+        words.push_back(word);
+      }
+    }
+  }
+  return words;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// seconds per call of run, repeated for at least min_seconds after a warm up
+// call; setup runs untimed before each call
+double time_per_run(double min_seconds, const std::function<void()> &setup,
+                    const std::function<void()> &run) {
+  setup();
+  run();
+  double total = 0.0;
+  int runs = 0;
+  do {
+    setup();
+    auto start = std::chrono::steady_clock::now();
+    run();
+    total += seconds_since(start);
+    ++runs;
+  } while (total < min_seconds);
+  return total / runs;
+}
+
+void report(const char *name, const Options &options, size_t beam,
+            size_t threads, size_t frames, double seconds) {
+  std::printf("%s\t%zu\t%zu\t%zu\t%zu\t%.6f\t%.1f\t%.2f\n", name,
+              options.vocab, beam, threads, frames, seconds, frames / seconds,
+              seconds * 1e9 / (static_cast<double>(frames) * beam));
+  std::fflush(stdout);
+}
+
+void bench_prune(const Options &options, const std::vector<float> &logits) {
+  ProbsView view = view_of(logits, options.vocab);
+  double seconds = time_per_run(options.min_seconds, [] {}, [&] {
+    size_t kept = 0;
+    for (size_t t = 0; t < view.num_time_steps; ++t) {
+      kept += get_pruned_log_probs(view.frame(t), view.vocab_size,
+                                   view.vocab_stride, 1.0,
+                                   options.cutoff_top_n, 1)
+                  .size();
+    }
+    sink = kept;
+  });
+  report("prune", options, 1, 1, view.num_time_steps, seconds);
+}
+
+void bench_trie(const Options &options, const std::vector<float> &logits) {
+  ProbsView view = view_of(logits, options.vocab);
+  // pruned once upfront, it is timed on its own above
+  std::vector<std::vector<std::pair<size_t, float>>> pruned;
+  for (size_t t = 0; t < view.num_time_steps; ++t) {
+    pruned.push_back(get_pruned_log_probs(view.frame(t), view.vocab_size,
+                                          view.vocab_stride, 1.0,
+                                          options.cutoff_top_n, 1));
+  }
+
+  double seconds = time_per_run(options.min_seconds, [] {}, [&] {
+    PathTriePool pool;
+    PathTrie root;
+    root.set_pool(&pool);
+    root.score = root.log_prob_b_prev = 0.0;
+    std::vector<PathTrie *> prefixes(1, &root);
+    for (size_t t = 0; t < pruned.size(); ++t) {
+      for (PathTrie *prefix : prefixes) {
+        for (const auto &label : pruned[t]) {
+          float log_prob = prefix->score + label.second;
+          if (label.first == BLANK_ID) {
+            prefix->log_prob_b_cur = log_prob;
+            continue;
+          }
+          PathTrie *child = prefix->get_path_trie(label.first, t, label.second);
+          if (child != nullptr) {
+            child->log_prob_nb_cur =
+                std::max(child->log_prob_nb_cur, log_prob);
+          }
+        }
+      }
+      prefixes.clear();
+      root.iterate_to_vec(prefixes);
+      if (prefixes.size() > options.beam) {
+        std::nth_element(prefixes.begin(), prefixes.begin() + options.beam,
+                         prefixes.end(), [](PathTrie *a, PathTrie *b) {
+                           return a->score > b->score;
+                         });
+        for (size_t i = options.beam; i < prefixes.size(); ++i) {
+          prefixes[i]->remove();
+        }
+        prefixes.resize(options.beam);
+      }
+    }
+    sink = prefixes.size();
+  });
+  report("trie", options, options.beam, 1, view.num_time_steps, seconds);
+}
+
+void bench_lm_query(const Options &options, Scorer *scorer,
+                    const std::vector<std::string> &words) {
+  if (words.empty()) {
+    return;
+  }
+  std::mt19937 rng(options.seed);
+  std::vector<std::vector<std::string>> ngrams(NUM_NGRAMS);
+  for (auto &ngram : ngrams) {
+    for (size_t i = 0; i < scorer->get_max_order(); ++i) {
+      ngram.push_back(words[rng() % words.size()]);
+    }
+  }
+  double seconds = time_per_run(options.min_seconds, [] {}, [&] {
+    double total = 0.0;
+    size_t num_queries = options.frames * options.beam;
+    for (size_t i = 0; i < num_queries; ++i) {
+      total += scorer->get_log_cond_prob(ngrams[i % ngrams.size()]);
+    }
+    sink = total;
+  });
+  report("lm_query", options, options.beam, 1, options.frames, seconds);
+}
+
+void bench_state(const Options &options, const std::vector<float> &logits,
+                 const std::vector<std::string> &vocabulary, Scorer *scorer) {
+  ProbsView view = view_of(logits, options.vocab);
+  auto config = std::make_shared<const DecoderConfig>(
+      vocabulary, options.beam, 1.0, options.cutoff_top_n, BLANK_ID, 1,
+      scorer);
+  std::unique_ptr<DecoderState> state;
+  auto fresh_state = [&] { state.reset(new DecoderState(config)); };
+
+  double next_seconds =
+      time_per_run(options.min_seconds, fresh_state, [&] { state->next(view); });
+  report(scorer != nullptr ? "next_lm" : "next", options, options.beam, 1,
+         view.num_time_steps, next_seconds);
+
+  fresh_state();
+  state->next(view);
+  double decode_seconds = time_per_run(options.min_seconds, [] {}, [&] {
+    sink = state->decode().size();
+  });
+  report(scorer != nullptr ? "decode_lm" : "decode", options, options.beam, 1,
+         view.num_time_steps, decode_seconds);
+}
+
+void bench_batch(const Options &options,
+                 const std::vector<std::string> &vocabulary) {
+  std::vector<std::vector<float>> items;
+  std::vector<ProbsView> views;
+  for (size_t i = 0; i < options.batch; ++i) {
+    items.push_back(synthetic_logits(options, options.frames,
+                                     options.seed + 1 + i));
+  }
+  for (const auto &item : items) {
+    views.push_back(view_of(item, options.vocab));
+  }
+
+  size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<size_t> thread_counts;
+  for (size_t n = 1; n < max_threads; n *= 2) {
+    thread_counts.push_back(n);
+  }
+  thread_counts.push_back(max_threads);
+  for (size_t num_processes : thread_counts) {
+    double seconds = time_per_run(options.min_seconds, [] {}, [&] {
+      sink = ctc_beam_search_decoder_batch(views, vocabulary, options.beam,
+                                           num_processes, 1.0,
+                                           options.cutoff_top_n, BLANK_ID, 1)
+                 .size();
+    });
+    report("batch", options, options.beam, num_processes,
+           options.batch * options.frames, seconds);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    if (!parse_option(argv[i], &options)) {
+      std::fprintf(stderr, "unknown option %s, see the top of %s\n", argv[i],
+                   __FILE__);
+      return 1;
+    }
+  }
+  if (options.vocab < 2 || options.frames == 0 || options.beam == 0) {
+    std::fprintf(stderr, "vocab must be at least 2, frames and beam positive\n");
+    return 1;
+  }
+
+  std::string lm_path = options.lm;
+  if (lm_path == "generate") {
+    lm_path = generate_arpa(options.lm_words, options.seed);
+    if (lm_path.empty()) {
+      std::fprintf(stderr, "could not write a temporary ARPA file\n");
+      return 1;
+    }
+  }
+  std::vector<std::string> vocabulary = make_vocabulary(options.vocab);
+  std::vector<float> logits =
+      synthetic_logits(options, options.frames, options.seed);
+
+  std::printf(
+      "benchmark\tvocab\tbeam\tthreads\tframes\tseconds\tframes_per_sec\t"
+      "ns_per_frame_beam\n");
+  bench_prune(options, logits);
+  bench_trie(options, logits);
+  bench_state(options, logits, vocabulary, nullptr);
+  {
+    Scorer scorer(0.5, 1.0, lm_path, vocabulary);
+    bench_lm_query(options, &scorer, arpa_words(lm_path));
+    bench_state(options, logits, vocabulary, &scorer);
+  }
+  bench_batch(options, vocabulary);
+
+  if (options.lm == "generate") {
+    std::remove(lm_path.c_str());
+  }
+  return 0;
+}
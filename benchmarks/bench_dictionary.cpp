@@ -0,0 +1,187 @@
+/* Cost of a spelling check in PathTrie: CompactDictionary against the
+ * SortedMatcher over the dictionary fst it replaced.
+ *
+ * Builds a dictionary the way Scorer::fill_dictionary does from random words
+ * (each followed by a space), timed against the determinize and minimize
+ * construction it replaced, then replays lookups of (state, label) pairs
+ * collected on random walks through it, half of them along an arc and half
+ * off the dictionary. A lookup finds the arc and tests whether its next state
+ * is final, as get_path_trie does. Rows cover a character vocabulary, where
+ * the per-state label masks apply, and a large wordpiece-like one, where
+ * arcs are binary searched. Build and run from the repository root, with the
+ * third party sources in place as for setup.py:
+ *
+ *     g++ -O3 -std=c++14 -I ctcdecode/src \
+ *         -I third_party/openfst-1.6.7/src/include \
+ *         ctcdecode/src/compact_dictionary.cpp \
+ *         ctcdecode/src/dictionary_builder.cpp \
+ *         $(find third_party/openfst-1.6.7/src/lib -name '*.cc') \
+ *         benchmarks/bench_dictionary.cpp -o bench_dictionary -lpthread
+ *     ./bench_dictionary
+ *
+ * Output is one tab-separated row per vocabulary: labels, words, states,
+ * arcs, compact_bytes, fst_build_ms, build_ms, matcher_ns, compact_ns.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "compact_dictionary.h"
+#include "dictionary_builder.h"
+#include "fst/fstlib.h"
+
+namespace {
+
+const size_t NUM_WORDS = 50000;
+const size_t NUM_QUERIES = 1 << 16;
+const size_t NUM_LOOKUPS = 1 << 23;
+
+// keeps the compiler from dropping the lookups
+volatile long sink;
+
+// random words over labels 1 to num_labels - 1, each ending with the space
+// label num_labels
+std::vector<std::vector<int>> random_words(int num_labels, std::mt19937 *rng) {
+  std::uniform_int_distribution<int> length(2, 10);
+  // skewed towards small labels, like letter frequencies
+  std::geometric_distribution<int> label(8.0 / num_labels);
+
+  std::vector<std::vector<int>> words(NUM_WORDS);
+  for (auto &word : words) {
+    int n = length(*rng);
+    for (int i = 0; i < n; ++i) {
+      word.push_back(1 + label(*rng) % (num_labels - 1));
+    }
+    word.push_back(num_labels);
+  }
+  return words;
+}
+
+double ms_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// the dictionary built the way Scorer::fill_dictionary does, storing the
+// time taken in build_ms
+fst::StdVectorFst build_dictionary(std::vector<std::vector<int>> words,
+                                   double *build_ms) {
+  auto start = std::chrono::steady_clock::now();
+  std::sort(words.begin(), words.end());
+  DictionaryBuilder builder;
+  for (const auto &word : words) {
+    builder.add(word);
+  }
+  fst::StdVectorFst dictionary;
+  builder.finish(&dictionary);
+  *build_ms = ms_since(start);
+  return dictionary;
+}
+
+// the same dictionary from one chain per word, determinized and minimized,
+// as it used to be built
+double fst_build_ms(const std::vector<std::vector<int>> &words) {
+  auto start = std::chrono::steady_clock::now();
+  fst::StdVectorFst chains;
+  chains.AddState();
+  chains.SetStart(0);
+  for (const auto &word : words) {
+    int state = chains.Start();
+    for (int l : word) {
+      int next = chains.AddState();
+      chains.AddArc(state, fst::StdArc(l, l, 0, next));
+      state = next;
+    }
+    chains.SetFinal(state, fst::TropicalWeight::One());
+  }
+  fst::StdVectorFst dictionary;
+  fst::Determinize(chains, &dictionary);
+  fst::Minimize(&dictionary);
+  return ms_since(start);
+}
+
+// (state, label) lookups from random walks, half of them along an arc
+std::vector<std::pair<int, int>> collect_queries(
+    const fst::StdVectorFst &dictionary, int num_labels, std::mt19937 *rng) {
+  std::uniform_int_distribution<int> any_label(1, num_labels);
+  std::vector<std::pair<int, int>> queries;
+  int state = dictionary.Start();
+  while (queries.size() < NUM_QUERIES) {
+    std::vector<fst::StdArc> arcs;
+    for (fst::ArcIterator<fst::StdVectorFst> aiter(dictionary, state);
+         !aiter.Done(); aiter.Next()) {
+      arcs.push_back(aiter.Value());
+    }
+    if (arcs.empty()) {
+      state = dictionary.Start();
+      continue;
+    }
+    // a label missing from the state, if any
+    int absent = any_label(*rng);
+    queries.emplace_back(state, absent);
+
+    const fst::StdArc &arc = arcs[(*rng)() % arcs.size()];
+    queries.emplace_back(state, arc.ilabel);
+    state = arc.ilabel == num_labels ? dictionary.Start() : arc.nextstate;
+  }
+  return queries;
+}
+
+template <typename Lookup>
+double ns_per_lookup(const std::vector<std::pair<int, int>> &queries,
+                     Lookup lookup) {
+  long found = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < NUM_LOOKUPS; ++i) {
+    const auto &query = queries[i % queries.size()];
+    found += lookup(query.first, query.second);
+  }
+  auto end = std::chrono::steady_clock::now();
+  sink = found;
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         NUM_LOOKUPS;
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng(42);
+  std::printf(
+      "labels\twords\tstates\tarcs\tcompact_bytes\tfst_build_ms\tbuild_ms\t"
+      "matcher_ns\tcompact_ns\n");
+  for (int num_labels : {29, 2000}) {
+    std::vector<std::vector<int>> words = random_words(num_labels, &rng);
+    double build_ms;
+    fst::StdVectorFst dictionary = build_dictionary(words, &build_ms);
+    double old_build_ms = fst_build_ms(words);
+    CompactDictionary compact(dictionary);
+    std::vector<std::pair<int, int>> queries =
+        collect_queries(dictionary, num_labels, &rng);
+
+    fst::SortedMatcher<fst::StdVectorFst> matcher(dictionary,
+                                                  fst::MATCH_INPUT);
+    const auto zero = fst::TropicalWeight::Zero();
+    double matcher_ns = ns_per_lookup(queries, [&](int state, int label) {
+      matcher.SetState(state);
+      if (!matcher.Find(label)) return 0;
+      const fst::StdArc &arc = matcher.Value();
+      return 1 + (dictionary.Final(arc.nextstate) != zero) +
+             static_cast<int>(arc.weight.Value());
+    });
+    double compact_ns = ns_per_lookup(queries, [&](int state, int label) {
+      int next_state, weight;
+      if (!compact.find(state, label, &next_state, &weight)) return 0;
+      return 1 + compact.is_final(next_state) + weight;
+    });
+
+    std::printf("%d\t%zu\t%zu\t%zu\t%zu\t%.1f\t%.1f\t%.2f\t%.2f\n", num_labels,
+                NUM_WORDS, compact.num_states(), compact.num_arcs(),
+                compact.memory_size(), old_build_ms, build_ms, matcher_ns,
+                compact_ns);
+  }
+  return 0;
+}
@@ -0,0 +1,157 @@
+/* Accuracy and speed of the fast log-add against the exact one.
+ *
+ * First compares log_sum_exp and fast_log_sum_exp on random pairs of log
+ * probabilities, then decodes the same logits with LOG_ADD_EXACT and
+ * LOG_ADD_FAST and reports time, agreement of the best beam and the largest
+ * score difference. Logits are read from a text file with one frame per line
+ * (whitespace-separated log probabilities, e.g. saved with numpy.savetxt from
+ * a model's log_softmax output); without a file, seeded synthetic frames are
+ * used. Build and run from the repository root, with the third party sources
+ * in place as for setup.py:
+ *
+ *     benchmarks/build.sh bench_log_add
+ *     ./bench_log_add [logits.txt]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ctc_beam_search_decoder.h"
+#include "decoder_utils.h"
+
+namespace {
+
+const size_t NUM_PAIRS = 1 << 20;
+const size_t NUM_TIME_STEPS = 500;
+const size_t VOCAB_SIZE = 29;
+const size_t BEAM_SIZE = 100;
+const int NUM_REPEATS = 5;
+
+// keeps the compiler from dropping the results
+volatile float sink;
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+std::vector<std::vector<double>> read_logits(const char *path) {
+  std::vector<std::vector<double>> frames;
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::vector<double> frame;
+    double value;
+    while (fields >> value) frame.push_back(value);
+    if (!frame.empty()) frames.push_back(frame);
+  }
+  return frames;
+}
+
+// log_softmax of random logits, peaked on blank and a few labels per frame
+std::vector<std::vector<double>> synthetic_logits() {
+  std::mt19937 rng(7);
+  std::normal_distribution<double> noise(0.0, 2.0);
+  std::uniform_int_distribution<size_t> label(0, VOCAB_SIZE - 1);
+  std::vector<std::vector<double>> frames(NUM_TIME_STEPS);
+  for (auto &frame : frames) {
+    frame.resize(VOCAB_SIZE);
+    for (auto &x : frame) x = noise(rng);
+    frame[0] += 4.0;
+    frame[label(rng)] += 4.0;
+    double max_x = *std::max_element(frame.begin(), frame.end());
+    double sum = 0.0;
+    for (auto x : frame) sum += std::exp(x - max_x);
+    for (auto &x : frame) x -= max_x + std::log(sum);
+  }
+  return frames;
+}
+
+void report_pairs() {
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> log_prob(-40.0f, 0.0f);
+  std::vector<float> x(NUM_PAIRS), y(NUM_PAIRS), out(NUM_PAIRS);
+  for (size_t i = 0; i < NUM_PAIRS; ++i) {
+    x[i] = log_prob(rng);
+    y[i] = log_prob(rng);
+  }
+
+  double max_err = 0.0, sum_err = 0.0;
+  for (size_t i = 0; i < NUM_PAIRS; ++i) {
+    // against the float result LOG_ADD_EXACT computes
+    double err = std::fabs(fast_log_sum_exp(x[i], y[i]) - log_sum_exp(x[i], y[i]));
+    max_err = std::max(max_err, err);
+    sum_err += err;
+  }
+
+  std::printf("pairs\tmode\tns_per_op\tmax_abs_err\tmean_abs_err\n");
+  const char *names[] = {"exact", "fast"};
+  for (LogAddMode mode : {LOG_ADD_EXACT, LOG_ADD_FAST}) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < NUM_REPEATS; ++r) {
+      log_sum_exp_batch(x.data(), y.data(), out.data(), NUM_PAIRS, mode);
+    }
+    double ns = elapsed_ms(start) * 1e6 / (NUM_REPEATS * NUM_PAIRS);
+    sink = out[NUM_PAIRS / 2];
+    if (mode == LOG_ADD_EXACT) {
+      std::printf("pairs\t%s\t%.3f\t-\t-\n", names[mode], ns);
+    } else {
+      std::printf("pairs\t%s\t%.3f\t%.3g\t%.3g\n",
+                  names[mode], ns, max_err, sum_err / NUM_PAIRS);
+    }
+  }
+}
+
+void report_decode(const std::vector<std::vector<double>> &frames) {
+  std::vector<std::string> vocabulary;
+  for (size_t i = 0; i < frames[0].size(); ++i) {
+    vocabulary.push_back(std::string(1, char('a' + i % 26)));
+  }
+
+  std::vector<std::pair<double, Output>> results[2];
+  double ms[2];
+  for (LogAddMode mode : {LOG_ADD_EXACT, LOG_ADD_FAST}) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < NUM_REPEATS; ++r) {
+      results[mode] = ctc_beam_search_decoder(
+          frames, vocabulary, BEAM_SIZE, 1.0, 40, 0, 1, nullptr, mode);
+    }
+    ms[mode] = elapsed_ms(start) / NUM_REPEATS;
+  }
+
+  const auto &exact = results[LOG_ADD_EXACT];
+  const auto &fast = results[LOG_ADD_FAST];
+  bool same_best = !exact.empty() && !fast.empty() &&
+                   exact[0].second.tokens == fast[0].second.tokens;
+  double max_score_diff = 0.0;
+  for (size_t i = 0; i < std::min(exact.size(), fast.size()); ++i) {
+    max_score_diff =
+        std::max(max_score_diff, std::fabs(exact[i].first - fast[i].first));
+  }
+
+  std::printf("\ndecode\ttime_steps\texact_ms\tfast_ms\tsame_best\tmax_score_diff\n");
+  std::printf("decode\t%zu\t%.2f\t%.2f\t%d\t%.3g\n", frames.size(),
+              ms[LOG_ADD_EXACT], ms[LOG_ADD_FAST], same_best, max_score_diff);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::vector<std::vector<double>> frames =
+      argc > 1 ? read_logits(argv[1]) : synthetic_logits();
+  if (frames.empty()) {
+    std::fprintf(stderr, "no logits read from %s\n", argv[1]);
+    return 1;
+  }
+  report_pairs();
+  report_decode(frames);
+  return 0;
+}
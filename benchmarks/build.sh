@@ -0,0 +1,62 @@
+#!/bin/bash
+# Builds a benchmark with the sources and flags setup.py uses for the
+# extension. Run from the repository root, with the third party sources in
+# place as for setup.py:
+#
+#     benchmarks/build.sh bench_decoder && ./bench_decoder
+#
+# Extra arguments are passed on to g++ after the defaults, e.g. -O2 or -g.
+set -e
+
+name=${1:?usage: benchmarks/build.sh BENCHMARK [G++ ARGS...]}
+name=$(basename "$name" .cpp)
+shift
+
+compile_args=(-O3 -DKENLM_MAX_ORDER=6 -std=c++14 -DINCLUDE_KENLM)
+ext_libs=()
+
+# Does gcc compile with this header and library?
+compile_test() {
+  g++ -include "$1" -l"$2" -x c++ - <<<'int main() {}' -o /dev/null \
+    >/dev/null 2>&1
+}
+
+if compile_test zlib.h z; then
+  compile_args+=(-DHAVE_ZLIB)
+  ext_libs+=(-lz)
+fi
+if compile_test bzlib.h bz2; then
+  compile_args+=(-DHAVE_BZLIB)
+  ext_libs+=(-lbz2)
+fi
+if compile_test lzma.h lzma; then
+  compile_args+=(-DHAVE_XZLIB)
+  ext_libs+=(-llzma)
+fi
+
+include_dirs=()
+for lib in kenlm openfst-1.6.7/src/include ThreadPool boost_1_67_0 utf8; do
+  include_dirs+=(-I "third_party/$lib")
+done
+
+shopt -s nullglob
+lib_sources=()
+for source in third_party/kenlm/util/*.cc third_party/kenlm/lm/*.cc \
+              third_party/kenlm/util/double-conversion/*.cc \
+              third_party/openfst-1.6.7/src/lib/*.cc; do
+  case "$source" in
+    *main.cc | *test.cc) ;;
+    *) lib_sources+=("$source") ;;
+  esac
+done
+
+ctc_sources=()
+for source in ctcdecode/src/*.cpp; do
+  if [ "$source" != ctcdecode/src/binding.cpp ]; then
+    ctc_sources+=("$source")
+  fi
+done
+
+exec g++ "${compile_args[@]}" "$@" -I ctcdecode/src "${include_dirs[@]}" \
+  "${ctc_sources[@]}" "${lib_sources[@]}" "benchmarks/$name.cpp" \
+  -o "$name" -lpthread "${ext_libs[@]}"
@@ -3,6 +3,92 @@ import torch
 from ._ext import ctc_decode
 
 
+# util::LoadMethod values of KenLM, by the name the decoders take
+_LM_LOAD_METHODS = {"lazy": 0, "populate": 1, "populate_or_read": 2, "read": 3, "parallel_read": 4}
+
+
+def _lm_load_method(name):
+    if name not in _LM_LOAD_METHODS:
+        raise ValueError("lm_load_method must be one of {}, got {!r}".format(sorted(_LM_LOAD_METHODS), name))
+    return _LM_LOAD_METHODS[name]
+
+
+def _lm_cache_stats(scorer):
+    """
+    Counters of the language model query cache of a scorer: hits, misses, evictions and capacity (in entries).
+    All zero if the cache is disabled.
+    """
+    hits, misses, evictions, capacity = ctc_decode.get_lm_cache_stats(scorer)
+    return {"hits": hits, "misses": misses, "evictions": evictions, "capacity": capacity}
+
+
+def _dictionary_stats(scorer):
+    """
+    How the spelling dictionary of a scorer with a word based LM was set up: the seconds spent building it (or
+    loading it from the dictionary cache), whether it came from the cache, and its numbers of states and arcs.
+    All zero for a character based LM.
+    """
+    seconds, from_cache, num_states, num_arcs = ctc_decode.get_dictionary_stats(scorer)
+    return {"seconds": seconds, "from_cache": from_cache, "num_states": num_states, "num_arcs": num_arcs}
+
+
+def num_loaded_lms():
+    """
+    Number of language models the decoders of the process have loaded and still use. Decoders of the same LM file
+    and lm_load_method share one loaded model, which is freed with the last of them.
+    """
+    return ctc_decode.get_num_loaded_lms()
+
+
+def _decode_pool_timing(pool):
+    """
+    Wall clock timing in seconds of the last batch a decoding pool ran for decode: its makespan, the ideal makespan
+    (the larger of the summed item decoding times spread evenly over the threads and the longest item) and the
+    summed item decoding time, with the number of items.
+    """
+    makespan, ideal_makespan, busy, num_items = ctc_decode.get_decode_pool_timing(pool)
+    return {"makespan": makespan, "ideal_makespan": ideal_makespan, "busy": busy, "num_items": num_items}
+
+
+class DecodeFuture(object):
+    """
+    Handle of a batch decoding in the background on a decoder's workers, returned by decode_async.
+    It keeps the decoder (and decoding states) it uses alive until it is done.
+    """
+
+    def __init__(self, job, collect, keep_alive):
+        self._job = job
+        self._collect = collect
+        self._keep_alive = keep_alive
+        self._result = None
+
+    def done(self):
+        """
+        Whether the batch has finished decoding, so that result returns without waiting.
+        """
+        return self._result is not None or bool(ctc_decode.is_decode_job_done(self._job))
+
+    def result(self):
+        """
+        Wait for the batch to finish decoding, without holding the GIL, and return what the synchronous decode
+        call would have.
+        """
+        if self._result is None:
+            ctc_decode.wait_decode_job(self._job)
+            self._result = self._collect(self._job)
+        return self._result
+
+    def __del__(self):
+        if getattr(self, "_job", None) is not None:
+            ctc_decode.release_decode_job(self._job)
+
+
+def _seq_lens(probs, seq_lens):
+    if seq_lens is None:
+        return torch.IntTensor(probs.size(0)).fill_(probs.size(1))
+    return seq_lens.cpu().int()
+
+
 class CTCBeamDecoder(object):
     """
     PyTorch wrapper for DeepSpeech PaddlePaddle Beam Search Decoder.
@@ -18,9 +104,24 @@ class CTCBeamDecoder(object):
         cutoff_prob (float): Cutoff probability in pruning. 1.0 means no pruning.
         beam_width (int): This controls how broad the beam search is. Higher values are more likely to find top beams,
                             but they also will make your beam search exponentially slower.
-        num_processes (int): Parallelize the batch using num_processes workers.
+        num_processes (int): Parallelize the batch using num_processes workers. The workers are started once and
+                            reused by every call to decode, see set_num_processes.
         blank_id (int): Index of the CTC blank token (probably 0) used when training your model.
         log_probs_input (bool): False if your model has passed through a softmax and output probabilities sum to 1.
+        fast_log_add (bool): Use a table-based approximation of log-add (absolute error of a few 1e-6) instead of
+                            exact exp/log. Faster, with scores that can differ slightly from the exact ones.
+        blank_skip_threshold (float): Frames whose blank probability is above this value only extend every beam
+                            with a blank, skipping pruning and beam expansion. 1.0 means no skipping.
+        lm_cache_mb (float): Memory cap in megabytes of a cache of language model queries shared by all decoding
+                            threads. 0 disables the cache.
+        dictionary_cache_dir (basestring): Directory where the spelling dictionary built from a word based LM is
+                            saved, keyed by the LM vocabulary and the labels, and loaded from on later runs instead
+                            of being rebuilt. None always builds it.
+        lm_load_method (str): How a binary KenLM model is loaded: "lazy" maps it and reads pages on use,
+                            "populate" maps it and reads it all upfront, "read" copies it into the process.
+                            Mapped models are shared through the page cache by processes using the same file.
+                            Within a process, decoders of the same file and load method share one loaded model,
+                            see num_loaded_lms. Also "populate_or_read" (KenLM's default) and "parallel_read".
     """
 
     def __init__(
@@ -35,20 +136,36 @@ class CTCBeamDecoder(object):
         num_processes=4,
         blank_id=0,
         log_probs_input=False,
+        fast_log_add=False,
+        blank_skip_threshold=1.0,
+        lm_cache_mb=0,
+        dictionary_cache_dir=None,
+        lm_load_method="populate_or_read",
     ):
         self.cutoff_top_n = cutoff_top_n
         self._beam_width = beam_width
         self._scorer = None
-        self._num_processes = num_processes
+        self._pool = ctc_decode.create_decode_pool(num_processes)
         self._labels = list(labels)  # Ensure labels are a list
         self._num_labels = len(labels)
         self._blank_id = blank_id
         self._log_probs = 1 if log_probs_input else 0
+        self._log_add_mode = 1 if fast_log_add else 0
+        self._blank_skip_threshold = blank_skip_threshold
         if model_path:
             self._scorer = ctc_decode.paddle_get_scorer(
-                alpha, beta, model_path.encode(), self._labels, self._num_labels
+                alpha,
+                beta,
+                model_path.encode(),
+                self._labels,
+                self._num_labels,
+                (dictionary_cache_dir or "").encode(),
+                _lm_load_method(lm_load_method),
             )
+            if lm_cache_mb > 0:
+                ctc_decode.set_lm_cache(self._scorer, int(lm_cache_mb * 2 ** 20))
         self._cutoff_prob = cutoff_prob
+        self._num_skipped_frames = None
 
     def decode(self, probs, seq_lens=None):
         """
@@ -76,14 +193,12 @@ class CTCBeamDecoder(object):
         """
         probs = probs.cpu().float()
         batch_size, max_seq_len = probs.size(0), probs.size(1)
-        if seq_lens is None:
-            seq_lens = torch.IntTensor(batch_size).fill_(max_seq_len)
-        else:
-            seq_lens = seq_lens.cpu().int()
+        seq_lens = _seq_lens(probs, seq_lens)
         output = torch.IntTensor(batch_size, self._beam_width, max_seq_len).cpu().int()
         timesteps = torch.IntTensor(batch_size, self._beam_width, max_seq_len).cpu().int()
         scores = torch.FloatTensor(batch_size, self._beam_width).cpu().float()
         out_seq_len = torch.zeros(batch_size, self._beam_width).cpu().int()
+        num_skipped_frames = torch.zeros(batch_size).cpu().int()
         if self._scorer:
             ctc_decode.paddle_beam_decode_lm(
                 probs,
@@ -91,16 +206,19 @@ class CTCBeamDecoder(object):
                 self._labels,
                 self._num_labels,
                 self._beam_width,
-                self._num_processes,
+                self._pool,
                 self._cutoff_prob,
                 self.cutoff_top_n,
                 self._blank_id,
                 self._log_probs,
                 self._scorer,
+                self._log_add_mode,
+                self._blank_skip_threshold,
                 output,
                 timesteps,
                 scores,
                 out_seq_len,
+                num_skipped_frames,
             )
         else:
             ctc_decode.paddle_beam_decode(
@@ -109,19 +227,115 @@ class CTCBeamDecoder(object):
                 self._labels,
                 self._num_labels,
                 self._beam_width,
-                self._num_processes,
+                self._pool,
                 self._cutoff_prob,
                 self.cutoff_top_n,
                 self._blank_id,
                 self._log_probs,
+                self._log_add_mode,
+                self._blank_skip_threshold,
                 output,
                 timesteps,
                 scores,
                 out_seq_len,
+                num_skipped_frames,
             )
+        self._num_skipped_frames = num_skipped_frames
 
         return output, scores, timesteps, out_seq_len
 
+    def decode_packed(self, probs, seq_lens=None, top_k=None):
+        """
+        Conducts the beamsearch like decode, returning results packed into flat tensors instead of padded to
+        num_beams x num_timesteps per item.
+        Args:
+        probs (Tensor) - A rank 3 tensor representing model outputs. Shape is batch x num_timesteps x num_labels.
+        seq_lens (Tensor) - A rank 1 tensor representing the sequence length of the items in the batch. Optional,
+        if not provided the size of axis 1 (num_timesteps) of `probs` is used for all items
+        top_k (int) - Only return the top_k beams of each item. Optional, all of them if not provided.
+
+        Returns:
+        tuple: (beam_results, beam_scores, timesteps, out_lens, offsets)
+
+        beam_results (Tensor): A 1-dim int tensor with the tokens of every beam of every item, one after the other.
+                                Beam j of item i is beam_results[offsets[i][j]:offsets[i][j] + out_lens[i][j]].
+        beam_scores (Tensor): Shape: batchsize x num_beams, as for decode. Infinite for the missing beams of an
+                                item with fewer of them than num_beams.
+        timesteps (Tensor): A 1-dim int tensor with the timestep of each token of beam_results.
+        out_lens (Tensor): Shape: batchsize x num_beams. The length of each beam, 0 for missing beams.
+        offsets (Tensor): Shape: batchsize x num_beams. Where each beam starts in beam_results, an int64 tensor.
+        """
+        probs = probs.cpu().float()
+        batch_size = probs.size(0)
+        seq_lens = _seq_lens(probs, seq_lens)
+        num_skipped_frames = torch.zeros(batch_size).cpu().int()
+        results = ctc_decode.paddle_beam_decode_packed(
+            probs,
+            seq_lens,
+            self._labels,
+            self._beam_width,
+            self._pool,
+            self._cutoff_prob,
+            self.cutoff_top_n,
+            self._blank_id,
+            self._log_probs,
+            self._scorer,
+            self._log_add_mode,
+            self._blank_skip_threshold,
+            top_k or 0,
+            num_skipped_frames,
+        )
+        self._num_skipped_frames = num_skipped_frames
+
+        return results
+
+    def decode_async(self, probs, seq_lens=None):
+        """
+        Starts the beamsearch of decode on the decoder's workers and returns right away, so that the calling thread
+        can go on, e.g. with the model outputs of the next batch. probs must not be modified until it is done.
+        Args:
+        probs (Tensor) - A rank 3 tensor representing model outputs. Shape is batch x num_timesteps x num_labels.
+        seq_lens (Tensor) - A rank 1 tensor representing the sequence length of the items in the batch, see decode.
+
+        Returns:
+        DecodeFuture: its result() is the (beam_results, beam_scores, timesteps, out_lens) tuple of decode.
+        """
+        probs = probs.cpu().float()
+        batch_size, max_seq_len = probs.size(0), probs.size(1)
+        job = ctc_decode.paddle_beam_decode_async(
+            probs,
+            _seq_lens(probs, seq_lens),
+            self._labels,
+            self._beam_width,
+            self._pool,
+            self._cutoff_prob,
+            self.cutoff_top_n,
+            self._blank_id,
+            self._log_probs,
+            self._scorer,
+            self._log_add_mode,
+            self._blank_skip_threshold,
+        )
+
+        def collect(job):
+            output = torch.IntTensor(batch_size, self._beam_width, max_seq_len).cpu().int()
+            timesteps = torch.IntTensor(batch_size, self._beam_width, max_seq_len).cpu().int()
+            scores = torch.FloatTensor(batch_size, self._beam_width).cpu().float()
+            out_seq_len = torch.zeros(batch_size, self._beam_width).cpu().int()
+            num_skipped_frames = torch.zeros(batch_size).cpu().int()
+            ctc_decode.get_decode_job_results(job, output, timesteps, scores, out_seq_len, num_skipped_frames)
+            self._num_skipped_frames = num_skipped_frames
+            return output, scores, timesteps, out_seq_len
+
+        return DecodeFuture(job, collect, self)
+
+    def num_skipped_frames(self):
+        """
+        Number of frames of each batch item that the last call to decode skipped as confidently blank,
+        as a rank 1 int tensor, or None before the first call. See blank_skip_threshold.
+        """
+        return self._num_skipped_frames
+
     def character_based(self):
         return ctc_decode.is_character_based(self._scorer) if self._scorer else None
 
@@ -135,9 +349,99 @@ class CTCBeamDecoder(object):
         if self._scorer is not None:
             ctc_decode.reset_params(self._scorer, alpha, beta)
 
+    def lm_cache_stats(self):
+        return _lm_cache_stats(self._scorer) if self._scorer else None
+
+    def dictionary_stats(self):
+        return _dictionary_stats(self._scorer) if self._scorer else None
+
+    def num_processes(self):
+        return ctc_decode.get_decode_pool_size(self._pool)
+
+    def set_num_processes(self, num_processes):
+        """
+        Resize the pool of decoding workers. Waits for decode calls running in other threads to finish.
+        """
+        ctc_decode.resize_decode_pool(self._pool, num_processes)
+
+    def last_batch_timing(self):
+        """
+        How long the last call to decode took against the ideal for its batch, see _decode_pool_timing.
+        Items start longest first, so that a long item doesn't finish the batch late. Batches of decode_async
+        are not timed.
+        """
+        return _decode_pool_timing(self._pool)
+
     def __del__(self):
         if self._scorer is not None:
             ctc_decode.paddle_release_scorer(self._scorer)
+        ctc_decode.release_decode_pool(self._pool)
+
+
+class CTCGreedyDecoder(object):
+    """
+    Best path decoder: takes the most probable label of each frame, then merges repeats and removes blanks.
+    Much cheaper than a beam search, without language model.
+    Args:
+        labels (list): The tokens/vocab used to train your model.
+                        They should be in the same order as they are in your model's outputs.
+        num_processes (int): Parallelize the batch using num_processes workers. The workers are started once and
+                            reused by every call to decode, see set_num_processes.
+        blank_id (int): Index of the CTC blank token (probably 0) used when training your model.
+        log_probs_input (bool): False if your model has passed through a softmax and output probabilities sum to 1.
+    """
+
+    def __init__(self, labels, num_processes=4, blank_id=0, log_probs_input=False):
+        self._pool = ctc_decode.create_decode_pool(num_processes)
+        self._labels = list(labels)  # Ensure labels are a list
+        self._blank_id = blank_id
+        self._log_probs = 1 if log_probs_input else 0
+
+    def decode(self, probs, seq_lens=None):
+        """
+        Decodes model outputs along their best paths, returning them the way CTCBeamDecoder.decode does
+        with a single beam.
+        Args:
+        probs (Tensor) - A rank 3 tensor representing model outputs. Shape is batch x num_timesteps x num_labels.
+        seq_lens (Tensor) - A rank 1 tensor representing the sequence length of the items in the batch. Optional,
+        if not provided the size of axis 1 (num_timesteps) of `probs` is used for all items
+
+        Returns:
+        tuple: (beam_results, beam_scores, timesteps, out_lens), with num_beams 1. The score of a path is its
+        negated log probability.
+        """
+        probs = probs.cpu().float()
+        batch_size, max_seq_len = probs.size(0), probs.size(1)
+        seq_lens = _seq_lens(probs, seq_lens)
+        output = torch.IntTensor(batch_size, 1, max_seq_len).cpu().int()
+        timesteps = torch.IntTensor(batch_size, 1, max_seq_len).cpu().int()
+        scores = torch.FloatTensor(batch_size, 1).cpu().float()
+        out_seq_len = torch.zeros(batch_size, 1).cpu().int()
+        ctc_decode.paddle_greedy_decode(
+            probs,
+            seq_lens,
+            self._pool,
+            self._blank_id,
+            self._log_probs,
+            output,
+            timesteps,
+            scores,
+            out_seq_len,
+        )
+
+        return output, scores, timesteps, out_seq_len
+
+    def num_processes(self):
+        return ctc_decode.get_decode_pool_size(self._pool)
+
+    def set_num_processes(self, num_processes):
+        """
+        Resize the pool of decoding workers. Waits for decode calls running in other threads to finish.
+        """
+        ctc_decode.resize_decode_pool(self._pool, num_processes)
+
+    def __del__(self):
+        ctc_decode.release_decode_pool(self._pool)
 
 
 class OnlineCTCBeamDecoder(object):
@@ -155,9 +459,24 @@ class OnlineCTCBeamDecoder(object):
         cutoff_prob (float): Cutoff probability in pruning. 1.0 means no pruning.
         beam_width (int): This controls how broad the beam search is. Higher values are more likely to find top beams,
                             but they also will make your beam search exponentially slower.
-        num_processes (int): Parallelize the batch using num_processes workers.
+        num_processes (int): Parallelize the batch using num_processes workers. The workers are started once and
+                            reused by every call to decode, see set_num_processes.
         blank_id (int): Index of the CTC blank token (probably 0) used when training your model.
         log_probs_input (bool): False if your model has passed through a softmax and output probabilities sum to 1.
+        fast_log_add (bool): Use a table-based approximation of log-add (absolute error of a few 1e-6) instead of
+                            exact exp/log. Faster, with scores that can differ slightly from the exact ones.
+        blank_skip_threshold (float): Frames whose blank probability is above this value only extend every beam
+                            with a blank, skipping pruning and beam expansion. 1.0 means no skipping.
+        lm_cache_mb (float): Memory cap in megabytes of a cache of language model queries shared by all decoding
+                            threads. 0 disables the cache.
+        dictionary_cache_dir (basestring): Directory where the spelling dictionary built from a word based LM is
+                            saved, keyed by the LM vocabulary and the labels, and loaded from on later runs instead
+                            of being rebuilt. None always builds it.
+        lm_load_method (str): How a binary KenLM model is loaded: "lazy" maps it and reads pages on use,
+                            "populate" maps it and reads it all upfront, "read" copies it into the process.
+                            Mapped models are shared through the page cache by processes using the same file.
+                            Within a process, decoders of the same file and load method share one loaded model,
+                            see num_loaded_lms. Also "populate_or_read" (KenLM's default) and "parallel_read".
     """
     def __init__(
         self,
@@ -171,20 +490,47 @@ class OnlineCTCBeamDecoder(object):
         num_processes=4,
         blank_id=0,
         log_probs_input=False,
+        fast_log_add=False,
+        blank_skip_threshold=1.0,
+        lm_cache_mb=0,
+        dictionary_cache_dir=None,
+        lm_load_method="populate_or_read",
     ):
         self._cutoff_top_n = cutoff_top_n
         self._beam_width = beam_width
         self._scorer = None
-        self._num_processes = num_processes
+        self._pool = ctc_decode.create_decode_pool(num_processes)
         self._labels = list(labels)  # Ensure labels are a list
         self._num_labels = len(labels)
         self._blank_id = blank_id
         self._log_probs = 1 if log_probs_input else 0
+        self._log_add_mode = 1 if fast_log_add else 0
+        self._blank_skip_threshold = blank_skip_threshold
         if model_path:
             self._scorer = ctc_decode.paddle_get_scorer(
-                alpha, beta, model_path.encode(), self._labels, self._num_labels
+                alpha,
+                beta,
+                model_path.encode(),
+                self._labels,
+                self._num_labels,
+                (dictionary_cache_dir or "").encode(),
+                _lm_load_method(lm_load_method),
             )
+            if lm_cache_mb > 0:
+                ctc_decode.set_lm_cache(self._scorer, int(lm_cache_mb * 2 ** 20))
         self._cutoff_prob = cutoff_prob
+        # read-only settings shared by every DecoderState of this decoder
+        self._config = ctc_decode.paddle_get_decoder_config(
+            self._labels,
+            self._beam_width,
+            self._cutoff_prob,
+            self._cutoff_top_n,
+            self._blank_id,
+            self._log_probs,
+            self._scorer,
+            self._log_add_mode,
+            self._blank_skip_threshold,
+        )
 
     def decode(self, probs, states, is_eos_s, seq_lens=None):
         """
@@ -214,11 +560,8 @@ class OnlineCTCBeamDecoder(object):
 
         """
         probs = probs.cpu().float()
-        batch_size, max_seq_len = probs.size(0), probs.size(1)
-        if seq_lens is None:
-            seq_lens = torch.IntTensor(batch_size).fill_(max_seq_len)
-        else:
-            seq_lens = seq_lens.cpu().int()
+        batch_size = probs.size(0)
+        seq_lens = _seq_lens(probs, seq_lens)
         scores = torch.FloatTensor(batch_size, self._beam_width).cpu().float()
         out_seq_len = torch.zeros(batch_size, self._beam_width).cpu().int()
 
@@ -226,7 +569,7 @@ class OnlineCTCBeamDecoder(object):
         res_beam_results, res_timesteps = decode_fn(
             probs,
             seq_lens,
-            self._num_processes,
+            self._pool,
             [state.state for state in states],
             is_eos_s,
             scores,
@@ -237,6 +580,66 @@ class OnlineCTCBeamDecoder(object):
 
         return res_beam_results, scores, res_timesteps, out_seq_len
 
+    def decode_packed(self, probs, states, is_eos_s, seq_lens=None, top_k=None):
+        """
+        Conducts the beamsearch like decode, returning results packed into flat tensors the way
+        CTCBeamDecoder.decode_packed does.
+        Args:
+        probs (Tensor) - A rank 3 tensor representing model outputs. Shape is batch x num_timesteps x num_labels.
+        states (Sequence[DecoderState]) - sequence of decoding states with lens equal to batch_size.
+        is_eos_s (Sequence[bool]) - sequence of bool with lens equal to batch size, see decode.
+        seq_lens (Tensor) - A rank 1 tensor representing the sequence length of the items in the batch. Optional,
+        if not provided the size of axis 1 (num_timesteps) of `probs` is used for all items
+        top_k (int) - Only return the top_k beams of each item. Optional, all of them if not provided.
+
+        Returns:
+        tuple: (beam_results, beam_scores, timesteps, out_lens, offsets), see CTCBeamDecoder.decode_packed.
+        """
+        probs = probs.cpu().float()
+        seq_lens = _seq_lens(probs, seq_lens)
+        return ctc_decode.paddle_beam_decode_with_given_state_packed(
+            probs,
+            seq_lens,
+            self._pool,
+            [state.state for state in states],
+            is_eos_s,
+            top_k or 0,
+        )
+
+    def decode_async(self, probs, states, is_eos_s, seq_lens=None):
+        """
+        Starts the beamsearch of decode on the decoder's workers and returns right away, see
+        CTCBeamDecoder.decode_async. Neither probs nor the states may be used elsewhere until it is done.
+        Args:
+        probs (Tensor) - A rank 3 tensor representing model outputs. Shape is batch x num_timesteps x num_labels.
+        states (Sequence[DecoderState]) - sequence of decoding states with lens equal to batch_size.
+        is_eos_s (Sequence[bool]) - sequence of bool with lens equal to batch size, see decode.
+        seq_lens (Tensor) - A rank 1 tensor representing the sequence length of the items in the batch, see decode.
+
+        Returns:
+        DecodeFuture: its result() is the (beam_results, beam_scores, timesteps, out_lens) tuple of decode.
+        """
+        probs = probs.cpu().float()
+        batch_size = probs.size(0)
+        states = list(states)
+        job = ctc_decode.paddle_beam_decode_with_given_state_async(
+            probs,
+            _seq_lens(probs, seq_lens),
+            self._pool,
+            [state.state for state in states],
+            is_eos_s,
+        )
+
+        def collect(job):
+            scores = torch.FloatTensor(batch_size, self._beam_width).cpu().float()
+            out_seq_len = torch.zeros(batch_size, self._beam_width).cpu().int()
+            res_beam_results, res_timesteps = ctc_decode.get_decode_job_results_with_given_state(
+                job, scores, out_seq_len
+            )
+            return res_beam_results.int(), scores, res_timesteps.int(), out_seq_len
+
+        return DecodeFuture(job, collect, (self, states))
+
     def character_based(self):
         return ctc_decode.is_character_based(self._scorer) if self._scorer else None
 
@@ -246,27 +649,124 @@ class OnlineCTCBeamDecoder(object):
     def dict_size(self):
         return ctc_decode.get_dict_size(self._scorer) if self._scorer else None
 
+    def lm_cache_stats(self):
+        return _lm_cache_stats(self._scorer) if self._scorer else None
+
+    def dictionary_stats(self):
+        return _dictionary_stats(self._scorer) if self._scorer else None
+
+    def num_processes(self):
+        return ctc_decode.get_decode_pool_size(self._pool)
+
+    def set_num_processes(self, num_processes):
+        """
+        Resize the pool of decoding workers. Waits for decode calls running in other threads to finish.
+        """
+        ctc_decode.resize_decode_pool(self._pool, num_processes)
+
+    def last_batch_timing(self):
+        """
+        How long the last call to decode took against the ideal for its batch, see _decode_pool_timing.
+        Items start longest first, so that a long item doesn't finish the batch late. Batches of decode_async
+        are not timed.
+        """
+        return _decode_pool_timing(self._pool)
+
     def reset_state(state):
         ctc_decode.paddle_release_state(state)
 
+    def __del__(self):
+        # the config holds on to the scorer for the states still using it
+        ctc_decode.paddle_release_decoder_config(self._config)
+        if self._scorer is not None:
+            ctc_decode.paddle_release_scorer(self._scorer)
+        ctc_decode.release_decode_pool(self._pool)
+
 
 class DecoderState:
     """
     Class using for maintain different chunks of data in one beam algorithm corresponding to one unique source.
     Note: after using State you should delete it, so dont reuse it
+    The state shares the decoder's vocabulary, settings and dictionary instead of copying them, so it is cheap to
+    create many of them.
     Args:
         decoder (OnlineCTCBeamDecoder) - decoder you will use for decoding.
+        snapshot (bytes) - Restore the state of a stream from its snapshot(), possibly taken in another process on
+        the same platform, e.g. to move the stream between workers. decoder must have the same labels, settings and
+        language model as the snapshot's. Decoding then goes on as it would have in the original state.
     """
-    def __init__(self, decoder):
-        self.state = ctc_decode.paddle_get_decoder_state(
-            decoder._labels,
-            decoder._beam_width,
-            decoder._cutoff_prob,
-            decoder._cutoff_top_n,
-            decoder._blank_id,
-            decoder._log_probs,
-            decoder._scorer,
+    def __init__(self, decoder, snapshot=None):
+        if snapshot is None:
+            self.state = ctc_decode.paddle_get_decoder_state(decoder._config)
+        else:
+            self.state = ctc_decode.paddle_restore_decoder_state(decoder._config, snapshot)
+            if self.state is None:
+                raise ValueError("snapshot is not a decoder state snapshot for this decoder")
+
+    def num_skipped_frames(self):
+        """
+        Number of frames pushed to this state so far that were skipped as confidently blank.
+        """
+        return ctc_decode.get_num_skipped_frames(self.state)
+
+    def memory_stats(self):
+        """
+        How much of the stream the state holds in its prefix tree. The labels every hypothesis of the beam agrees on
+        are folded out of the tree at word boundaries as the stream goes on, so the number of nodes stays bounded by
+        the beam width and how far back the hypotheses differ, however long the stream is.
+
+        Returns:
+        dict with
+        num_nodes_allocated (int): Number of prefix tree nodes allocated so far.
+        num_nodes_recycled (int): Number of prefix tree nodes that reused the memory of pruned ones.
+        num_folded_tokens (int): Number of leading tokens folded out of the tree.
+        """
+        num_nodes_allocated, num_nodes_recycled, num_folded_tokens = ctc_decode.get_state_memory(self.state)
+        return {
+            "num_nodes_allocated": num_nodes_allocated,
+            "num_nodes_recycled": num_nodes_recycled,
+            "num_folded_tokens": num_folded_tokens,
+        }
+
+    def snapshot(self):
+        """
+        Compact binary snapshot of the chunks pushed so far, to restore with DecoderState(decoder, snapshot). Its
+        size grows with the beam width and how far back the hypotheses of the beam differ, plus 8 bytes per token
+        folded out of the prefix tree (see memory_stats). Don't call it while the state is being decoded.
+        """
+        return ctc_decode.get_state_snapshot(self.state)
+
+    def partial(self, changes_only=False):
+        """
+        Cheap interim result of the chunks pushed so far, for showing a transcript while the stream goes on: the
+        best hypothesis of the beam, without the rescoring and sorting that the final result gets. Don't call it
+        while the state is being decoded.
+        Args:
+        changes_only (bool) - Return only the tokens from the first one that differs from the previous call's
+        result, instead of the whole hypothesis.
+
+        Returns:
+        dict with
+        tokens (list of int): Tokens of the best hypothesis, from index num_unchanged on if changes_only.
+        timesteps (list of int): Timestep of each of the tokens.
+        length (int): Number of tokens of the whole hypothesis.
+        num_committed (int): Number of leading tokens shared by every hypothesis of the beam. Later chunks and the
+                            final result keep them, so only the tokens after them can still change.
+        num_unchanged (int): Number of leading tokens that are the same as in the previous call's result.
+        score (float): Beam score of the hypothesis.
+        """
+        tokens, timesteps, length, num_committed, num_unchanged, score = ctc_decode.get_partial_result(
+            self.state, changes_only
         )
+        return {
+            "tokens": tokens,
+            "timesteps": timesteps,
+            "length": length,
+            "num_committed": num_committed,
+            "num_unchanged": num_unchanged,
+            "score": score,
+        }
 
     def __del__(self):
-        ctc_decode.paddle_release_state(self.state)
+        if getattr(self, "state", None) is not None:
+            ctc_decode.paddle_release_state(self.state)
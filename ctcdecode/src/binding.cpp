@@ -1,11 +1,15 @@
 #include <algorithm>
 #include <iostream>
+#include <limits>
+#include <sstream>
 #include <string>
+#include <tuple>
 #include <vector>
 #include <torch/torch.h>
 #include <memory>
 #include "scorer.h"
 #include "ctc_beam_search_decoder.h"
+#include "ctc_greedy_decoder.h"
 #include "utf8.h"
 #include "boost/shared_ptr.hpp"
 #include "boost/python.hpp"
@@ -32,71 +36,96 @@ boost::python::list std_vector_to_py_list(std::vector<T> vector) {
     return list;
 }
 
-int beam_decode(at::Tensor th_probs,
-                at::Tensor th_seq_lens,
-                std::vector<std::string> new_vocab,
-                int vocab_size,
-                size_t beam_size,
-                size_t num_processes,
-                double cutoff_prob,
-                size_t cutoff_top_n,
-                size_t blank_id,
-                bool log_input,
-                void *scorer,
-                at::Tensor th_output,
-                at::Tensor th_timesteps,
-                at::Tensor th_scores,
-                at::Tensor th_out_length)
+// View each batch item of a [B, T, V] float tensor in place, no copy
+std::vector<ProbsView> get_probs_views(at::Tensor th_probs, at::Tensor th_seq_lens)
 {
-    Scorer *ext_scorer = NULL;
-    if (scorer != NULL) {
-        ext_scorer = static_cast<Scorer *>(scorer);
-    }
     const int64_t max_time = th_probs.size(1);
     const int64_t batch_size = th_probs.size(0);
     const int64_t num_classes = th_probs.size(2);
 
-    std::vector<std::vector<std::vector<double>>> inputs;
-    auto prob_accessor = th_probs.accessor<float, 3>();
+    const float *probs_data = th_probs.data_ptr<float>();
     auto seq_len_accessor = th_seq_lens.accessor<int, 1>();
 
+    std::vector<ProbsView> views;
     for (int b=0; b < batch_size; ++b) {
         // avoid a crash by ensuring that an erroneous seq_len doesn't have us try to access memory we shouldn't
-        int seq_len = std::min((int)seq_len_accessor[b], (int)max_time);
-        std::vector<std::vector<double>> temp (seq_len, std::vector<double>(num_classes));
-        for (int t=0; t < seq_len; ++t) {
-            for (int n=0; n < num_classes; ++n) {
-                float val = prob_accessor[b][t][n];
-                temp[t][n] = val;
-            }
-        }
-        inputs.push_back(temp);
+        int seq_len = std::max(0, std::min((int)seq_len_accessor[b], (int)max_time));
+        ProbsView view;
+        view.data = probs_data + b * th_probs.stride(0);
+        view.num_time_steps = seq_len;
+        view.vocab_size = num_classes;
+        view.time_stride = th_probs.stride(1);
+        view.vocab_stride = th_probs.stride(2);
+        views.push_back(view);
     }
+    return views;
+}
 
-
-    std::vector<std::vector<std::pair<double, Output>>> batch_results =
-    ctc_beam_search_decoder_batch(inputs, new_vocab, beam_size, num_processes, cutoff_prob, cutoff_top_n, blank_id, log_input, ext_scorer);
+// Write the results of a batch into the [batch, beams, timesteps] outputs of CTCBeamDecoder.decode
+void fill_results(const std::vector<std::vector<std::pair<double, Output>>> &batch_results,
+                  const std::vector<size_t> &num_skipped,
+                  at::Tensor th_output,
+                  at::Tensor th_timesteps,
+                  at::Tensor th_scores,
+                  at::Tensor th_out_length,
+                  at::Tensor th_num_skipped)
+{
     auto outputs_accessor = th_output.accessor<int, 3>();
     auto timesteps_accessor =  th_timesteps.accessor<int, 3>();
     auto scores_accessor =  th_scores.accessor<float, 2>();
     auto out_length_accessor =  th_out_length.accessor<int, 2>();
+    auto num_skipped_accessor =  th_num_skipped.accessor<int, 1>();
 
 
     for (int b = 0; b < batch_results.size(); ++b){
-        std::vector<std::pair<double, Output>> results = batch_results[b];
+        const std::vector<std::pair<double, Output>> &results = batch_results[b];
         for (int p = 0; p < results.size();++p){
-            std::pair<double, Output> n_path_result = results[p];
-            Output output = n_path_result.second;
-            std::vector<int> output_tokens = output.tokens;
-            std::vector<int> output_timesteps = output.timesteps;
-            for (int t = 0; t < output_tokens.size(); ++t){
-                outputs_accessor[b][p][t] =  output_tokens[t]; // fill output tokens
-                timesteps_accessor[b][p][t] = output_timesteps[t];
+            const Output &output = results[p].second;
+            for (int t = 0; t < output.tokens.size(); ++t){
+                outputs_accessor[b][p][t] =  output.tokens[t]; // fill output tokens
+                timesteps_accessor[b][p][t] = output.timesteps[t];
             }
-            scores_accessor[b][p] = n_path_result.first;
-            out_length_accessor[b][p] = output_tokens.size();
+            scores_accessor[b][p] = results[p].first;
+            out_length_accessor[b][p] = output.tokens.size();
         }
+        num_skipped_accessor[b] = num_skipped[b];
     }
+}
+
+// Scorer handles are shared_ptrs, so that decoder configs can keep a scorer
+// alive after its handle is released; the scorer of a handle, or NULL
+static Scorer *get_scorer(void *scorer) {
+    return scorer != NULL ? static_cast<std::shared_ptr<Scorer> *>(scorer)->get() : NULL;
+}
+
+int beam_decode(at::Tensor th_probs,
+                at::Tensor th_seq_lens,
+                std::vector<std::string> new_vocab,
+                int vocab_size,
+                size_t beam_size,
+                void *pool,
+                double cutoff_prob,
+                size_t cutoff_top_n,
+                size_t blank_id,
+                bool log_input,
+                void *scorer,
+                int log_add_mode,
+                double blank_skip_threshold,
+                at::Tensor th_output,
+                at::Tensor th_timesteps,
+                at::Tensor th_scores,
+                at::Tensor th_out_length,
+                at::Tensor th_num_skipped)
+{
+    Scorer *ext_scorer = get_scorer(scorer);
+    std::vector<ProbsView> inputs = get_probs_views(th_probs, th_seq_lens);
+
+
+    std::vector<size_t> num_skipped;
+    std::vector<std::vector<std::pair<double, Output>>> batch_results =
+    ctc_beam_search_decoder_batch(inputs, new_vocab, beam_size, *static_cast<DecodePool *>(pool), cutoff_prob, cutoff_top_n, blank_id, log_input, ext_scorer,
+                                  static_cast<LogAddMode>(log_add_mode), blank_skip_threshold, &num_skipped);
+    fill_results(batch_results, num_skipped, th_output, th_timesteps, th_scores, th_out_length, th_num_skipped);
     return 1;
 }
 
@@ -105,18 +134,22 @@ int paddle_beam_decode(at::Tensor th_probs,
                        std::vector<std::string> labels,
                        int vocab_size,
                        size_t beam_size,
-                       size_t num_processes,
+                       void *pool,
                        double cutoff_prob,
                        size_t cutoff_top_n,
                        size_t blank_id,
                        int log_input,
+                       int log_add_mode,
+                       double blank_skip_threshold,
                        at::Tensor th_output,
                        at::Tensor th_timesteps,
                        at::Tensor th_scores,
-                       at::Tensor th_out_length){
+                       at::Tensor th_out_length,
+                       at::Tensor th_num_skipped){
 
-    return beam_decode(th_probs, th_seq_lens, labels, vocab_size, beam_size, num_processes,
-                cutoff_prob, cutoff_top_n, blank_id, log_input, NULL, th_output, th_timesteps, th_scores, th_out_length);
+    return beam_decode(th_probs, th_seq_lens, labels, vocab_size, beam_size, pool,
+                cutoff_prob, cutoff_top_n, blank_id, log_input, NULL, log_add_mode, blank_skip_threshold,
+                th_output, th_timesteps, th_scores, th_out_length, th_num_skipped);
 }
 
 int paddle_beam_decode_lm(at::Tensor th_probs,
@@ -124,19 +157,68 @@ int paddle_beam_decode_lm(at::Tensor th_probs,
                           std::vector<std::string> labels,
                           int vocab_size,
                           size_t beam_size,
-                          size_t num_processes,
+                          void *pool,
                           double cutoff_prob,
                           size_t cutoff_top_n,
                           size_t blank_id,
                           int log_input,
                           void *scorer,
+                          int log_add_mode,
+                          double blank_skip_threshold,
                           at::Tensor th_output,
                           at::Tensor th_timesteps,
                           at::Tensor th_scores,
-                          at::Tensor th_out_length){
+                          at::Tensor th_out_length,
+                          at::Tensor th_num_skipped){
 
-    return beam_decode(th_probs, th_seq_lens, labels, vocab_size, beam_size, num_processes,
-                cutoff_prob, cutoff_top_n, blank_id, log_input, scorer, th_output, th_timesteps, th_scores, th_out_length);
+    return beam_decode(th_probs, th_seq_lens, labels, vocab_size, beam_size, pool,
+                cutoff_prob, cutoff_top_n, blank_id, log_input, scorer, log_add_mode, blank_skip_threshold,
+                th_output, th_timesteps, th_scores, th_out_length, th_num_skipped);
+}
+
+
+// Best path decoding, filling beam 0 of the same output tensors as beam_decode
+int paddle_greedy_decode(at::Tensor th_probs,
+                         at::Tensor th_seq_lens,
+                         void *pool,
+                         size_t blank_id,
+                         int log_input,
+                         at::Tensor th_output,
+                         at::Tensor th_timesteps,
+                         at::Tensor th_scores,
+                         at::Tensor th_out_length)
+{
+    std::vector<ProbsView> inputs = get_probs_views(th_probs, th_seq_lens);
+    std::vector<std::pair<double, Output>> batch_results =
+    ctc_greedy_decoder_batch(inputs, *static_cast<DecodePool *>(pool), blank_id, log_input);
+
+    auto outputs_accessor = th_output.accessor<int, 3>();
+    auto timesteps_accessor =  th_timesteps.accessor<int, 3>();
+    auto scores_accessor =  th_scores.accessor<float, 2>();
+    auto out_length_accessor =  th_out_length.accessor<int, 2>();
+
+    for (int b = 0; b < batch_results.size(); ++b){
+        const Output &output = batch_results[b].second;
+        for (int t = 0; t < output.tokens.size(); ++t){
+            outputs_accessor[b][0][t] = output.tokens[t];
+            timesteps_accessor[b][0][t] = output.timesteps[t];
+        }
+        scores_accessor[b][0] = batch_results[b].first;
+        out_length_accessor[b][0] = output.tokens.size();
+    }
+    return 1;
+}
+
+
+// Prune one time step of float32 (log) probabilities. Internal, exposed for
+// testing
+std::vector<std::pair<size_t, float>> pruned_log_probs(at::Tensor th_probs,
+                                                       double cutoff_prob,
+                                                       size_t cutoff_top_n,
+                                                       int log_input)
+{
+    return get_pruned_log_probs(th_probs.data_ptr<float>(), th_probs.size(0), th_probs.stride(0),
+                                cutoff_prob, cutoff_top_n, log_input);
 }
 
 
@@ -144,84 +226,51 @@ void* paddle_get_scorer(double alpha,
                         double beta,
                         const char* lm_path,
                         vector<std::string> new_vocab,
-                        int vocab_size) {
-    Scorer* scorer = new Scorer(alpha, beta, lm_path, new_vocab);
+                        int vocab_size,
+                        const char* dictionary_cache_dir,
+                        int lm_load_method) {
+    auto scorer = new std::shared_ptr<Scorer>(std::make_shared<Scorer>(
+        alpha, beta, lm_path, new_vocab, dictionary_cache_dir, static_cast<util::LoadMethod>(lm_load_method)));
     return static_cast<void*>(scorer);
 }
 
 
-std::pair<torch::Tensor, torch::Tensor> beam_decode_with_given_state(at::Tensor th_probs,
-                at::Tensor th_seq_lens,
-                size_t num_processes,
-                std::vector<void*> &states,
-                const std::vector<bool> &is_eos_s,
-                at::Tensor th_scores,
-                at::Tensor th_out_length)
+// The results of a batch of streams as [batch, beams, tokens] tokens and timesteps, as long as the longest
+// beam, with the scores and lengths written into th_scores and th_out_length
+std::pair<torch::Tensor, torch::Tensor> padded_results(
+    const std::vector<std::vector<std::pair<double, Output>>> &batch_results,
+    at::Tensor th_scores,
+    at::Tensor th_out_length)
 {
-    const int64_t max_time = th_probs.size(1);
-    const int64_t batch_size = th_probs.size(0);
-    const int64_t num_classes = th_probs.size(2);
-
-    std::vector<std::vector<std::vector<double>>> inputs;
-    auto prob_accessor = th_probs.accessor<float, 3>();
-    auto seq_len_accessor = th_seq_lens.accessor<int, 1>();
-
-    for (int b=0; b < batch_size; ++b) {
-        // avoid a crash by ensuring that an erroneous seq_len doesn't have us try to access memory we shouldn't
-        int seq_len = std::min((int)seq_len_accessor[b], (int)max_time);
-        std::vector<std::vector<double>> temp (seq_len, std::vector<double>(num_classes));
-        for (int t=0; t < seq_len; ++t) {
-            for (int n=0; n < num_classes; ++n) {
-                float val = prob_accessor[b][t][n];
-                temp[t][n] = val;
-            }
+    size_t max_result_size = 0;
+    size_t max_output_tokens_size = 0;
+    for (const auto &results : batch_results) {
+        max_result_size = std::max(max_result_size, results.size());
+        for (const auto &result : results) {
+            max_output_tokens_size = std::max(max_output_tokens_size, result.second.tokens.size());
         }
-        inputs.push_back(temp);
-        
     }
 
-    std::vector<std::vector<std::pair<double, Output>>> batch_results =
-    ctc_beam_search_decoder_batch_with_states(inputs, num_processes, states, is_eos_s);
-    
-    int max_result_size = 0;
-    int max_output_tokens_size = 0;
-    for (int b = 0; b < batch_results.size(); ++b){
-        std::vector<std::pair<double, Output>> results = batch_results[b];
-        if (batch_results[b].size() > max_result_size) {
-            max_result_size = batch_results[b].size();
-        }
-        for (int p = 0; p < results.size();++p){
-            std::pair<double, Output> n_path_result = results[p];
-            Output output = n_path_result.second;
-            std::vector<int> output_tokens = output.tokens;
-            
-            if (output_tokens.size() > max_output_tokens_size) {
-            max_output_tokens_size = output_tokens.size();
-        }
-        }
-        }
-    
-    torch::Tensor output_tokens_tensor = torch::randint(1, {batch_results.size(), max_result_size, max_output_tokens_size});
-    torch::Tensor output_timesteps_tensor = torch::randint(1, {batch_results.size(), max_result_size, max_output_tokens_size});
-
+    const int64_t batch_size = batch_results.size();
+    torch::Tensor output_tokens_tensor = torch::zeros(
+        {batch_size, (int64_t)max_result_size, (int64_t)max_output_tokens_size}, torch::kInt32);
+    torch::Tensor output_timesteps_tensor = torch::zeros_like(output_tokens_tensor);
+    int *tokens_data = output_tokens_tensor.data_ptr<int>();
+    int *timesteps_data = output_timesteps_tensor.data_ptr<int>();
 
     auto scores_accessor =  th_scores.accessor<float, 2>();
     auto out_length_accessor =  th_out_length.accessor<int, 2>();
 
-
-    for (int b = 0; b < batch_results.size(); ++b){
-        std::vector<std::pair<double, Output>> results = batch_results[b];
-        for (int p = 0; p < results.size();++p){
-            std::pair<double, Output> n_path_result = results[p];
-            Output output = n_path_result.second;
-            std::vector<int> output_tokens = output.tokens;
-            std::vector<int> output_timesteps = output.timesteps;
-            for (int t = 0; t < output_tokens.size(); ++t) {
-                output_tokens_tensor[b][p][t] =  output_tokens[t]; // fill output tokens
-                output_timesteps_tensor[b][p][t] = output_timesteps[t];
-            }
-            scores_accessor[b][p] = n_path_result.first;
-            out_length_accessor[b][p] = output_tokens.size();
+    for (int b = 0; b < batch_size; ++b){
+        const std::vector<std::pair<double, Output>> &results = batch_results[b];
+        for (int p = 0; p < results.size(); ++p){
+            const Output &output = results[p].second;
+            // rows of the padded [batch, beams, tokens] tensors
+            size_t row = (b * max_result_size + p) * max_output_tokens_size;
+            std::copy(output.tokens.begin(), output.tokens.end(), tokens_data + row);
+            std::copy(output.timesteps.begin(), output.timesteps.end(), timesteps_data + row);
+            scores_accessor[b][p] = results[p].first;
+            out_length_accessor[b][p] = output.tokens.size();
         }
     }
 
@@ -229,34 +278,262 @@ std::pair<torch::Tensor, torch::Tensor> beam_decode_with_given_state(at::Tensor
 }
 
 
+std::pair<torch::Tensor, torch::Tensor> beam_decode_with_given_state(at::Tensor th_probs,
+                at::Tensor th_seq_lens,
+                void *pool,
+                std::vector<void*> &states,
+                const std::vector<bool> &is_eos_s,
+                at::Tensor th_scores,
+                at::Tensor th_out_length)
+{
+    std::vector<ProbsView> inputs = get_probs_views(th_probs, th_seq_lens);
+
+    std::vector<std::vector<std::pair<double, Output>>> batch_results =
+    ctc_beam_search_decoder_batch_with_states(inputs, *static_cast<DecodePool *>(pool), states, is_eos_s);
+    return padded_results(batch_results, th_scores, th_out_length);
+}
+
+
 std::pair<torch::Tensor, torch::Tensor> paddle_beam_decode_with_given_state(at::Tensor th_probs,
                           at::Tensor th_seq_lens,
-                          size_t num_processes,
+                          void *pool,
                           std::vector<void*> states,
                           std::vector<bool> is_eos_s,
                           at::Tensor th_scores,
                           at::Tensor th_out_length){
 
-    return beam_decode_with_given_state(th_probs, th_seq_lens, num_processes, states,is_eos_s, th_scores, th_out_length);
+    return beam_decode_with_given_state(th_probs, th_seq_lens, pool, states,is_eos_s, th_scores, th_out_length);
+}
+
+
+// (tokens, scores, timesteps, lengths, offsets) of a batch, see pack_results
+typedef std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> PackedResults;
+
+// Pack the top_k beams of each item (all of them if top_k is 0) into flat int32 token and timestep buffers,
+// without padding: beam p of item b is tokens[offsets[b][p]:offsets[b][p] + lengths[b][p]]. scores, lengths
+// and the int64 offsets are [batch, beams], the beams of an item that has fewer of them have length 0 and an
+// infinite score.
+PackedResults pack_results(const std::vector<std::vector<std::pair<double, Output>>> &batch_results,
+                           size_t top_k)
+{
+    const int64_t batch_size = batch_results.size();
+    size_t num_beams = 0;
+    for (const auto &results : batch_results) {
+        num_beams = std::max(num_beams, results.size());
+    }
+    if (top_k > 0) {
+        num_beams = std::min(num_beams, top_k);
+    }
+    int64_t num_tokens = 0;
+    for (const auto &results : batch_results) {
+        for (size_t p = 0; p < std::min(num_beams, results.size()); ++p) {
+            num_tokens += results[p].second.tokens.size();
+        }
+    }
+
+    torch::Tensor tokens = torch::empty({num_tokens}, torch::kInt32);
+    torch::Tensor timesteps = torch::empty({num_tokens}, torch::kInt32);
+    torch::Tensor scores = torch::empty({batch_size, (int64_t)num_beams}, torch::kFloat32);
+    torch::Tensor lengths = torch::empty({batch_size, (int64_t)num_beams}, torch::kInt32);
+    torch::Tensor offsets = torch::empty({batch_size, (int64_t)num_beams}, torch::kInt64);
+    int *tokens_data = tokens.data_ptr<int>();
+    int *timesteps_data = timesteps.data_ptr<int>();
+    float *scores_data = scores.data_ptr<float>();
+    int *lengths_data = lengths.data_ptr<int>();
+    int64_t *offsets_data = offsets.data_ptr<int64_t>();
+
+    int64_t offset = 0;
+    for (int64_t b = 0; b < batch_size; ++b) {
+        const std::vector<std::pair<double, Output>> &results = batch_results[b];
+        for (size_t p = 0; p < num_beams; ++p) {
+            size_t i = b * num_beams + p;
+            offsets_data[i] = offset;
+            if (p >= results.size()) {
+                scores_data[i] = std::numeric_limits<float>::infinity();
+                lengths_data[i] = 0;
+                continue;
+            }
+            const Output &output = results[p].second;
+            std::copy(output.tokens.begin(), output.tokens.end(), tokens_data + offset);
+            std::copy(output.timesteps.begin(), output.timesteps.end(), timesteps_data + offset);
+            scores_data[i] = results[p].first;
+            lengths_data[i] = output.tokens.size();
+            offset += output.tokens.size();
+        }
+    }
+    return std::make_tuple(tokens, scores, timesteps, lengths, offsets);
 }
 
 
+// beam_decode returning packed results, see pack_results. scorer may be NULL.
+PackedResults paddle_beam_decode_packed(at::Tensor th_probs,
+                                        at::Tensor th_seq_lens,
+                                        std::vector<std::string> labels,
+                                        size_t beam_size,
+                                        void *pool,
+                                        double cutoff_prob,
+                                        size_t cutoff_top_n,
+                                        size_t blank_id,
+                                        int log_input,
+                                        void *scorer,
+                                        int log_add_mode,
+                                        double blank_skip_threshold,
+                                        size_t top_k,
+                                        at::Tensor th_num_skipped)
+{
+    std::vector<ProbsView> inputs = get_probs_views(th_probs, th_seq_lens);
+
+    std::vector<size_t> num_skipped;
+    std::vector<std::vector<std::pair<double, Output>>> batch_results =
+    ctc_beam_search_decoder_batch(inputs, labels, beam_size, *static_cast<DecodePool *>(pool), cutoff_prob, cutoff_top_n,
+                                  blank_id, log_input, get_scorer(scorer),
+                                  static_cast<LogAddMode>(log_add_mode), blank_skip_threshold, &num_skipped);
+    int *num_skipped_data = th_num_skipped.data_ptr<int>();
+    for (size_t b = 0; b < num_skipped.size(); ++b) {
+        num_skipped_data[b] = num_skipped[b];
+    }
+    return pack_results(batch_results, top_k);
+}
 
 
-void* paddle_get_decoder_state(const std::vector<std::string> &vocabulary,
+// beam_decode_with_given_state returning packed results, see pack_results
+PackedResults paddle_beam_decode_with_given_state_packed(at::Tensor th_probs,
+                                                         at::Tensor th_seq_lens,
+                                                         void *pool,
+                                                         std::vector<void*> states,
+                                                         std::vector<bool> is_eos_s,
+                                                         size_t top_k)
+{
+    std::vector<ProbsView> inputs = get_probs_views(th_probs, th_seq_lens);
+    return pack_results(
+        ctc_beam_search_decoder_batch_with_states(inputs, *static_cast<DecodePool *>(pool), states, is_eos_s),
+        top_k);
+}
+
+
+
+
+// A batch decoding in the background on a pool, see paddle_beam_decode_async
+struct DecodeJob {
+    // the input the pool reads until the batch is done
+    at::Tensor th_probs;
+    std::vector<std::vector<std::pair<double, Output>>> batch_results;
+    std::vector<size_t> num_skipped;
+    std::shared_ptr<DecodePool::Pending> pending;
+};
+
+// beam_decode submitted to the pool without waiting for it: returns a job to wait for with wait_decode_job and
+// read with get_decode_job_results, then release with release_decode_job. scorer may be NULL.
+void* paddle_beam_decode_async(at::Tensor th_probs,
+                               at::Tensor th_seq_lens,
+                               std::vector<std::string> labels,
                                size_t beam_size,
+                               void *pool,
                                double cutoff_prob,
                                size_t cutoff_top_n,
                                size_t blank_id,
                                int log_input,
-                                void* scorer)
+                               void *scorer,
+                               int log_add_mode,
+                               double blank_skip_threshold)
+{
+    DecodeJob *job = new DecodeJob();
+    job->th_probs = th_probs;
+    job->pending = ctc_beam_search_decoder_batch_async(
+        get_probs_views(th_probs, th_seq_lens), labels, beam_size, *static_cast<DecodePool *>(pool), cutoff_prob,
+        cutoff_top_n, blank_id, log_input, get_scorer(scorer), static_cast<LogAddMode>(log_add_mode),
+        blank_skip_threshold, &job->batch_results, &job->num_skipped);
+    return static_cast<void*>(job);
+}
+
+// beam_decode_with_given_state submitted to the pool without waiting for it, see paddle_beam_decode_async.
+// Read the results with get_decode_job_results_with_given_state.
+void* paddle_beam_decode_with_given_state_async(at::Tensor th_probs,
+                                                at::Tensor th_seq_lens,
+                                                void *pool,
+                                                std::vector<void*> states,
+                                                std::vector<bool> is_eos_s)
+{
+    DecodeJob *job = new DecodeJob();
+    job->th_probs = th_probs;
+    job->pending = ctc_beam_search_decoder_batch_with_states_async(
+        get_probs_views(th_probs, th_seq_lens), *static_cast<DecodePool *>(pool), states, is_eos_s,
+        &job->batch_results);
+    return static_cast<void*>(job);
+}
+
+int is_decode_job_done(void* job) {
+    return static_cast<DecodeJob*>(job)->pending->done();
+}
+
+void wait_decode_job(void* job) {
+    static_cast<DecodeJob*>(job)->pending->wait();
+}
+
+// results of a finished job of paddle_beam_decode_async, written like beam_decode does
+int get_decode_job_results(void* job,
+                           at::Tensor th_output,
+                           at::Tensor th_timesteps,
+                           at::Tensor th_scores,
+                           at::Tensor th_out_length,
+                           at::Tensor th_num_skipped)
+{
+    const DecodeJob *decode_job = static_cast<DecodeJob*>(job);
+    fill_results(decode_job->batch_results, decode_job->num_skipped, th_output, th_timesteps, th_scores,
+                 th_out_length, th_num_skipped);
+    return 1;
+}
+
+// results of a finished job of paddle_beam_decode_with_given_state_async, see beam_decode_with_given_state
+std::pair<torch::Tensor, torch::Tensor> get_decode_job_results_with_given_state(void* job,
+                                                                                at::Tensor th_scores,
+                                                                                at::Tensor th_out_length)
+{
+    return padded_results(static_cast<DecodeJob*>(job)->batch_results, th_scores, th_out_length);
+}
+
+// waits for the job if it's still running, since the pool refers to its input and results until it is done
+void release_decode_job(void* job) {
+    DecodeJob *decode_job = static_cast<DecodeJob*>(job);
+    try {
+        decode_job->pending->wait();
+    } catch (const std::exception &) {
+        // an error nobody asked for the results of
+    }
+    delete decode_job;
+}
+
+
+
+
+// A shared_ptr to a DecoderConfig, so that states made from it keep it alive
+void* paddle_get_decoder_config(const std::vector<std::string> &vocabulary,
+                                size_t beam_size,
+                                double cutoff_prob,
+                                size_t cutoff_top_n,
+                                size_t blank_id,
+                                int log_input,
+                                void* scorer,
+                                int log_add_mode,
+                                double blank_skip_threshold)
 {
-    // DecoderState state(vocabulary, beam_size, cutoff_prob, cutoff_top_n, blank_id, log_input, ext_scorer);
-    Scorer *ext_scorer = NULL;
+    std::shared_ptr<Scorer> ext_scorer;
     if (scorer != NULL) {
-        ext_scorer = static_cast<Scorer *>(scorer);
+        ext_scorer = *static_cast<std::shared_ptr<Scorer> *>(scorer);
     }
-    DecoderState* state = new DecoderState(vocabulary, beam_size, cutoff_prob, cutoff_top_n, blank_id, log_input, ext_scorer);
+    auto config = new std::shared_ptr<const DecoderConfig>(
+        std::make_shared<const DecoderConfig>(vocabulary, beam_size, cutoff_prob, cutoff_top_n, blank_id, log_input,
+                                              ext_scorer, static_cast<LogAddMode>(log_add_mode), blank_skip_threshold));
+    return static_cast<void*>(config);
+}
+
+void paddle_release_decoder_config(void* config) {
+    delete static_cast<std::shared_ptr<const DecoderConfig>*>(config);
+}
+
+void* paddle_get_decoder_state(void* config)
+{
+    DecoderState* state = new DecoderState(*static_cast<std::shared_ptr<const DecoderConfig>*>(config));
     return static_cast<void*>(state);
 }
 
@@ -264,40 +541,181 @@ void paddle_release_state(void* state) {
     delete static_cast<DecoderState*>(state);
 }
 
+size_t get_num_skipped_frames(void* state) {
+    return static_cast<DecoderState*>(state)->num_skipped_frames();
+}
+
+// binary snapshot of a stream, see DecoderState::snapshot
+pybind11::bytes get_state_snapshot(void* state) {
+    std::ostringstream out;
+    static_cast<DecoderState*>(state)->snapshot(out);
+    return pybind11::bytes(out.str());
+}
+
+// a stream restored from a snapshot, or nullptr if it isn't one the config can restore
+void* paddle_restore_decoder_state(void* config, const std::string& snapshot) {
+    std::unique_ptr<DecoderState> state = DecoderState::from_snapshot(
+        *static_cast<std::shared_ptr<const DecoderConfig>*>(config), snapshot.data(), snapshot.size());
+    return static_cast<void*>(state.release());
+}
+
+// trie nodes a stream has allocated and reused, and labels it has folded out
+// of the trie
+std::tuple<size_t, size_t, size_t> get_state_memory(void* state) {
+    const DecoderState* decoder_state = static_cast<DecoderState*>(state);
+    return std::make_tuple(decoder_state->num_nodes_allocated(),
+                           decoder_state->num_nodes_recycled(),
+                           decoder_state->num_folded_tokens());
+}
+
+// tokens, timesteps, length, number of committed and of unchanged tokens,
+// and score of the best hypothesis of a stream so far, see
+// DecoderState::partial
+std::tuple<std::vector<int>, std::vector<int>, size_t, size_t, size_t, double>
+get_partial_result(void* state, bool changes_only) {
+    PartialOutput partial = static_cast<DecoderState*>(state)->partial(changes_only);
+    return std::make_tuple(std::move(partial.tokens), std::move(partial.timesteps), partial.length,
+                           partial.num_committed, partial.num_unchanged, partial.score);
+}
+
+void* create_decode_pool(size_t num_processes) {
+    return static_cast<void*>(new DecodePool(num_processes));
+}
+
+void resize_decode_pool(void* pool, size_t num_processes) {
+    static_cast<DecodePool*>(pool)->resize(num_processes);
+}
+
+size_t get_decode_pool_size(void* pool) {
+    return static_cast<DecodePool*>(pool)->size();
+}
+
+// makespan, its lower bound on the pool's threads, the summed run time of
+// the items and their number, for the last batch the pool ran, see
+// DecodePool::last_timing
+std::tuple<double, double, double, size_t> get_decode_pool_timing(void* pool) {
+    DecodePool::Timing timing = static_cast<DecodePool*>(pool)->last_timing();
+    return std::make_tuple(timing.makespan, timing.ideal_makespan(), timing.busy, timing.num_tasks);
+}
+
+void release_decode_pool(void* pool) {
+    delete static_cast<DecodePool*>(pool);
+}
+
+// Drops the handle's reference, decoder configs using the scorer keep it
 void paddle_release_scorer(void* scorer) {
-    delete static_cast<Scorer*>(scorer);
+    delete static_cast<std::shared_ptr<Scorer>*>(scorer);
 }
 
 int is_character_based(void *scorer){
-    Scorer *ext_scorer  = static_cast<Scorer *>(scorer);
+    Scorer *ext_scorer  = get_scorer(scorer);
     return ext_scorer->is_character_based();
 }
 size_t get_max_order(void *scorer){
-    Scorer *ext_scorer  = static_cast<Scorer *>(scorer);
+    Scorer *ext_scorer  = get_scorer(scorer);
     return ext_scorer->get_max_order();
 }
 size_t get_dict_size(void *scorer){
-    Scorer *ext_scorer  = static_cast<Scorer *>(scorer);
+    Scorer *ext_scorer  = get_scorer(scorer);
     return ext_scorer->get_dict_size();
 }
 
 void reset_params(void *scorer, double alpha, double beta){
-    Scorer *ext_scorer  = static_cast<Scorer *>(scorer);
+    Scorer *ext_scorer  = get_scorer(scorer);
     ext_scorer->reset_params(alpha, beta);
 }
 
+void set_lm_cache(void *scorer, size_t max_bytes){
+    Scorer *ext_scorer  = get_scorer(scorer);
+    ext_scorer->set_cache(max_bytes);
+}
+
+// hits, misses, evictions and capacity in entries of the lm query cache
+std::tuple<size_t, size_t, size_t, size_t> get_lm_cache_stats(void *scorer){
+    const NgramCache *cache = get_scorer(scorer)->get_cache();
+    if (cache == nullptr) {
+        return std::make_tuple(0, 0, 0, 0);
+    }
+    return std::make_tuple(cache->num_hits(), cache->num_misses(), cache->num_evictions(), cache->capacity());
+}
+
+// seconds spent building or loading the dictionary, whether it came from the
+// dictionary cache, and its numbers of states and arcs
+std::tuple<double, bool, size_t, size_t> get_dictionary_stats(void *scorer){
+    Scorer::DictionaryStats stats = get_scorer(scorer)->get_dictionary_stats();
+    return std::make_tuple(stats.seconds, stats.from_cache, stats.num_states, stats.num_arcs);
+}
+
+// rank of the word spelled by labels (vocabulary indices, the trailing space
+// included) in the dictionary of a scorer with a word based lm, the sum of
+// the arc weights along its path; -1 if the dictionary doesn't accept it.
+// Internal, exposed for testing
+int dictionary_word_rank(void *scorer, const std::vector<int> &labels){
+    const CompactDictionary *dictionary = get_scorer(scorer)->get_compact_dictionary();
+    if (dictionary == NULL) {
+        return -1;
+    }
+    int state = dictionary->start();
+    int rank = 0;
+    for (int label : labels) {
+        int weight;
+        // the dictionary's labels start at 1, see Scorer::set_char_map
+        if (!dictionary->find(state, label + 1, &state, &weight)) {
+            return -1;
+        }
+        rank += weight;
+    }
+    return dictionary->is_final(state) ? rank : -1;
+}
+
+// lms loaded by the scorers of the process, see Scorer::num_loaded_models
+size_t get_num_loaded_lms() {
+    return Scorer::num_loaded_models();
+}
+
+
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
-  m.def("paddle_beam_decode", &paddle_beam_decode, "paddle_beam_decode");
-  m.def("paddle_beam_decode_lm", &paddle_beam_decode_lm, "paddle_beam_decode_lm");
-  m.def("paddle_get_scorer", &paddle_get_scorer, "paddle_get_scorer");
+  // calls that can take a while run without the GIL, so that other Python threads go on meanwhile
+  auto nogil = pybind11::call_guard<pybind11::gil_scoped_release>();
+  m.def("paddle_beam_decode", &paddle_beam_decode, "paddle_beam_decode", nogil);
+  m.def("paddle_beam_decode_lm", &paddle_beam_decode_lm, "paddle_beam_decode_lm", nogil);
+  m.def("paddle_greedy_decode", &paddle_greedy_decode, "paddle_greedy_decode", nogil);
+  m.def("paddle_get_scorer", &paddle_get_scorer, "paddle_get_scorer", nogil);
   m.def("paddle_release_scorer", &paddle_release_scorer, "paddle_release_scorer");
   m.def("is_character_based", &is_character_based, "is_character_based");
   m.def("get_max_order", &get_max_order, "get_max_order");
   m.def("get_dict_size", &get_dict_size, "get_max_order");
   m.def("reset_params", &reset_params, "reset_params");
+  m.def("set_lm_cache", &set_lm_cache, "set_lm_cache");
+  m.def("get_lm_cache_stats", &get_lm_cache_stats, "get_lm_cache_stats");
+  m.def("get_dictionary_stats", &get_dictionary_stats, "get_dictionary_stats");
+  m.def("_dictionary_word_rank", &dictionary_word_rank, "_dictionary_word_rank");
+  m.def("get_num_loaded_lms", &get_num_loaded_lms, "get_num_loaded_lms");
+  m.def("paddle_get_decoder_config", &paddle_get_decoder_config, "paddle_get_decoder_config");
+  m.def("paddle_release_decoder_config", &paddle_release_decoder_config, "paddle_release_decoder_config");
   m.def("paddle_get_decoder_state", &paddle_get_decoder_state, "paddle_get_decoder_state");
-  m.def("paddle_beam_decode_with_given_state", &paddle_beam_decode_with_given_state, "paddle_beam_decode_with_given_state");
+  m.def("paddle_beam_decode_with_given_state", &paddle_beam_decode_with_given_state, "paddle_beam_decode_with_given_state", nogil);
+  m.def("paddle_beam_decode_packed", &paddle_beam_decode_packed, "paddle_beam_decode_packed", nogil);
+  m.def("paddle_beam_decode_with_given_state_packed", &paddle_beam_decode_with_given_state_packed, "paddle_beam_decode_with_given_state_packed", nogil);
   m.def("paddle_release_state", &paddle_release_state, "paddle_release_state");
+  m.def("get_num_skipped_frames", &get_num_skipped_frames, "get_num_skipped_frames");
+  m.def("get_state_memory", &get_state_memory, "get_state_memory");
+  m.def("get_state_snapshot", &get_state_snapshot, "get_state_snapshot");
+  m.def("paddle_restore_decoder_state", &paddle_restore_decoder_state, "paddle_restore_decoder_state");
+  m.def("get_partial_result", &get_partial_result, "get_partial_result");
+  m.def("_pruned_log_probs", &pruned_log_probs, "_pruned_log_probs");
+  m.def("create_decode_pool", &create_decode_pool, "create_decode_pool");
+  m.def("resize_decode_pool", &resize_decode_pool, "resize_decode_pool", nogil);
+  m.def("get_decode_pool_size", &get_decode_pool_size, "get_decode_pool_size");
+  m.def("get_decode_pool_timing", &get_decode_pool_timing, "get_decode_pool_timing");
+  m.def("release_decode_pool", &release_decode_pool, "release_decode_pool", nogil);
+  m.def("paddle_beam_decode_async", &paddle_beam_decode_async, "paddle_beam_decode_async");
+  m.def("paddle_beam_decode_with_given_state_async", &paddle_beam_decode_with_given_state_async, "paddle_beam_decode_with_given_state_async");
+  m.def("is_decode_job_done", &is_decode_job_done, "is_decode_job_done");
+  m.def("wait_decode_job", &wait_decode_job, "wait_decode_job", nogil);
+  m.def("get_decode_job_results", &get_decode_job_results, "get_decode_job_results");
+  m.def("get_decode_job_results_with_given_state", &get_decode_job_results_with_given_state, "get_decode_job_results_with_given_state");
+  m.def("release_decode_job", &release_decode_job, "release_decode_job", nogil);
   //paddle_beam_decode_with_given_state
 }
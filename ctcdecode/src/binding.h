@@ -3,15 +3,18 @@ int paddle_beam_decode(THFloatTensor *th_probs,
                        std::vector<std::string> labels,
                        int vocab_size,
                        size_t beam_size,
-                       size_t num_processes,
+                       void *pool,
                        double cutoff_prob,
                        size_t cutoff_top_n,
                        size_t blank_id,
                        int log_input,
+                       int log_add_mode,
+                       double blank_skip_threshold,
                        THIntTensor *th_output,
                        THIntTensor *th_timesteps,
                        THFloatTensor *th_scores,
-                       THIntTensor *th_out_length);
+                       THIntTensor *th_out_length,
+                       THIntTensor *th_num_skipped);
 
 
 int paddle_beam_decode_lm(THFloatTensor *th_probs,
@@ -19,34 +22,82 @@ int paddle_beam_decode_lm(THFloatTensor *th_probs,
                           std::vector<std::string> labels,
                           int vocab_size,
                           size_t beam_size,
-                          size_t num_processes,
+                          void *pool,
                           double cutoff_prob,
                           size_t cutoff_top_n,
                           size_t blank_id,
                           bool log_input,
                           int *scorer,
+                          int log_add_mode,
+                          double blank_skip_threshold,
                           THIntTensor *th_output,
                           THIntTensor *th_timesteps,
                           THFloatTensor *th_scores,
-                          THIntTensor *th_out_length);
+                          THIntTensor *th_out_length,
+                          THIntTensor *th_num_skipped);
+
+int paddle_greedy_decode(THFloatTensor *th_probs,
+                         THIntTensor *th_seq_lens,
+                         void *pool,
+                         size_t blank_id,
+                         int log_input,
+                         THIntTensor *th_output,
+                         THIntTensor *th_timesteps,
+                         THFloatTensor *th_scores,
+                         THIntTensor *th_out_length);
 
 void* paddle_get_scorer(double alpha,
                         double beta,
                         const char* lm_path,
                         std::vector<std::string> labels,
-                        int vocab_size);
+                        int vocab_size,
+                        const char* dictionary_cache_dir,
+                        int lm_load_method);
+
+
+void* paddle_get_decoder_config(const std::vector<std::string> &vocabulary,
+                                size_t beam_size,
+                                double cutoff_prob,
+                                size_t cutoff_top_n,
+                                size_t blank_id,
+                                int log_input,
+                                void* scorer,
+                                int log_add_mode,
+                                double blank_skip_threshold);
 
+void paddle_release_decoder_config(void* config);
 
-void* paddle_get_decoder_state(const std::vector<std::string> &vocabulary,
+void* paddle_get_decoder_state(void* config);
+
+void paddle_release_scorer(void* scorer);
+void paddle_release_state(void* state);
+
+void* create_decode_pool(size_t num_processes);
+void resize_decode_pool(void* pool, size_t num_processes);
+size_t get_decode_pool_size(void* pool);
+void release_decode_pool(void* pool);
+
+void* paddle_beam_decode_async(THFloatTensor *th_probs,
+                               THIntTensor *th_seq_lens,
+                               std::vector<std::string> labels,
                                size_t beam_size,
+                               void *pool,
                                double cutoff_prob,
                                size_t cutoff_top_n,
                                size_t blank_id,
                                int log_input,
-                               void* scorer);
-
-void paddle_release_scorer(void* scorer);
-void paddle_release_state(void* state);
+                               void *scorer,
+                               int log_add_mode,
+                               double blank_skip_threshold);
+int is_decode_job_done(void* job);
+void wait_decode_job(void* job);
+int get_decode_job_results(void* job,
+                           THIntTensor *th_output,
+                           THIntTensor *th_timesteps,
+                           THFloatTensor *th_scores,
+                           THIntTensor *th_out_length,
+                           THIntTensor *th_num_skipped);
+void release_decode_job(void* job);
 
 
 int is_character_based(void *scorer);
@@ -0,0 +1,170 @@
+#ifndef CHILD_INDEX_H_
+#define CHILD_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/* Map from label to child used by PathTrie.
+ *
+ * Up to INLINE_SIZE children are kept in a small array that is scanned
+ * linearly. Past that, the children move to an open-addressing hash table
+ * with linear probing, so lookups stay O(1) for nodes with a large fan-out
+ * (e.g. the root with a wordpiece vocabulary and a high cutoff_top_n).
+ * Labels must be non-negative; iteration order is unspecified.
+ */
+template <typename V>
+class ChildIndex {
+public:
+  static const size_t INLINE_SIZE = 4;
+
+  ChildIndex() : size_(0), capacity_(0), shift_(0) {}
+
+  ChildIndex(const ChildIndex &) = delete;
+  ChildIndex &operator=(const ChildIndex &) = delete;
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  // return the child for label, or V() if there is none
+  V find(int label) const {
+    if (capacity_ == 0) {
+      for (size_t i = 0; i < size_; ++i) {
+        if (inline_[i].label == label) return inline_[i].value;
+      }
+      return V();
+    }
+    for (size_t i = bucket(label);; i = (i + 1) & (capacity_ - 1)) {
+      if (table_[i].label == label) return table_[i].value;
+      if (table_[i].label == EMPTY) return V();
+    }
+  }
+
+  // add a child; label must not be present yet
+  void insert(int label, V value) {
+    if (capacity_ == 0 && size_ < INLINE_SIZE) {
+      inline_[size_].label = label;
+      inline_[size_].value = value;
+      ++size_;
+      return;
+    }
+    if (capacity_ == 0 || 2 * (size_ + 1) > capacity_) {
+      rehash(capacity_ == 0 ? 4 * INLINE_SIZE : 2 * capacity_);
+    }
+    place(label, value);
+    ++size_;
+  }
+
+  // remove the child for label, return false if there is none
+  bool erase(int label) {
+    if (capacity_ == 0) {
+      for (size_t i = 0; i < size_; ++i) {
+        if (inline_[i].label == label) {
+          inline_[i] = inline_[--size_];
+          return true;
+        }
+      }
+      return false;
+    }
+
+    size_t mask = capacity_ - 1;
+    size_t hole = bucket(label);
+    while (table_[hole].label != label) {
+      if (table_[hole].label == EMPTY) return false;
+      hole = (hole + 1) & mask;
+    }
+    // backward-shift deletion keeps probe chains intact without tombstones
+    for (size_t next = (hole + 1) & mask; table_[next].label != EMPTY;
+         next = (next + 1) & mask) {
+      size_t home = bucket(table_[next].label);
+      bool stays = hole <= next ? (hole < home && home <= next)
+                                : (hole < home || home <= next);
+      if (!stays) {
+        table_[hole] = table_[next];
+        hole = next;
+      }
+    }
+    table_[hole].label = EMPTY;
+    if (--size_ == 0) {
+      clear();
+    }
+    return true;
+  }
+
+  void clear() {
+    table_.reset();
+    size_ = 0;
+    capacity_ = 0;
+    shift_ = 0;
+  }
+
+  void swap(ChildIndex &other) {
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(shift_, other.shift_);
+    std::swap(inline_, other.inline_);
+    table_.swap(other.table_);
+  }
+
+  // call f(label, child) for every child
+  template <typename F>
+  void for_each(F f) const {
+    if (capacity_ == 0) {
+      for (size_t i = 0; i < size_; ++i) f(inline_[i].label, inline_[i].value);
+      return;
+    }
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (table_[i].label != EMPTY) f(table_[i].label, table_[i].value);
+    }
+  }
+
+private:
+  struct Slot {
+    int label;
+    V value;
+  };
+
+  static const int EMPTY = -1;
+
+  // Fibonacci hashing: the high bits of the product index the table
+  size_t bucket(int label) const {
+    return (static_cast<uint32_t>(label) * 2654435769u) >> shift_;
+  }
+
+  void place(int label, V value) {
+    size_t i = bucket(label);
+    while (table_[i].label != EMPTY) i = (i + 1) & (capacity_ - 1);
+    table_[i].label = label;
+    table_[i].value = value;
+  }
+
+  void rehash(size_t new_capacity) {
+    std::unique_ptr<Slot[]> old_table(new Slot[new_capacity]);
+    old_table.swap(table_);
+    size_t old_capacity = capacity_;
+
+    capacity_ = new_capacity;
+    shift_ = 32;
+    for (size_t c = new_capacity; c > 1; c >>= 1) --shift_;
+    for (size_t i = 0; i < capacity_; ++i) table_[i].label = EMPTY;
+
+    if (old_capacity == 0) {
+      for (size_t i = 0; i < size_; ++i) place(inline_[i].label, inline_[i].value);
+    } else {
+      for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_table[i].label != EMPTY) place(old_table[i].label, old_table[i].value);
+      }
+    }
+  }
+
+  size_t size_;
+  // 0 while the children fit in inline_, otherwise the hash table size
+  size_t capacity_;
+  unsigned shift_;
+  Slot inline_[INLINE_SIZE];
+  std::unique_ptr<Slot[]> table_;
+};
+
+#endif  // CHILD_INDEX_H_
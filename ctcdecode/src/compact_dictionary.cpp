@@ -0,0 +1,176 @@
+#include "compact_dictionary.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+// bytes of n items of type T, padded to 8
+template <typename T>
+size_t padded_size(size_t n) {
+  return (n * sizeof(T) + 7) / 8 * 8;
+}
+
+template <typename T>
+void write_padded(std::ostream &out, const T *items, size_t n) {
+  static const char zeros[8] = {0};
+  size_t size = n * sizeof(T);
+  out.write(reinterpret_cast<const char *>(items), size);
+  out.write(zeros, padded_size<T>(n) - size);
+}
+
+}  // namespace
+
+CompactDictionary::CompactDictionary(const fst::StdVectorFst &fst)
+    : start_(fst.Start()), mask_words_(0) {
+  size_t num_states = fst.NumStates();
+  own_offsets_.reserve(num_states + 1);
+  own_offsets_.push_back(0);
+  own_final_bits_.assign(num_states / 64 + 1, 0);
+
+  int max_label = 0;
+  for (size_t s = 0; s < num_states; ++s) {
+    if (fst.Final(s) != fst::TropicalWeight::Zero()) {
+      own_final_bits_[s >> 6] |= uint64_t(1) << (s & 63);
+    }
+    size_t first = own_arcs_.size();
+    for (fst::ArcIterator<fst::StdVectorFst> aiter(fst, s); !aiter.Done();
+         aiter.Next()) {
+      const fst::StdArc &arc = aiter.Value();
+      own_arcs_.push_back(
+          Arc{arc.ilabel, arc.nextstate, static_cast<int>(arc.weight.Value())});
+      max_label = std::max(max_label, arc.ilabel);
+    }
+    std::sort(own_arcs_.begin() + first, own_arcs_.end(),
+              [](const Arc &a, const Arc &b) { return a.label < b.label; });
+    own_offsets_.push_back(own_arcs_.size());
+  }
+
+  size_t words = max_label / 64 + 1;
+  if (words <= MAX_MASK_WORDS) {
+    mask_words_ = words;
+    own_label_masks_.assign(num_states * words, 0);
+    for (size_t s = 0; s < num_states; ++s) {
+      uint64_t *mask = &own_label_masks_[s * words];
+      for (size_t i = own_offsets_[s]; i < own_offsets_[s + 1]; ++i) {
+        int label = own_arcs_[i].label;
+        mask[label >> 6] |= uint64_t(1) << (label & 63);
+      }
+    }
+  }
+  use_own_tables();
+}
+
+void CompactDictionary::use_own_tables() {
+  num_states_ = own_offsets_.size() - 1;
+  num_arcs_ = own_arcs_.size();
+  offsets_ = own_offsets_.data();
+  arcs_ = own_arcs_.data();
+  final_bits_ = own_final_bits_.data();
+  label_masks_ = own_label_masks_.data();
+}
+
+std::unique_ptr<CompactDictionary> CompactDictionary::from_tables(
+    const char *data,
+    size_t size,
+    std::shared_ptr<const void> storage,
+    size_t *table_size) {
+  if (size < sizeof(TableHeader)) {
+    return nullptr;
+  }
+  const TableHeader *header = reinterpret_cast<const TableHeader *>(data);
+  if (header->mask_words > MAX_MASK_WORDS ||
+      header->num_states >= (uint64_t(1) << 31) ||
+      header->num_arcs >= (uint64_t(1) << 32) ||
+      header->start < -1 ||
+      header->start >= static_cast<int64_t>(header->num_states)) {
+    return nullptr;
+  }
+  size_t num_states = header->num_states;
+  size_t num_arcs = header->num_arcs;
+  size_t offsets_size = padded_size<uint32_t>(num_states + 1);
+  size_t arcs_size = padded_size<Arc>(num_arcs);
+  size_t final_size = padded_size<uint64_t>(num_states / 64 + 1);
+  size_t masks_size = padded_size<uint64_t>(num_states * header->mask_words);
+  size_t total = sizeof(TableHeader) + offsets_size + arcs_size + final_size +
+                 masks_size;
+  if (size < total) {
+    return nullptr;
+  }
+
+  std::unique_ptr<CompactDictionary> dictionary(new CompactDictionary);
+  dictionary->start_ = header->start;
+  dictionary->mask_words_ = header->mask_words;
+  dictionary->num_states_ = num_states;
+  dictionary->num_arcs_ = num_arcs;
+  const char *table = data + sizeof(TableHeader);
+  dictionary->offsets_ = reinterpret_cast<const uint32_t *>(table);
+  table += offsets_size;
+  dictionary->arcs_ = reinterpret_cast<const Arc *>(table);
+  table += arcs_size;
+  dictionary->final_bits_ = reinterpret_cast<const uint64_t *>(table);
+  table += final_size;
+  dictionary->label_masks_ = reinterpret_cast<const uint64_t *>(table);
+  dictionary->storage_ = std::move(storage);
+
+  // lookups trust the offsets, label masks and next states to stay within
+  // the tables, and the arcs of each state to be sorted by label
+  const uint32_t *offsets = dictionary->offsets_;
+  const Arc *arcs = dictionary->arcs_;
+  size_t mask_words = dictionary->mask_words_;
+  if (offsets[0] != 0 || offsets[num_states] != num_arcs) {
+    return nullptr;
+  }
+  for (size_t s = 0; s < num_states; ++s) {
+    if (offsets[s] > offsets[s + 1]) {
+      return nullptr;
+    }
+    for (size_t i = offsets[s]; i < offsets[s + 1]; ++i) {
+      if (arcs[i].label < 0 ||
+          (i > offsets[s] && arcs[i].label <= arcs[i - 1].label)) {
+        return nullptr;
+      }
+    }
+    if (mask_words == 0) {
+      continue;
+    }
+    // the set bits of the mask, in order, must be the labels of the arcs
+    const uint64_t *mask = &dictionary->label_masks_[s * mask_words];
+    size_t i = offsets[s];
+    for (size_t word = 0; word < mask_words; ++word) {
+      for (uint64_t bits = mask[word]; bits != 0; bits &= bits - 1) {
+        int label = static_cast<int>(word * 64 + __builtin_ctzll(bits));
+        if (i == offsets[s + 1] || arcs[i].label != label) {
+          return nullptr;
+        }
+        ++i;
+      }
+    }
+    if (i != offsets[s + 1]) {
+      return nullptr;
+    }
+  }
+  for (size_t i = 0; i < num_arcs; ++i) {
+    int next_state = arcs[i].next_state;
+    if (next_state < 0 || static_cast<size_t>(next_state) >= num_states) {
+      return nullptr;
+    }
+  }
+  *table_size = total;
+  return dictionary;
+}
+
+void CompactDictionary::write(std::ostream &out) const {
+  TableHeader header{start_, mask_words_, num_states_, num_arcs_};
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  write_padded(out, offsets_, num_states_ + 1);
+  write_padded(out, arcs_, num_arcs_);
+  write_padded(out, final_bits_, num_states_ / 64 + 1);
+  write_padded(out, label_masks_, num_states_ * mask_words_);
+}
+
+size_t CompactDictionary::memory_size() const {
+  return (num_states_ + 1) * sizeof(uint32_t) + num_arcs_ * sizeof(Arc) +
+         (num_states_ / 64 + 1) * sizeof(uint64_t) +
+         num_states_ * mask_words_ * sizeof(uint64_t);
+}
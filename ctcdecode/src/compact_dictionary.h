@@ -0,0 +1,149 @@
+#ifndef COMPACT_DICTIONARY_H_
+#define COMPACT_DICTIONARY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include "fst/fstlib.h"
+
+/* Frozen copy of a deterministic dictionary fst, laid out for the spelling
+ * checks of PathTrie.
+ *
+ * The arcs of all states sit in one array, each state's sorted by label and
+ * starting at a per-state offset, and final states are a bitset. When the
+ * labels fit in MAX_MASK_WORDS 64 bit words, each state also has a bitmask
+ * of the labels it accepts: a missing label costs one bit test, and the arc
+ * of a present one is at the popcount of the mask bits below it. With more
+ * labels, the state's arcs are binary searched like the fst matcher does.
+ * Arc weights are kept as the ints number_dictionary_words stores in them.
+ *
+ * The tables can be written out and used in place from a mapped file, see
+ * write and from_tables.
+ */
+class CompactDictionary {
+public:
+  // largest per-state label bitmask, in 64 bit words
+  static const size_t MAX_MASK_WORDS = 4;
+
+  explicit CompactDictionary(const fst::StdVectorFst &fst);
+
+  /* Dictionary over the tables write put at data, used in place: data must
+   * be 8 byte aligned and stay valid as long as storage is held. Stores the
+   * bytes the tables take in table_size. Returns nullptr if they don't fit
+   * in size bytes or are inconsistent.
+   */
+  static std::unique_ptr<CompactDictionary> from_tables(
+      const char *data,
+      size_t size,
+      std::shared_ptr<const void> storage,
+      size_t *table_size);
+
+  CompactDictionary(const CompactDictionary &) = delete;
+  CompactDictionary &operator=(const CompactDictionary &) = delete;
+
+  // start state, -1 if the dictionary is empty
+  int start() const { return start_; }
+
+  bool is_final(int state) const {
+    return state >= 0 && ((final_bits_[state >> 6] >> (state & 63)) & 1);
+  }
+
+  // follow the arc of state labelled label, storing its next state and
+  // weight; return false if there is none
+  bool find(int state, int label, int *next_state, int *weight) const {
+    if (state < 0 || label < 0) {
+      return false;
+    }
+    const Arc *arc;
+    if (mask_words_ > 0) {
+      size_t word = label >> 6;
+      if (word >= mask_words_) {
+        return false;
+      }
+      const uint64_t *mask = &label_masks_[state * mask_words_];
+      uint64_t bit = uint64_t(1) << (label & 63);
+      if ((mask[word] & bit) == 0) {
+        return false;
+      }
+      size_t rank = __builtin_popcountll(mask[word] & (bit - 1));
+      for (size_t i = 0; i < word; ++i) {
+        rank += __builtin_popcountll(mask[i]);
+      }
+      arc = &arcs_[offsets_[state] + rank];
+    } else {
+      const Arc *end = arcs_ + offsets_[state + 1];
+      const Arc *first = arcs_ + offsets_[state];
+      const Arc *last = end;
+      while (first < last) {
+        const Arc *middle = first + (last - first) / 2;
+        if (middle->label < label) {
+          first = middle + 1;
+        } else {
+          last = middle;
+        }
+      }
+      if (first == end || first->label != label) {
+        return false;
+      }
+      arc = first;
+    }
+    *next_state = arc->next_state;
+    *weight = arc->weight;
+    return true;
+  }
+
+  size_t num_states() const { return num_states_; }
+
+  size_t num_arcs() const { return num_arcs_; }
+
+  // bytes taken by the tables
+  size_t memory_size() const;
+
+  // write the tables for from_tables, each padded to 8 bytes
+  void write(std::ostream &out) const;
+
+private:
+  struct Arc {
+    int label;
+    int next_state;
+    int weight;
+  };
+
+  // fixed size start of the written tables
+  struct TableHeader {
+    int64_t start;
+    uint64_t mask_words;
+    uint64_t num_states;
+    uint64_t num_arcs;
+  };
+
+  CompactDictionary() {}
+
+  // point the tables at the vectors below
+  void use_own_tables();
+
+  int start_;
+  // words per label bitmask, 0 when the labels don't fit
+  size_t mask_words_;
+  size_t num_states_;
+  size_t num_arcs_;
+
+  // arcs of state s are arcs_[offsets_[s]] to arcs_[offsets_[s + 1] - 1]
+  const uint32_t *offsets_;
+  const Arc *arcs_;
+  const uint64_t *final_bits_;
+  const uint64_t *label_masks_;
+
+  // tables built by the constructor, empty when they are mapped
+  std::vector<uint32_t> own_offsets_;
+  std::vector<Arc> own_arcs_;
+  std::vector<uint64_t> own_final_bits_;
+  std::vector<uint64_t> own_label_masks_;
+  // keeps mapped tables valid
+  std::shared_ptr<const void> storage_;
+};
+
+#endif  // COMPACT_DICTIONARY_H_
@@ -2,53 +2,108 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <map>
+#include <unordered_map>
 #include <utility>
 
+#include "decode_pool.h"
 #include "decoder_utils.h"
-#include "ThreadPool.h"
-#include "fst/fstlib.h"
 #include "path_trie.h"
 
-using FSTMATCH = fst::SortedMatcher<fst::StdVectorFst>;
+// index of " " in vocabulary, or -2 if it has no space
+static int find_space_id(const std::vector<std::string> &vocabulary) {
+  auto it = std::find(vocabulary.begin(), vocabulary.end(), " ");
+  if (it == vocabulary.end()) {
+    return -2;
+  }
+  return std::distance(vocabulary.begin(), it);
+}
 
-DecoderState::DecoderState(const std::vector<std::string> &vocabulary,
-                           size_t beam_size,
-                           double cutoff_prob,
-                           size_t cutoff_top_n,
-                           size_t blank_id,
-                           int log_input,
-                           Scorer *ext_scorer)
-  : abs_time_step(0)
+// frames between two attempts to fold the labels the beam agrees on out of
+// the trie, see DecoderState::compact_history
+static const int HISTORY_COMPACTION_INTERVAL = 128;
+
+DecoderConfig::DecoderConfig(const std::vector<std::string> &vocabulary,
+                             size_t beam_size,
+                             double cutoff_prob,
+                             size_t cutoff_top_n,
+                             size_t blank_id,
+                             int log_input,
+                             std::shared_ptr<Scorer> ext_scorer,
+                             LogAddMode log_add_mode,
+                             double blank_skip_threshold)
+  : vocabulary(vocabulary)
+  , space_id(find_space_id(vocabulary))
   , beam_size(beam_size)
   , cutoff_prob(cutoff_prob)
   , cutoff_top_n(cutoff_top_n)
   , blank_id(blank_id)
   , log_input(log_input)
-  , vocabulary(vocabulary)
   , ext_scorer(ext_scorer)
+  , log_add_mode(log_add_mode)
+  , blank_skip_log_threshold(blank_skip_threshold < 1.0
+                                 ? std::log(blank_skip_threshold)
+                                 : NUM_FLT_INF)
+  , dictionary(ext_scorer != nullptr && !ext_scorer->is_character_based()
+                   ? ext_scorer->get_compact_dictionary()
+                   : nullptr)
 {
-  // assign space id
-  auto it = std::find(vocabulary.begin(), vocabulary.end(), " ");
-  // if no space in vocabulary
-  if (it == vocabulary.end()) {
-    space_id = -2;
-  } else {
-    space_id = std::distance(vocabulary.begin(), it);
-  }
+  VALID_CHECK_GT(blank_skip_threshold, 0.0,
+                 "blank_skip_threshold must be positive");
+}
+
+// the aliasing constructor of an empty shared_ptr points to the scorer
+// without owning it
+DecoderConfig::DecoderConfig(const std::vector<std::string> &vocabulary,
+                             size_t beam_size,
+                             double cutoff_prob,
+                             size_t cutoff_top_n,
+                             size_t blank_id,
+                             int log_input,
+                             Scorer *ext_scorer,
+                             LogAddMode log_add_mode,
+                             double blank_skip_threshold)
+  : DecoderConfig(vocabulary, beam_size, cutoff_prob, cutoff_top_n, blank_id,
+                  log_input, std::shared_ptr<Scorer>(std::shared_ptr<Scorer>(),
+                                                     ext_scorer),
+                  log_add_mode, blank_skip_threshold)
+{
+}
 
+DecoderState::DecoderState(const std::vector<std::string> &vocabulary,
+                           size_t beam_size,
+                           double cutoff_prob,
+                           size_t cutoff_top_n,
+                           size_t blank_id,
+                           int log_input,
+                           Scorer *ext_scorer,
+                           LogAddMode log_add_mode,
+                           double blank_skip_threshold)
+  : DecoderState(std::make_shared<const DecoderConfig>(
+        vocabulary, beam_size, cutoff_prob, cutoff_top_n, blank_id, log_input,
+        ext_scorer, log_add_mode, blank_skip_threshold))
+{
+}
+
+DecoderState::DecoderState(std::shared_ptr<const DecoderConfig> shared_config)
+  : config(std::move(shared_config))
+  , abs_time_step(0)
+  , num_skipped(0)
+  , committed(&root)
+  , last_partial_start(0)
+{
   // init prefixes' root
+  root.set_pool(&pool);
   root.score = root.log_prob_b_prev = 0.0;
+  root.in_beam = true;
   prefixes.push_back(&root);
 
-  if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
-    auto fst_dict = static_cast<fst::StdVectorFst *>(ext_scorer->dictionary);
-    fst::StdVectorFst *dict_ptr = fst_dict->Copy(true);
-    root.set_dictionary(dict_ptr);
-    auto matcher = std::make_shared<FSTMATCH>(*dict_ptr, fst::MATCH_INPUT);
-    root.set_matcher(matcher);
+  if (config->dictionary != nullptr) {
+    root.set_dictionary(config->dictionary);
   }
 }
 
@@ -60,110 +115,195 @@ DecoderState::next(const std::vector<std::vector<double>> &probs_seq)
   size_t num_time_steps = probs_seq.size();
   for (size_t i = 0; i < num_time_steps; ++i) {
     VALID_CHECK_EQ(probs_seq[i].size(),
-                   vocabulary.size(),
+                   config->vocabulary.size(),
                    "The shape of probs_seq does not match with "
                    "the shape of the vocabulary");
   }
 
   // prefix search over time
-  for (size_t time_step = 0; time_step < num_time_steps; ++time_step, ++abs_time_step) {
+  for (size_t time_step = 0; time_step < num_time_steps; ++time_step) {
     auto &prob = probs_seq[time_step];
+    double blank_prob = prob[config->blank_id];
+    float blank_log_prob = config->log_input ? blank_prob : std::log(blank_prob);
+    if (blank_log_prob > config->blank_skip_log_threshold) {
+      skip_frame(blank_log_prob);
+      continue;
+    }
+    get_pruned_log_probs(prob, config->cutoff_prob, config->cutoff_top_n,
+                         config->log_input, log_prob_idx, pruning_scratch);
+    next_frame(log_prob_idx, blank_log_prob);
+  }
+}
 
-    float min_cutoff = -NUM_FLT_INF;
-    bool full_beam = false;
-    if (ext_scorer != nullptr) {
-      size_t num_prefixes = std::min(prefixes.size(), beam_size);
-      std::sort(
-          prefixes.begin(), prefixes.begin() + num_prefixes, prefix_compare);
-      float blank_prob = log_input ? prob[blank_id] : std::log(prob[blank_id]);
-      min_cutoff = prefixes[num_prefixes - 1]->score +
-                   blank_prob - std::max(0.0, ext_scorer->beta);
-      full_beam = (num_prefixes == beam_size);
+void
+DecoderState::next(const ProbsView &probs)
+{
+  // dimension check
+  VALID_CHECK_EQ(probs.vocab_size,
+                 config->vocabulary.size(),
+                 "The shape of probs does not match with "
+                 "the shape of the vocabulary");
+
+  // prefix search over time
+  for (size_t time_step = 0; time_step < probs.num_time_steps; ++time_step) {
+    const float *prob = probs.frame(time_step);
+    double blank_prob = prob[config->blank_id * probs.vocab_stride];
+    float blank_log_prob = config->log_input ? blank_prob : std::log(blank_prob);
+    if (blank_log_prob > config->blank_skip_log_threshold) {
+      skip_frame(blank_log_prob);
+      continue;
     }
+    get_pruned_log_probs(prob,
+                         probs.vocab_size,
+                         probs.vocab_stride,
+                         config->cutoff_prob,
+                         config->cutoff_top_n,
+                         config->log_input,
+                         log_prob_idx,
+                         pruning_scratch);
+    next_frame(log_prob_idx, blank_log_prob);
+  }
+}
 
-    std::vector<std::pair<size_t, float>> log_prob_idx =
-        get_pruned_log_probs(prob, cutoff_prob, cutoff_top_n, log_input);
-    // loop over chars
-    for (size_t index = 0; index < log_prob_idx.size(); index++) {
-      auto c = log_prob_idx[index].first;
-      auto log_prob_c = log_prob_idx[index].second;
-
-      for (size_t i = 0; i < prefixes.size() && i < beam_size; ++i) {
-        auto prefix = prefixes[i];
-        if (full_beam && log_prob_c + prefix->score < min_cutoff) {
-          break;
-        }
-        // blank
-        if (c == blank_id) {
-          prefix->log_prob_b_cur =
-              log_sum_exp(prefix->log_prob_b_cur, log_prob_c + prefix->score);
-          continue;
+void
+DecoderState::next_frame(
+    const std::vector<std::pair<size_t, float>> &log_prob_idx,
+    float blank_prob)
+{
+  Scorer *ext_scorer = config->ext_scorer.get();
+  float min_cutoff = -NUM_FLT_INF;
+  bool full_beam = false;
+  if (ext_scorer != nullptr) {
+    size_t num_prefixes = std::min(prefixes.size(), config->beam_size);
+    std::sort(
+        prefixes.begin(), prefixes.begin() + num_prefixes, prefix_compare);
+    min_cutoff = prefixes[num_prefixes - 1]->score +
+                 blank_prob - std::max(0.0, ext_scorer->beta);
+    full_beam = (num_prefixes == config->beam_size);
+  }
+
+  // loop over chars
+  for (size_t index = 0; index < log_prob_idx.size(); index++) {
+    auto c = log_prob_idx[index].first;
+    auto log_prob_c = log_prob_idx[index].second;
+
+    for (size_t i = 0; i < prefixes.size() && i < config->beam_size; ++i) {
+      auto prefix = prefixes[i];
+      if (full_beam && log_prob_c + prefix->score < min_cutoff) {
+        break;
+      }
+      // blank
+      if (c == config->blank_id) {
+        prefix->log_prob_b_cur =
+            log_sum_exp(prefix->log_prob_b_cur, log_prob_c + prefix->score,
+                      config->log_add_mode);
+        continue;
+      }
+      // repeated character
+      if (c == prefix->character) {
+        prefix->log_prob_nb_cur = log_sum_exp(
+            prefix->log_prob_nb_cur, log_prob_c + prefix->log_prob_nb_prev,
+            config->log_add_mode);
+      }
+      // get new prefix
+      auto prefix_new = prefix->get_path_trie(c, abs_time_step, log_prob_c);
+
+      if (prefix_new != nullptr) {
+        if (!prefix_new->in_beam) {
+          prefix_new->in_beam = true;
+          new_prefixes.push_back(prefix_new);
         }
-        // repeated character
-        if (c == prefix->character) {
-          prefix->log_prob_nb_cur = log_sum_exp(
-              prefix->log_prob_nb_cur, log_prob_c + prefix->log_prob_nb_prev);
+
+        float log_p = -NUM_FLT_INF;
+
+        if (c == prefix->character &&
+            prefix->log_prob_b_prev > -NUM_FLT_INF) {
+          log_p = log_prob_c + prefix->log_prob_b_prev;
+        } else if (c != prefix->character) {
+          log_p = log_prob_c + prefix->score;
         }
-        // get new prefix
-        auto prefix_new = prefix->get_path_trie(c, abs_time_step, log_prob_c);
-
-        if (prefix_new != nullptr) {
-          float log_p = -NUM_FLT_INF;
-
-          if (c == prefix->character &&
-              prefix->log_prob_b_prev > -NUM_FLT_INF) {
-            log_p = log_prob_c + prefix->log_prob_b_prev;
-          } else if (c != prefix->character) {
-            log_p = log_prob_c + prefix->score;
-          }
-
-          // language model scoring
-          if (ext_scorer != nullptr &&
-              (c == space_id || ext_scorer->is_character_based())) {
-            PathTrie *prefix_to_score = nullptr;
-            // skip scoring the space
-            if (ext_scorer->is_character_based()) {
-              prefix_to_score = prefix_new;
-            } else {
-              prefix_to_score = prefix;
-            }
-
-            float score = 0.0;
-            std::vector<std::string> ngram;
-            ngram = ext_scorer->make_ngram(prefix_to_score);
-            score = ext_scorer->get_log_cond_prob(ngram) * ext_scorer->alpha;
-            log_p += score;
-            log_p += ext_scorer->beta;
-          }
-          prefix_new->log_prob_nb_cur =
-              log_sum_exp(prefix_new->log_prob_nb_cur, log_p);
+
+        // language model scoring, from the lm state cached in the trie; a
+        // word based lm scores the word before the space
+        if (ext_scorer != nullptr &&
+            (c == config->space_id || ext_scorer->is_character_based())) {
+          float score = 0.0;
+          score = ext_scorer->get_log_cond_prob(prefix_new) * ext_scorer->alpha;
+          log_p += score;
+          log_p += ext_scorer->beta;
         }
-      }  // end of loop over prefix
-    }    // end of loop over vocabulary
-
-
-    prefixes.clear();
-    // update log probs
-    root.iterate_to_vec(prefixes);
-
-    // only preserve top beam_size prefixes
-    if (prefixes.size() >= beam_size) {
-      std::nth_element(prefixes.begin(),
-                       prefixes.begin() + beam_size,
-                       prefixes.end(),
-                       prefix_compare);
-      for (size_t i = beam_size; i < prefixes.size(); ++i) {
-        prefixes[i]->remove();
+        prefix_new->log_prob_nb_cur =
+            log_sum_exp(prefix_new->log_prob_nb_cur, log_p, config->log_add_mode);
       }
+    }  // end of loop over prefix
+  }    // end of loop over vocabulary
+
 
-      prefixes.resize(beam_size);
+  // the live prefixes are the previous beam plus the nodes that were
+  // extended into this frame, so there is no need to walk the whole trie
+  prefixes.insert(prefixes.end(), new_prefixes.begin(), new_prefixes.end());
+  new_prefixes.clear();
+
+  // update log probs, scoring all prefixes of the frame in one batch
+  size_t num_prefixes = prefixes.size();
+  prefix_log_probs_b.resize(num_prefixes);
+  prefix_log_probs_nb.resize(num_prefixes);
+  prefix_scores.resize(num_prefixes);
+  for (size_t i = 0; i < num_prefixes; ++i) {
+    prefix_log_probs_b[i] = prefixes[i]->log_prob_b_cur;
+    prefix_log_probs_nb[i] = prefixes[i]->log_prob_nb_cur;
+  }
+  log_sum_exp_batch(prefix_log_probs_b.data(),
+                    prefix_log_probs_nb.data(),
+                    prefix_scores.data(),
+                    num_prefixes,
+                    config->log_add_mode);
+  for (size_t i = 0; i < num_prefixes; ++i) {
+    prefixes[i]->shift_log_probs(prefix_scores[i]);
+  }
+
+  // only preserve top beam_size prefixes
+  if (prefixes.size() >= config->beam_size) {
+    std::nth_element(prefixes.begin(),
+                     prefixes.begin() + config->beam_size,
+                     prefixes.end(),
+                     prefix_compare);
+    for (size_t i = config->beam_size; i < prefixes.size(); ++i) {
+      prefixes[i]->in_beam = false;
+      prefixes[i]->remove();
     }
-  }  // end of loop over time
+
+    prefixes.resize(config->beam_size);
+  }
+
+  ++abs_time_step;
+  if (abs_time_step % HISTORY_COMPACTION_INTERVAL == 0) {
+    compact_history();
+  }
+}
+
+void
+DecoderState::skip_frame(float blank_prob)
+{
+  // with the repeated-character paths dropped, every score moves by the same
+  // blank_prob, so the beam keeps its members and their order
+  for (PathTrie *prefix : prefixes) {
+    prefix->log_prob_b_prev = prefix->score + blank_prob;
+    prefix->log_prob_nb_prev = -NUM_FLT_INF;
+    prefix->score = prefix->log_prob_b_prev;
+  }
+
+  ++num_skipped;
+  ++abs_time_step;
+  if (abs_time_step % HISTORY_COMPACTION_INTERVAL == 0) {
+    compact_history();
+  }
 }
 
 std::vector<std::pair<double, Output>>
 DecoderState::decode()
 {
+  Scorer *ext_scorer = config->ext_scorer.get();
   std::vector<PathTrie*> prefixes_copy = prefixes;
   std::unordered_map<const PathTrie*, float> scores;
   for (PathTrie* prefix : prefixes_copy) {
@@ -172,12 +312,11 @@ DecoderState::decode()
 
   // score the last word of each prefix that doesn't end with space
   if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
-    for (size_t i = 0; i < beam_size && i < prefixes_copy.size(); ++i) {
+    for (size_t i = 0; i < config->beam_size && i < prefixes_copy.size(); ++i) {
       auto prefix = prefixes_copy[i];
-      if (!prefix->is_empty() && prefix->character != space_id) {
+      if (!prefix->is_empty() && prefix->character != config->space_id) {
         float score = 0.0;
-        std::vector<std::string> ngram = ext_scorer->make_ngram(prefix);
-        score = ext_scorer->get_log_cond_prob(ngram) * ext_scorer->alpha;
+        score = ext_scorer->get_last_word_log_cond_prob(prefix) * ext_scorer->alpha;
         score += ext_scorer->beta;
         scores[prefix] += score;
       }
@@ -185,29 +324,428 @@ DecoderState::decode()
   }
 
   using namespace std::placeholders;
-  size_t num_prefixes = std::min(prefixes_copy.size(), beam_size);
+  size_t num_prefixes = std::min(prefixes_copy.size(), config->beam_size);
   std::sort(prefixes_copy.begin(), prefixes_copy.begin() + num_prefixes,
             std::bind(prefix_compare_external_scores, _1, _2, scores));
 
   // compute aproximate ctc score as the return score, without affecting the
   // return order of decoding result. To delete when decoder gets stable.
-  for (size_t i = 0; i < beam_size && i < prefixes_copy.size(); ++i) {
+  for (size_t i = 0; i < config->beam_size && i < prefixes_copy.size(); ++i) {
     double approx_ctc = scores[prefixes_copy[i]];
     if (ext_scorer != nullptr) {
-      std::vector<int> output;
-      std::vector<int> timesteps;
-      prefixes_copy[i]->get_path_vec(output, timesteps);
-      auto prefix_length = output.size();
-      auto words = ext_scorer->split_labels(output);
       // remove word insert
-      approx_ctc = approx_ctc - prefix_length * ext_scorer->beta;
-      // remove language model weight:
-      approx_ctc -= (ext_scorer->get_sent_log_prob(words)) * ext_scorer->alpha;
+      approx_ctc = approx_ctc - prefixes_copy[i]->depth * ext_scorer->beta;
+      // remove language model weight, from the scores kept in the trie
+      approx_ctc -= (ext_scorer->get_sent_log_prob(prefixes_copy[i])) * ext_scorer->alpha;
     }
     prefixes_copy[i]->approx_ctc = approx_ctc;
   }
 
-  return get_beam_search_result(prefixes_copy, beam_size);
+  std::vector<std::pair<double, Output>> results =
+      get_beam_search_result(prefixes_copy, config->beam_size);
+  // put back the labels folded out of the trie
+  if (!history_tokens.empty()) {
+    for (auto &result : results) {
+      Output &output = result.second;
+      output.tokens.insert(output.tokens.begin(), history_tokens.begin(),
+                           history_tokens.end());
+      output.timesteps.insert(output.timesteps.begin(),
+                              history_timesteps.begin(),
+                              history_timesteps.end());
+    }
+  }
+  return results;
+}
+
+// deepest node that both a and b descend from
+static PathTrie *common_ancestor(PathTrie *a, PathTrie *b) {
+  while (a->depth > b->depth) {
+    a = a->parent;
+  }
+  while (b->depth > a->depth) {
+    b = b->parent;
+  }
+  while (a != b) {
+    a = a->parent;
+    b = b->parent;
+  }
+  return a;
+}
+
+PartialOutput
+DecoderState::partial(bool changes_only)
+{
+  PathTrie *best =
+      *std::min_element(prefixes.begin(), prefixes.end(), prefix_compare);
+
+  // every prefix descends from the previous committed node, so the walks
+  // stop at or below it
+  PathTrie *common = best;
+  for (PathTrie *prefix : prefixes) {
+    common = common_ancestor(common, prefix);
+  }
+  committed = common;
+
+  // the labels of best below the previous committed depth, which the
+  // previous result shares
+  std::vector<int> tokens;
+  std::vector<int> timesteps;
+  get_path(best, last_partial_start, tokens, timesteps);
+  size_t num_same = 0;
+  while (num_same < tokens.size() &&
+         num_same < last_partial_tokens.size() &&
+         tokens[num_same] == last_partial_tokens[num_same]) {
+    ++num_same;
+  }
+
+  PartialOutput result;
+  result.length = best->depth;
+  result.num_committed = committed->depth;
+  result.num_unchanged = last_partial_start + num_same;
+  result.score = best->score;
+  if (changes_only) {
+    result.tokens.assign(tokens.begin() + num_same, tokens.end());
+    result.timesteps.assign(timesteps.begin() + num_same, timesteps.end());
+  } else {
+    get_path(best, 0, result.tokens, result.timesteps);
+  }
+
+  // keep only what the next call can still find changed
+  last_partial_tokens.assign(
+      tokens.begin() + (committed->depth - last_partial_start), tokens.end());
+  last_partial_start = committed->depth;
+  return result;
+}
+
+void
+DecoderState::get_path(PathTrie *node,
+                       size_t start,
+                       std::vector<int> &tokens,
+                       std::vector<int> &timesteps) const
+{
+  size_t num_folded = history_tokens.size();
+  if (start < num_folded) {
+    tokens.insert(tokens.end(), history_tokens.begin() + start,
+                  history_tokens.end());
+    timesteps.insert(timesteps.end(), history_timesteps.begin() + start,
+                     history_timesteps.end());
+  }
+  // get_path_vec reverses all of its output, so collect the rest apart
+  std::vector<int> node_tokens;
+  std::vector<int> node_timesteps;
+  node->get_path_vec(node_tokens, node_timesteps, -1,
+                     node->depth - std::max(start, num_folded));
+  tokens.insert(tokens.end(), node_tokens.begin(), node_tokens.end());
+  timesteps.insert(timesteps.end(), node_timesteps.begin(),
+                   node_timesteps.end());
+}
+
+void
+DecoderState::compact_history()
+{
+  PathTrie *common = prefixes.front();
+  for (PathTrie *prefix : prefixes) {
+    common = common_ancestor(common, prefix);
+  }
+
+  // the new root must carry all the scorer needs of what comes before it:
+  // a word based lm restarts at spaces, a character based one anywhere
+  Scorer *ext_scorer = config->ext_scorer.get();
+  PathTrie *node = common;
+  if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
+    while (node != &root && node->character != config->space_id) {
+      node = node->parent;
+    }
+  }
+  if (node == &root) {
+    return;
+  }
+  if (ext_scorer != nullptr) {
+    ext_scorer->get_log_cond_prob(node);
+  }
+
+  std::vector<int> tokens;
+  std::vector<int> timesteps;
+  node->get_path_vec(tokens, timesteps);
+  history_tokens.insert(history_tokens.end(), tokens.begin(), tokens.end());
+  history_timesteps.insert(history_timesteps.end(), timesteps.begin(),
+                           timesteps.end());
+
+  // committed is node or one of its ancestors unless it is deeper
+  if (committed->depth <= node->depth) {
+    committed = &root;
+  }
+  std::replace(prefixes.begin(), prefixes.end(), node, &root);
+  root.reroot(node);
+}
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = {'C', 'T', 'C', 'S', 'T', 'A', 'T', 'E'};
+// bump on any change to the layout below or to PathTrieRecord
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+// start of a DecoderState snapshot, followed by the folded labels, their
+// timesteps, the labels of the last partial result, the PathTrieRecord of
+// every trie node after its parent's, and the record index of each prefix
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t key;
+  uint32_t record_size;
+  int32_t abs_time_step;
+  uint64_t num_skipped;
+  uint64_t last_partial_start;
+  uint64_t num_folded;
+  uint64_t num_last_partial_tokens;
+  uint64_t num_nodes;
+  uint64_t num_prefixes;
+  // record index of the committed node
+  uint64_t committed;
+};
+
+// fingerprint of the configuration the beam of a snapshot depends on
+uint64_t config_key(const DecoderConfig &config) {
+  uint64_t hash = HASH_SEED;
+  uint64_t count = config.vocabulary.size();
+  hash_bytes(&count, sizeof(count), &hash);
+  for (const auto &label : config.vocabulary) {
+    hash_string(label, &hash);
+  }
+  uint64_t settings[] = {config.beam_size,
+                         config.cutoff_top_n,
+                         config.blank_id,
+                         static_cast<uint64_t>(config.log_input),
+                         static_cast<uint64_t>(config.log_add_mode)};
+  hash_bytes(settings, sizeof(settings), &hash);
+  hash_bytes(&config.cutoff_prob, sizeof(config.cutoff_prob), &hash);
+  hash_bytes(&config.blank_skip_log_threshold,
+             sizeof(config.blank_skip_log_threshold), &hash);
+  uint64_t model_key = 0;
+  if (config.ext_scorer != nullptr) {
+    model_key = config.ext_scorer->get_model_key();
+  }
+  hash_bytes(&model_key, sizeof(model_key), &hash);
+  return hash;
+}
+
+template <typename T>
+void write_items(std::ostream &out, const T *items, size_t n) {
+  out.write(reinterpret_cast<const char *>(items), n * sizeof(T));
+}
+
+// read n items from the front of data, return false if it is too short
+template <typename T>
+bool read_items(const char **data, size_t *size, uint64_t n,
+                std::vector<T> *items) {
+  if (n > *size / sizeof(T)) {
+    return false;
+  }
+  items->resize(n);
+  if (n > 0) {
+    // data need not be aligned for T
+    std::memcpy(items->data(), *data, n * sizeof(T));
+  }
+  *data += n * sizeof(T);
+  *size -= n * sizeof(T);
+  return true;
+}
+
+// whether child's dictionary state is the one get_path_trie gives it
+bool valid_dictionary_step(const CompactDictionary &dictionary,
+                           const PathTrieRecord &parent,
+                           const PathTrieRecord &child) {
+  int next_state;
+  int weight;
+  if (!dictionary.find(parent.dictionary_state, child.character + 1,
+                       &next_state, &weight)) {
+    return false;
+  }
+  int rank = parent.dictionary_rank + weight;
+  if (dictionary.is_final(next_state)) {
+    return child.dictionary_state == dictionary.start() &&
+           child.dictionary_rank == 0 && child.dictionary_word == rank;
+  }
+  return child.dictionary_state == next_state &&
+         child.dictionary_rank == rank && child.dictionary_word == -1;
+}
+
+}  // namespace
+
+void
+DecoderState::snapshot(std::ostream &out) const
+{
+  std::vector<const PathTrie *> nodes;
+  root.collect(nodes);
+  std::unordered_map<const PathTrie *, uint64_t> index;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    index[nodes[i]] = i;
+  }
+
+  SnapshotHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.key = config_key(*config);
+  header.record_size = sizeof(PathTrieRecord);
+  header.abs_time_step = abs_time_step;
+  header.num_skipped = num_skipped;
+  header.last_partial_start = last_partial_start;
+  header.num_folded = history_tokens.size();
+  header.num_last_partial_tokens = last_partial_tokens.size();
+  header.num_nodes = nodes.size();
+  header.num_prefixes = prefixes.size();
+  header.committed = index.at(committed);
+  write_items(out, &header, 1);
+  write_items(out, history_tokens.data(), history_tokens.size());
+  write_items(out, history_timesteps.data(), history_timesteps.size());
+  write_items(out, last_partial_tokens.data(), last_partial_tokens.size());
+
+  PathTrieRecord record;
+  for (const PathTrie *node : nodes) {
+    node->get_record(&record);
+    if (node->parent != nullptr) {
+      record.parent = index.at(node->parent);
+    }
+    write_items(out, &record, 1);
+  }
+  std::vector<uint64_t> prefix_indices;
+  for (const PathTrie *prefix : prefixes) {
+    prefix_indices.push_back(index.at(prefix));
+  }
+  write_items(out, prefix_indices.data(), prefix_indices.size());
+}
+
+std::unique_ptr<DecoderState>
+DecoderState::from_snapshot(std::shared_ptr<const DecoderConfig> shared_config,
+                            const char *data,
+                            size_t size)
+{
+  SnapshotHeader header;
+  if (size < sizeof(header)) {
+    return nullptr;
+  }
+  std::memcpy(&header, data, sizeof(header));
+  data += sizeof(header);
+  size -= sizeof(header);
+  if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SNAPSHOT_VERSION ||
+      header.byte_order != SNAPSHOT_BYTE_ORDER ||
+      header.record_size != sizeof(PathTrieRecord) ||
+      header.key != config_key(*shared_config) ||
+      header.abs_time_step < 0 || header.num_nodes == 0 ||
+      header.num_prefixes == 0 || header.committed >= header.num_nodes) {
+    return nullptr;
+  }
+
+  std::vector<int> history_tokens;
+  std::vector<int> history_timesteps;
+  std::vector<int> last_partial_tokens;
+  std::vector<PathTrieRecord> records;
+  std::vector<uint64_t> prefix_indices;
+  if (!read_items(&data, &size, header.num_folded, &history_tokens) ||
+      !read_items(&data, &size, header.num_folded, &history_timesteps) ||
+      !read_items(&data, &size, header.num_last_partial_tokens,
+                  &last_partial_tokens) ||
+      !read_items(&data, &size, header.num_nodes, &records) ||
+      !read_items(&data, &size, header.num_prefixes, &prefix_indices) ||
+      size != 0) {
+    return nullptr;
+  }
+
+  // check everything decoding on relies on, in particular every index, label
+  // and lm or dictionary state that is looked up with
+  const DecoderConfig &config = *shared_config;
+  const CompactDictionary *dictionary = config.dictionary;
+  Scorer *ext_scorer = config.ext_scorer.get();
+  int num_labels = config.vocabulary.size();
+  int num_words = ext_scorer != nullptr ? ext_scorer->get_dict_size() : 0;
+  for (size_t i = 0; i < records.size(); ++i) {
+    const PathTrieRecord &record = records[i];
+    if (i == 0) {
+      if (record.parent != -1 || record.character < -1 ||
+          record.character >= num_labels ||
+          static_cast<uint64_t>(record.depth) != header.num_folded) {
+        return nullptr;
+      }
+    } else {
+      if (record.parent < 0 || static_cast<size_t>(record.parent) >= i ||
+          record.character < 0 || record.character >= num_labels ||
+          record.depth != records[record.parent].depth + 1) {
+        return nullptr;
+      }
+    }
+    if ((record.has_dictionary != 0) != (dictionary != nullptr)) {
+      return nullptr;
+    }
+    if (dictionary != nullptr) {
+      bool valid =
+          i == 0 ? record.dictionary_state == dictionary->start() &&
+                       record.dictionary_rank == 0 &&
+                       record.dictionary_word >= -1 &&
+                       record.dictionary_word < num_words
+                 : valid_dictionary_step(
+                       *dictionary, records[record.parent], record);
+      if (!valid) {
+        return nullptr;
+      }
+    }
+    if (record.has_lm_state &&
+        (ext_scorer == nullptr || !ext_scorer->is_valid_state(record.lm_state))) {
+      return nullptr;
+    }
+  }
+  const PathTrieRecord &committed_record = records[header.committed];
+  if (header.last_partial_start >
+      static_cast<uint64_t>(committed_record.depth)) {
+    return nullptr;
+  }
+  for (uint64_t prefix : prefix_indices) {
+    if (prefix >= records.size() || !records[prefix].exists) {
+      return nullptr;
+    }
+    // committed must be shared by every prefix
+    while (records[prefix].depth > committed_record.depth) {
+      prefix = records[prefix].parent;
+    }
+    if (prefix != header.committed) {
+      return nullptr;
+    }
+  }
+
+  std::unique_ptr<DecoderState> state(
+      new DecoderState(std::move(shared_config)));
+  std::vector<PathTrie *> nodes(records.size());
+  nodes[0] = &state->root;
+  state->root.set_record(records[0]);
+  state->root.in_beam = false;
+  for (size_t i = 1; i < records.size(); ++i) {
+    nodes[i] = nodes[records[i].parent]->add_child(records[i]);
+    if (nodes[i] == nullptr) {
+      // two children with the same label
+      return nullptr;
+    }
+  }
+  state->prefixes.clear();
+  for (uint64_t prefix : prefix_indices) {
+    if (nodes[prefix]->in_beam) {
+      return nullptr;
+    }
+    nodes[prefix]->in_beam = true;
+    state->prefixes.push_back(nodes[prefix]);
+  }
+
+  state->abs_time_step = header.abs_time_step;
+  state->num_skipped = header.num_skipped;
+  state->committed = nodes[header.committed];
+  state->last_partial_start = header.last_partial_start;
+  state->last_partial_tokens = std::move(last_partial_tokens);
+  state->history_tokens = std::move(history_tokens);
+  state->history_timesteps = std::move(history_timesteps);
+  return state;
 }
 
 std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
@@ -218,17 +756,38 @@ std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
     size_t cutoff_top_n,
     size_t blank_id,
     int log_input,
-    Scorer *ext_scorer)
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold)
 {
   DecoderState state(vocabulary, beam_size, cutoff_prob, cutoff_top_n, blank_id,
-                     log_input, ext_scorer);
+                     log_input, ext_scorer, log_add_mode, blank_skip_threshold);
   state.next(probs_seq);
   return state.decode();
 }
 
+std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
+    const ProbsView &probs,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    int log_input,
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold)
+{
+  DecoderState state(vocabulary, beam_size, cutoff_prob, cutoff_top_n, blank_id,
+                     log_input, ext_scorer, log_add_mode, blank_skip_threshold);
+  state.next(probs);
+  return state.decode();
+}
+
 
+template <typename Probs>
 std::vector<std::pair<double, Output>>  ctc_beam_search_decoder_with_given_state(
-    const std::vector<std::vector<double>> &probs_seq,
+    const Probs &probs_seq,
     DecoderState *state,
     bool is_eos)
     {
@@ -242,76 +801,300 @@ std::vector<std::pair<double, Output>>  ctc_beam_search_decoder_with_given_state
 
     }
 
-std::vector<std::vector<std::pair<double, Output>>>
-ctc_beam_search_decoder_batch(
-    const std::vector<std::vector<std::vector<double>>> &probs_split,
+// Number of time steps of one input, for estimating decoding costs
+static size_t num_frames(const std::vector<std::vector<double>> &probs) {
+  return probs.size();
+}
+
+static size_t num_frames(const ProbsView &probs) {
+  return probs.num_time_steps;
+}
+
+// Decoding tasks of a batch, one per sample, each filling its entry of
+// batch_results (and num_skipped_frames, if given), and their costs: about
+// the sample's number of frames. The tasks refer to probs_split and the
+// outputs, which are sized here.
+template <typename Probs>
+std::function<void(size_t)> batch_tasks(
+    const std::vector<Probs> &probs_split,
     const std::vector<std::string> &vocabulary,
     size_t beam_size,
-    size_t num_processes,
     double cutoff_prob,
     size_t cutoff_top_n,
     size_t blank_id,
     int log_input,
-    Scorer *ext_scorer)
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold,
+    std::vector<std::vector<std::pair<double, Output>>> *batch_results,
+    std::vector<size_t> *num_skipped_frames,
+    std::vector<double> *costs)
 {
-  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
-  // thread pool
-  ThreadPool pool(num_processes);
   // number of samples
   size_t batch_size = probs_split.size();
+  batch_results->assign(batch_size, {});
+  if (num_skipped_frames != nullptr) {
+    num_skipped_frames->assign(batch_size, 0);
+  }
 
-  // enqueue the tasks of decoding
-  std::vector<std::future<std::vector<std::pair<double, Output>>>> res;
+  costs->resize(batch_size);
   for (size_t i = 0; i < batch_size; ++i) {
-    res.emplace_back(pool.enqueue(ctc_beam_search_decoder,
-                                  std::cref(probs_split[i]),
-                                  std::cref(vocabulary),
-                                  beam_size,
-                                  cutoff_prob,
-                                  cutoff_top_n,
-                                  blank_id,
-                                  log_input,
-                                  ext_scorer));
+    (*costs)[i] = num_frames(probs_split[i]);
   }
+  auto config = std::make_shared<const DecoderConfig>(
+      vocabulary, beam_size, cutoff_prob, cutoff_top_n, blank_id, log_input,
+      ext_scorer, log_add_mode, blank_skip_threshold);
+  const std::vector<Probs> *probs = &probs_split;
+  return [probs, config, batch_results, num_skipped_frames](size_t i) {
+    DecoderState state(config);
+    state.next((*probs)[i]);
+    if (num_skipped_frames != nullptr) {
+      (*num_skipped_frames)[i] = state.num_skipped_frames();
+    }
+    (*batch_results)[i] = state.decode();
+  };
+}
 
+// Decoding tasks of a batch of streams, see batch_tasks, costing about the
+// sample's number of frames times the number of prefixes its beam holds
+template <typename Probs>
+std::function<void(size_t)> batch_tasks_with_states(
+    const std::vector<Probs> &probs_split,
+    const std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s,
+    std::vector<std::vector<std::pair<double, Output>>> *batch_results,
+    std::vector<double> *costs)
+{
+  // number of samples
+  size_t batch_size = probs_split.size();
+  batch_results->assign(batch_size, {});
 
-
-  // get decoding results
-  std::vector<std::vector<std::pair<double, Output>>> batch_results;
+  costs->resize(batch_size);
   for (size_t i = 0; i < batch_size; ++i) {
-    batch_results.emplace_back(res[i].get());
+    const DecoderState *state = static_cast<DecoderState*>(states[i]);
+    (*costs)[i] = static_cast<double>(num_frames(probs_split[i])) *
+                  std::max<size_t>(state->num_prefixes(), 1);
   }
+  const std::vector<Probs> *probs = &probs_split;
+  return [probs, states, is_eos_s, batch_results](size_t i) {
+    (*batch_results)[i] = ctc_beam_search_decoder_with_given_state(
+        (*probs)[i], static_cast<DecoderState*>(states[i]), is_eos_s[i]);
+  };
+}
+
+// Shared by the batch entry points for both input representations
+template <typename Probs>
+std::vector<std::vector<std::pair<double, Output>>>
+decode_batch(
+    const std::vector<Probs> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    DecodePool &pool,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    int log_input,
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold,
+    std::vector<size_t> *num_skipped_frames)
+{
+  std::vector<std::vector<std::pair<double, Output>>> batch_results;
+  std::vector<double> costs;
+  pool.run(probs_split.size(),
+           batch_tasks(probs_split, vocabulary, beam_size, cutoff_prob,
+                       cutoff_top_n, blank_id, log_input, ext_scorer,
+                       log_add_mode, blank_skip_threshold, &batch_results,
+                       num_skipped_frames, &costs),
+           &costs);
   return batch_results;
 }
 
+template <typename Probs>
+std::vector<std::vector<std::pair<double, Output>>>
+decode_batch_with_states(
+    const std::vector<Probs> &probs_split,
+    DecodePool &pool,
+    std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s)
+{
+  std::vector<std::vector<std::pair<double, Output>>> batch_results;
+  std::vector<double> costs;
+  pool.run(probs_split.size(),
+           batch_tasks_with_states(probs_split, states, is_eos_s,
+                                   &batch_results, &costs),
+           &costs);
+  return batch_results;
+}
+
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch(
+    const std::vector<std::vector<std::vector<double>>> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    int log_input,
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold,
+    std::vector<size_t> *num_skipped_frames)
+{
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  DecodePool pool(num_processes);
+  return decode_batch(probs_split, vocabulary, beam_size, pool,
+                      cutoff_prob, cutoff_top_n, blank_id, log_input,
+                      ext_scorer, log_add_mode, blank_skip_threshold,
+                      num_skipped_frames);
+}
+
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch(
+    const std::vector<ProbsView> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    int log_input,
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold,
+    std::vector<size_t> *num_skipped_frames)
+{
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  DecodePool pool(num_processes);
+  return decode_batch(probs_split, vocabulary, beam_size, pool,
+                      cutoff_prob, cutoff_top_n, blank_id, log_input,
+                      ext_scorer, log_add_mode, blank_skip_threshold,
+                      num_skipped_frames);
+}
+
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch(
+    const std::vector<std::vector<std::vector<double>>> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    DecodePool &pool,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    int log_input,
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold,
+    std::vector<size_t> *num_skipped_frames)
+{
+  return decode_batch(probs_split, vocabulary, beam_size, pool,
+                      cutoff_prob, cutoff_top_n, blank_id, log_input,
+                      ext_scorer, log_add_mode, blank_skip_threshold,
+                      num_skipped_frames);
+}
+
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch(
+    const std::vector<ProbsView> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    DecodePool &pool,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    int log_input,
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold,
+    std::vector<size_t> *num_skipped_frames)
+{
+  return decode_batch(probs_split, vocabulary, beam_size, pool,
+                      cutoff_prob, cutoff_top_n, blank_id, log_input,
+                      ext_scorer, log_add_mode, blank_skip_threshold,
+                      num_skipped_frames);
+}
+
 
 std::vector<std::vector<std::pair<double, Output>>> ctc_beam_search_decoder_batch_with_states
 (const std::vector<std::vector<std::vector<double>>> &probs_split,
     size_t num_processes,
     std::vector<void*> &states,
     const std::vector<bool> &is_eos_s)
+{
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  DecodePool pool(num_processes);
+  return decode_batch_with_states(probs_split, pool, states, is_eos_s);
+}
 
+std::vector<std::vector<std::pair<double, Output>>> ctc_beam_search_decoder_batch_with_states
+(const std::vector<ProbsView> &probs_split,
+    size_t num_processes,
+    std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s)
 {
   VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
-  // thread pool
-  ThreadPool pool(num_processes);
-  // number of samples
-  size_t batch_size = probs_split.size();
-  
+  DecodePool pool(num_processes);
+  return decode_batch_with_states(probs_split, pool, states, is_eos_s);
+}
 
-  // enqueue the tasks of decoding
-  std::vector<std::future<std::vector<std::pair<double, Output>>>> res;
-  for (size_t i = 0; i < batch_size; ++i) {
-    res.emplace_back(pool.enqueue(ctc_beam_search_decoder_with_given_state,
-                                  std::cref(probs_split[i]),
-                                  static_cast<DecoderState*>(states[i]),
-                                  is_eos_s[i]));
-  }
+std::vector<std::vector<std::pair<double, Output>>> ctc_beam_search_decoder_batch_with_states
+(const std::vector<std::vector<std::vector<double>>> &probs_split,
+    DecodePool &pool,
+    std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s)
+{
+  return decode_batch_with_states(probs_split, pool, states, is_eos_s);
+}
 
-  // get decoding results
-  std::vector<std::vector<std::pair<double, Output>>> batch_results;
-  for (size_t i = 0; i < batch_size; ++i) {
-    batch_results.emplace_back(res[i].get());
-  }
-  return batch_results;
+std::vector<std::vector<std::pair<double, Output>>> ctc_beam_search_decoder_batch_with_states
+(const std::vector<ProbsView> &probs_split,
+    DecodePool &pool,
+    std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s)
+{
+  return decode_batch_with_states(probs_split, pool, states, is_eos_s);
+}
+
+std::shared_ptr<DecodePool::Pending>
+ctc_beam_search_decoder_batch_async(
+    const std::vector<ProbsView> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    DecodePool &pool,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    int log_input,
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold,
+    std::vector<std::vector<std::pair<double, Output>>> *batch_results,
+    std::vector<size_t> *num_skipped_frames)
+{
+  // the tasks keep their own copy of the views
+  auto views = std::make_shared<const std::vector<ProbsView>>(probs_split);
+  std::vector<double> costs;
+  std::function<void(size_t)> tasks = batch_tasks(
+      *views, vocabulary, beam_size, cutoff_prob, cutoff_top_n, blank_id,
+      log_input, ext_scorer, log_add_mode, blank_skip_threshold,
+      batch_results, num_skipped_frames, &costs);
+  return pool.submit(views->size(),
+                     [views, tasks](size_t i) { tasks(i); }, &costs);
+}
+
+std::shared_ptr<DecodePool::Pending>
+ctc_beam_search_decoder_batch_with_states_async(
+    const std::vector<ProbsView> &probs_split,
+    DecodePool &pool,
+    const std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s,
+    std::vector<std::vector<std::pair<double, Output>>> *batch_results)
+{
+  auto views = std::make_shared<const std::vector<ProbsView>>(probs_split);
+  std::vector<double> costs;
+  std::function<void(size_t)> tasks = batch_tasks_with_states(
+      *views, states, is_eos_s, batch_results, &costs);
+  return pool.submit(views->size(),
+                     [views, tasks](size_t i) { tasks(i); }, &costs);
 }
@@ -1,12 +1,17 @@
 #ifndef CTC_BEAM_SEARCH_DECODER_H_
 #define CTC_BEAM_SEARCH_DECODER_H_
 
+#include <memory>
+#include <ostream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "decode_pool.h"
+#include "decoder_utils.h"
 #include "scorer.h"
 #include "output.h"
+#include "probs_view.h"
 
 /* CTC Beam Search Decoder
 
@@ -20,6 +25,10 @@
  *     ext_scorer: External scorer to evaluate a prefix, which consists of
  *                 n-gram language model scoring and word insertion term.
  *                 Default null, decoding the input sample without scorer.
+ *     log_add_mode: Exact or table-based approximate log-add.
+ *     blank_skip_threshold: Frames whose blank probability exceeds it only
+ *                           extend every prefix with a blank. Default 1.0,
+ *                           never skip.
  * Return:
  *     A vector that each element is a pair of score  and decoding result,
  *     in desending order.
@@ -33,7 +42,27 @@ std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
     size_t cutoff_top_n = 40,
     size_t blank_id = 0,
     int log_input = 0,
-    Scorer *ext_scorer = nullptr);
+    Scorer *ext_scorer = nullptr,
+    LogAddMode log_add_mode = LOG_ADD_EXACT,
+    double blank_skip_threshold = 1.0);
+
+/* CTC Beam Search Decoder reading float32 probabilities in place
+ *
+ * Same as above, with probs_seq replaced by a strided view of a
+ * time x vocabulary float matrix, e.g. one item of a padded tensor whose
+ * num_time_steps is the item's sequence length.
+*/
+std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
+    const ProbsView &probs,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    size_t blank_id = 0,
+    int log_input = 0,
+    Scorer *ext_scorer = nullptr,
+    LogAddMode log_add_mode = LOG_ADD_EXACT,
+    double blank_skip_threshold = 1.0);
 
 
 
@@ -50,6 +79,10 @@ std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
  *     ext_scorer: External scorer to evaluate a prefix, which consists of
  *                 n-gram language model scoring and word insertion term.
  *                 Default null, decoding the input sample without scorer.
+ *     log_add_mode: Exact or table-based approximate log-add.
+ *     blank_skip_threshold: See ctc_beam_search_decoder().
+ *     num_skipped_frames: If given, receives the number of skipped frames
+ *                         of each sample.
  * Return:
  *     A 2-D vector that each element is a vector of beam search decoding
  *     result for one audio sample.
@@ -64,27 +97,161 @@ ctc_beam_search_decoder_batch(
     size_t cutoff_top_n = 40,
     size_t blank_id = 0,
     int log_input = 0,
-    Scorer *ext_scorer = nullptr);
+    Scorer *ext_scorer = nullptr,
+    LogAddMode log_add_mode = LOG_ADD_EXACT,
+    double blank_skip_threshold = 1.0,
+    std::vector<size_t> *num_skipped_frames = nullptr);
+
+// Batch decoding over per-item float32 views, see ProbsView
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch(
+    const std::vector<ProbsView> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    size_t blank_id = 0,
+    int log_input = 0,
+    Scorer *ext_scorer = nullptr,
+    LogAddMode log_add_mode = LOG_ADD_EXACT,
+    double blank_skip_threshold = 1.0,
+    std::vector<size_t> *num_skipped_frames = nullptr);
+
+// Batch decoding on a long-lived pool instead of num_processes threads
+// started for this call
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch(
+    const std::vector<std::vector<std::vector<double>>> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    DecodePool &pool,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    size_t blank_id = 0,
+    int log_input = 0,
+    Scorer *ext_scorer = nullptr,
+    LogAddMode log_add_mode = LOG_ADD_EXACT,
+    double blank_skip_threshold = 1.0,
+    std::vector<size_t> *num_skipped_frames = nullptr);
+
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch(
+    const std::vector<ProbsView> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    DecodePool &pool,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    size_t blank_id = 0,
+    int log_input = 0,
+    Scorer *ext_scorer = nullptr,
+    LogAddMode log_add_mode = LOG_ADD_EXACT,
+    double blank_skip_threshold = 1.0,
+    std::vector<size_t> *num_skipped_frames = nullptr);
 
 
   
 
 
+/* Read-only decoding configuration, shared by any number of DecoderStates,
+ * e.g. all the streams of an online decoder: each state keeps only its beam
+ * and a reference to this. A configuration given a shared_ptr to its scorer
+ * keeps the scorer alive, so that it goes with the last configuration or
+ * state using it; given a plain pointer, the scorer must outlive the
+ * configuration.
+ *
+ * Parameters: see DecoderState::DecoderState().
+ */
+struct DecoderConfig {
+  DecoderConfig(const std::vector<std::string> &vocabulary,
+                size_t beam_size,
+                double cutoff_prob,
+                size_t cutoff_top_n,
+                size_t blank_id,
+                int log_input,
+                std::shared_ptr<Scorer> ext_scorer,
+                LogAddMode log_add_mode = LOG_ADD_EXACT,
+                double blank_skip_threshold = 1.0);
+
+  DecoderConfig(const std::vector<std::string> &vocabulary,
+                size_t beam_size,
+                double cutoff_prob,
+                size_t cutoff_top_n,
+                size_t blank_id,
+                int log_input,
+                Scorer *ext_scorer,
+                LogAddMode log_add_mode = LOG_ADD_EXACT,
+                double blank_skip_threshold = 1.0);
+
+  const std::vector<std::string> vocabulary;
+  // index of " " in vocabulary, -2 if there is none
+  const int space_id;
+  const size_t beam_size;
+  const double cutoff_prob;
+  const size_t cutoff_top_n;
+  const size_t blank_id;
+  const int log_input;
+  // owning, or not for a configuration given a plain pointer
+  const std::shared_ptr<Scorer> ext_scorer;
+  const LogAddMode log_add_mode;
+  // frames with a blank log prob above this are skipped, see skip_frame
+  const float blank_skip_log_threshold;
+  // the scorer's dictionary for a word based lm, nullptr otherwise
+  const CompactDictionary *const dictionary;
+};
+
+
 class DecoderState
 {
+  std::shared_ptr<const DecoderConfig> config;
   int abs_time_step;
-  int space_id;
-  size_t beam_size;
-  double cutoff_prob;
-  size_t cutoff_top_n;
-  size_t blank_id;
-  int log_input;
-  std::vector<std::string> vocabulary;
-  Scorer *ext_scorer;
+  size_t num_skipped;
 
   std::vector<PathTrie*> prefixes;
+  // nodes that joined the beam during the current frame
+  std::vector<PathTrie*> new_prefixes;
+  // pruned log probs of the current frame and their scratch space
+  std::vector<std::pair<size_t, float>> log_prob_idx;
+  PruningScratch pruning_scratch;
+  // per-prefix scratch for the batched score update at the end of a frame
+  std::vector<float> prefix_log_probs_b;
+  std::vector<float> prefix_log_probs_nb;
+  std::vector<float> prefix_scores;
+  // deepest node that every prefix of the beam descends from, as of the
+  // last partial call; later frames can't change the labels up to it
+  PathTrie *committed;
+  // labels of the last partial result below depth last_partial_start, the
+  // committed depth at the time
+  size_t last_partial_start;
+  std::vector<int> last_partial_tokens;
+  // labels and timesteps of the path from the start of the stream to root,
+  // folded out of the trie by compact_history
+  std::vector<int> history_tokens;
+  std::vector<int> history_timesteps;
+  // must outlive root, which returns its nodes here on destruction
+  PathTriePool pool;
   PathTrie root;
 
+  // advance the beam by one time step given its pruned log probs
+  void next_frame(const std::vector<std::pair<size_t, float>> &log_prob_idx,
+                  float blank_prob);
+
+  // advance the beam by one confidently blank time step: every prefix is
+  // extended with the blank only, so there is no pruning, expansion or sort
+  void skip_frame(float blank_prob);
+
+  // fold the labels every prefix of the beam shares, down to the deepest
+  // node the scorer can restart from, into history_tokens and make that
+  // node the root, so the trie only holds the part the beam disagrees on
+  void compact_history();
+
+  // append the labels of node from depth start on, folded ones included
+  void get_path(PathTrie *node,
+                size_t start,
+                std::vector<int> &tokens,
+                std::vector<int> &timesteps) const;
+
 public:
   /* Initialize CTC beam search decoder for streaming
    *
@@ -96,6 +263,11 @@ public:
    *     ext_scorer: External scorer to evaluate a prefix, which consists of
    *                 n-gram language model scoring and word insertion term.
    *                 Default null, decoding the input sample without scorer.
+   *     log_add_mode: Exact or table-based approximate log-add.
+   *     blank_skip_threshold: Frames whose blank probability exceeds it only
+   *                           extend every prefix with a blank, dropping the
+   *                           repeated-character paths. Default 1.0, never
+   *                           skip.
   */
   DecoderState(const std::vector<std::string> &vocabulary,
                size_t beam_size,
@@ -103,7 +275,12 @@ public:
                size_t cutoff_top_n,
                size_t blank_id,
                int log_input,
-               Scorer *ext_scorer);
+               Scorer *ext_scorer,
+               LogAddMode log_add_mode = LOG_ADD_EXACT,
+               double blank_skip_threshold = 1.0);
+
+  // Initialize a decoder stream with a shared configuration
+  explicit DecoderState(std::shared_ptr<const DecoderConfig> shared_config);
   ~DecoderState() = default;
 
   /* Process logits in decoder stream
@@ -114,6 +291,14 @@ public:
   */
   void next(const std::vector<std::vector<double>> &probs_seq);
 
+  /* Process logits in decoder stream, read in place
+   *
+   * Parameters:
+   *     probs: strided view of a time x vocabulary float32 matrix of
+   *            probabilities (or log probabilities if log_input).
+  */
+  void next(const ProbsView &probs);
+
   /* Get current transcription from the decoder stream state
    *
    * Return:
@@ -121,6 +306,66 @@ public:
    *     in descending order.
   */
   std::vector<std::pair<double, Output>> decode();
+
+  /* Cheap interim result from the decoder stream state: the best prefix of
+   * the beam by its beam score, without decode's copy, lm rescoring and
+   * sort of the whole beam. Costs about the number of prefixes times the
+   * length of the part the beam doesn't agree on yet, plus the length of
+   * the returned tokens: with changes_only, only those from the first one
+   * that differs from the previous call's result. Not to be called while
+   * the stream decodes.
+   *
+   * Return:
+   *     The best hypothesis, with how many of its leading tokens every
+   *     prefix of the beam shares, which later frames and the final result
+   *     keep, and how many are unchanged since the previous call.
+  */
+  PartialOutput partial(bool changes_only = false);
+
+  /* Write a compact binary snapshot of the stream to out, for carrying on
+   * with it in another process, e.g. when streams move between workers: the
+   * prefixes of the beam and the trie nodes they descend from, with their
+   * log probs, timesteps, lm and dictionary states, and the labels folded out
+   * of the trie. Its size grows with the number of trie nodes, which the
+   * beam bounds (see compact_history), plus 8 bytes per folded label. Not to
+   * be called while the stream decodes.
+  */
+  void snapshot(std::ostream &out) const;
+
+  /* Restore a stream from a snapshot
+   *
+   * Parameters:
+   *     shared_config: The configuration of the snapshot's stream: the same
+   *                    vocabulary, beam settings and lm, possibly loaded in
+   *                    another process on the same platform. Decoding on
+   *                    from the restored stream gives the same results as
+   *                    from the original.
+   *     data, size: The snapshot.
+   * Return:
+   *     The restored stream, or nullptr if data is not a snapshot that
+   *     shared_config can restore.
+  */
+  static std::unique_ptr<DecoderState> from_snapshot(
+      std::shared_ptr<const DecoderConfig> shared_config,
+      const char *data,
+      size_t size);
+
+  // number of trie nodes carved from fresh pool memory; the trie only holds
+  // the part of the beam since the last common word boundary, so this stays
+  // bounded however long the stream is
+  size_t num_nodes_allocated() const { return pool.num_allocated(); }
+
+  // number of labels folded out of the trie so far
+  size_t num_folded_tokens() const { return history_tokens.size(); }
+
+  // number of trie nodes reused from pruned prefixes
+  size_t num_nodes_recycled() const { return pool.num_recycled(); }
+
+  // number of time steps handled by skip_frame
+  size_t num_skipped_frames() const { return num_skipped; }
+
+  // number of prefixes in the beam
+  size_t num_prefixes() const { return prefixes.size(); }
 };
 
 
@@ -131,4 +376,57 @@ ctc_beam_search_decoder_batch_with_states(
     std::vector<void*> &states,
     const std::vector<bool> &is_eos_s);
 
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch_with_states(
+    const std::vector<ProbsView> &probs_split,
+    size_t num_processes,
+    std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s);
+
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch_with_states(
+    const std::vector<std::vector<std::vector<double>>> &probs_split,
+    DecodePool &pool,
+    std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s);
+
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch_with_states(
+    const std::vector<ProbsView> &probs_split,
+    DecodePool &pool,
+    std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s);
+
+/* Batch decoding over float32 views submitted to a pool without waiting for
+ * it, see DecodePool::submit. Once the returned batch is done,
+ * batch_results (and num_skipped_frames, if given) hold what
+ * ctc_beam_search_decoder_batch returns. The data the views point to,
+ * ext_scorer and the outputs must outlive the batch.
+*/
+std::shared_ptr<DecodePool::Pending>
+ctc_beam_search_decoder_batch_async(
+    const std::vector<ProbsView> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    DecodePool &pool,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    int log_input,
+    Scorer *ext_scorer,
+    LogAddMode log_add_mode,
+    double blank_skip_threshold,
+    std::vector<std::vector<std::pair<double, Output>>> *batch_results,
+    std::vector<size_t> *num_skipped_frames = nullptr);
+
+// Same for a batch of streams, whose states must outlive the batch too and
+// not be decoded by anything else until it is done
+std::shared_ptr<DecodePool::Pending>
+ctc_beam_search_decoder_batch_with_states_async(
+    const std::vector<ProbsView> &probs_split,
+    DecodePool &pool,
+    const std::vector<void*> &states,
+    const std::vector<bool> &is_eos_s,
+    std::vector<std::vector<std::pair<double, Output>>> *batch_results);
+
 #endif  // CTC_BEAM_SEARCH_DECODER_H_
@@ -0,0 +1,114 @@
+#include "ctc_greedy_decoder.h"
+
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// index of the largest of n > 0 contiguous floats, the first one on ties
+static size_t argmax_contiguous(const float *x, size_t n) {
+  size_t best = 0;
+  size_t i = 1;
+#ifdef __SSE2__
+  if (n >= 8) {
+    // per lane: the largest value seen and its index, ties keeping the
+    // earlier index since only a strictly larger value replaces it
+    __m128 lane_max = _mm_loadu_ps(x);
+    __m128i lane_idx = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i idx = lane_idx;
+    const __m128i four = _mm_set1_epi32(4);
+    for (i = 4; i + 4 <= n; i += 4) {
+      idx = _mm_add_epi32(idx, four);
+      __m128 v = _mm_loadu_ps(x + i);
+      __m128 greater = _mm_cmpgt_ps(v, lane_max);
+      __m128i greater_i = _mm_castps_si128(greater);
+      lane_max = _mm_or_ps(_mm_and_ps(greater, v),
+                           _mm_andnot_ps(greater, lane_max));
+      lane_idx = _mm_or_si128(_mm_and_si128(greater_i, idx),
+                              _mm_andnot_si128(greater_i, lane_idx));
+    }
+    float maxs[4];
+    int idxs[4];
+    _mm_storeu_ps(maxs, lane_max);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(idxs), lane_idx);
+    best = idxs[0];
+    float best_value = maxs[0];
+    for (int l = 1; l < 4; ++l) {
+      if (maxs[l] > best_value ||
+          (maxs[l] == best_value && static_cast<size_t>(idxs[l]) < best)) {
+        best = idxs[l];
+        best_value = maxs[l];
+      }
+    }
+  }
+#endif
+  // the tail the vector loop left, or all of a short frame
+  for (; i < n; ++i) {
+    if (x[i] > x[best]) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+// index of the largest of the n floats x[0], x[stride], ..., first on ties
+static size_t argmax_strided(const float *x, size_t n, ptrdiff_t stride) {
+  size_t best = 0;
+  float best_value = x[0];
+  for (size_t i = 1; i < n; ++i) {
+    float value = x[i * stride];
+    if (value > best_value) {
+      best = i;
+      best_value = value;
+    }
+  }
+  return best;
+}
+
+std::pair<double, Output> ctc_greedy_decoder(const ProbsView &probs,
+                                             size_t blank_id,
+                                             int log_input) {
+  Output output;
+  double log_prob = 0.0;
+  if (probs.vocab_size == 0) {
+    return std::make_pair(0.0, output);
+  }
+  size_t prev = blank_id;
+  for (size_t t = 0; t < probs.num_time_steps; ++t) {
+    const float *frame = probs.frame(t);
+    size_t best = probs.vocab_stride == 1
+                      ? argmax_contiguous(frame, probs.vocab_size)
+                      : argmax_strided(frame, probs.vocab_size,
+                                       probs.vocab_stride);
+    float value = frame[best * probs.vocab_stride];
+    log_prob += log_input ? value : std::log(value);
+
+    // a token is emitted where the path enters it from another one or blank
+    if (best != blank_id && best != prev) {
+      output.tokens.push_back(best);
+      output.timesteps.push_back(t);
+    }
+    prev = best;
+  }
+  return std::make_pair(-log_prob, output);
+}
+
+std::vector<std::pair<double, Output>> ctc_greedy_decoder_batch(
+    const std::vector<ProbsView> &probs_split,
+    DecodePool &pool,
+    size_t blank_id,
+    int log_input) {
+  size_t batch_size = probs_split.size();
+
+  // decoding tasks, one per sample, costing about its number of frames
+  std::vector<double> costs(batch_size);
+  for (size_t i = 0; i < batch_size; ++i) {
+    costs[i] = probs_split[i].num_time_steps;
+  }
+  std::vector<std::pair<double, Output>> batch_results(batch_size);
+  pool.run(batch_size, [&](size_t i) {
+    batch_results[i] = ctc_greedy_decoder(probs_split[i], blank_id, log_input);
+  }, &costs);
+  return batch_results;
+}
@@ -0,0 +1,37 @@
+#ifndef CTC_GREEDY_DECODER_H_
+#define CTC_GREEDY_DECODER_H_
+
+#include <utility>
+#include <vector>
+
+#include "decode_pool.h"
+#include "output.h"
+#include "probs_view.h"
+
+/* CTC Greedy (best path) Decoder
+
+ * Takes the most probable token of every frame, then merges repeated tokens
+ * and removes blanks.
+ *
+ * Parameters:
+ *     probs: Strided view of a time x vocabulary float matrix of
+ *            probabilities, see ProbsView.
+ *     blank_id: Index of the blank token.
+ *     log_input: Whether probs holds log probabilities.
+ * Return:
+ *     A pair of the score of the path, its negated log probability as for the
+ *     beams of ctc_beam_search_decoder, and the decoding result with the
+ *     timestep of the first frame of each token.
+*/
+std::pair<double, Output> ctc_greedy_decoder(const ProbsView &probs,
+                                             size_t blank_id = 0,
+                                             int log_input = 0);
+
+// Greedy decoding of a batch, one task per sample on a decoding pool
+std::vector<std::pair<double, Output>> ctc_greedy_decoder_batch(
+    const std::vector<ProbsView> &probs_split,
+    DecodePool &pool,
+    size_t blank_id = 0,
+    int log_input = 0);
+
+#endif  // CTC_GREEDY_DECODER_H_
@@ -0,0 +1,247 @@
+#include "decode_pool.h"
+
+#include "decoder_utils.h"
+
+DecodePool::DecodePool(size_t num_threads)
+    : num_queues_(0), next_queue_(0), num_queued_(0), stopping_(false),
+      num_submitted_(0) {
+  last_timing_ = Timing();
+  start(num_threads);
+}
+
+DecodePool::~DecodePool() { stop(); }
+
+void DecodePool::resize(size_t num_threads) {
+  std::unique_lock<std::shared_timed_mutex> lock(resize_mutex_);
+  if (num_threads == num_queues_) {
+    return;
+  }
+  {
+    // no batch can be submitted while the lock is held
+    std::unique_lock<std::mutex> submitted_lock(submitted_mutex_);
+    submitted_done_.wait(submitted_lock, [this] { return num_submitted_ == 0; });
+  }
+  stop();
+  start(num_threads);
+}
+
+void DecodePool::start(size_t num_threads) {
+  VALID_CHECK_GT(num_threads, 0, "num_threads must be positive!");
+  queues_.reset(new Queue[num_threads]);
+  num_queues_ = num_threads;
+  stopping_ = false;
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(&DecodePool::work, this, i);
+  }
+}
+
+void DecodePool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+}
+
+size_t DecodePool::enqueue(const std::shared_ptr<Batch> &batch,
+                           const std::vector<double> *costs) {
+  size_t num_tasks = batch->num_tasks;
+  std::vector<size_t> order(num_tasks);
+  for (size_t i = 0; i < num_tasks; ++i) {
+    order[i] = i;
+  }
+  if (costs != nullptr) {
+    std::stable_sort(order.begin(), order.end(), [costs](size_t a, size_t b) {
+      return (*costs)[a] > (*costs)[b];
+    });
+  }
+
+  // deal the tasks out round-robin, starting where the last batch did not
+  // so that small batches don't all land on the first worker
+  size_t first = next_queue_.fetch_add(1) % num_queues_;
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    num_queued_ += num_tasks;
+  }
+  for (size_t i = 0; i < num_tasks; ++i) {
+    Queue &queue = queues_[(first + i) % num_queues_];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(Task{batch, order[i]});
+  }
+  wake_.notify_all();
+  return first;
+}
+
+void DecodePool::run(size_t num_tasks,
+                     const std::function<void(size_t)> &task,
+                     const std::vector<double> *costs) {
+  if (num_tasks == 0) {
+    return;
+  }
+  std::shared_lock<std::shared_timed_mutex> resize_lock(resize_mutex_);
+
+  auto batch = std::make_shared<Batch>();
+  // task outlives the batch here, so the wrapper only refers to it
+  batch->task = [&task](size_t i) { task(i); };
+  batch->num_tasks = num_tasks;
+  batch->submitted = false;
+  batch->begin = Clock::now();
+  batch->remaining = num_tasks;
+  batch->busy = 0.0;
+  batch->longest = 0.0;
+  size_t first = enqueue(batch, costs);
+
+  // help until nothing is left to take, then wait for the tasks in flight
+  Task next;
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(batch->mutex);
+      if (batch->remaining == 0) {
+        break;
+      }
+    }
+    if (!take(first, &next)) {
+      break;
+    }
+    execute(next);
+  }
+  {
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->done.wait(lock, [&batch] { return batch->remaining == 0; });
+  }
+  record_timing(*batch);
+
+  if (batch->error) {
+    std::rethrow_exception(batch->error);
+  }
+}
+
+std::shared_ptr<DecodePool::Pending> DecodePool::submit(
+    size_t num_tasks,
+    std::function<void(size_t)> task,
+    const std::vector<double> *costs) {
+  std::shared_lock<std::shared_timed_mutex> resize_lock(resize_mutex_);
+
+  auto batch = std::make_shared<Batch>();
+  batch->task = std::move(task);
+  batch->num_tasks = num_tasks;
+  batch->submitted = num_tasks > 0;
+  batch->begin = Clock::now();
+  batch->remaining = num_tasks;
+  batch->busy = 0.0;
+  batch->longest = 0.0;
+  if (num_tasks > 0) {
+    {
+      std::lock_guard<std::mutex> lock(submitted_mutex_);
+      ++num_submitted_;
+    }
+    enqueue(batch, costs);
+  }
+  return std::shared_ptr<Pending>(new Pending(batch));
+}
+
+bool DecodePool::Pending::done() const {
+  std::lock_guard<std::mutex> lock(batch_->mutex);
+  return batch_->remaining == 0;
+}
+
+void DecodePool::Pending::wait() const {
+  std::unique_lock<std::mutex> lock(batch_->mutex);
+  batch_->done.wait(lock, [this] { return batch_->remaining == 0; });
+  if (batch_->error) {
+    std::rethrow_exception(batch_->error);
+  }
+}
+
+void DecodePool::work(size_t id) {
+  Task task;
+  for (;;) {
+    if (take(id, &task)) {
+      execute(task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    wake_.wait(lock, [this] { return stopping_ || num_queued_ > 0; });
+    if (stopping_ && num_queued_ == 0) {
+      return;
+    }
+  }
+}
+
+DecodePool::Timing DecodePool::last_timing() const {
+  std::lock_guard<std::mutex> lock(timing_mutex_);
+  return last_timing_;
+}
+
+bool DecodePool::take(size_t id, Task *task) {
+  {
+    Queue &own = queues_[id];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      *task = own.tasks.front();
+      own.tasks.pop_front();
+      --num_queued_;
+      return true;
+    }
+  }
+  for (size_t k = 1; k < num_queues_; ++k) {
+    Queue &victim = queues_[(id + k) % num_queues_];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      *task = victim.tasks.back();
+      victim.tasks.pop_back();
+      --num_queued_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void DecodePool::execute(const Task &task) {
+  Batch *batch = task.batch.get();
+  std::exception_ptr error;
+  Clock::time_point begin = Clock::now();
+  try {
+    batch->task(task.index);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  double run_time = std::chrono::duration<double>(Clock::now() - begin).count();
+
+  std::lock_guard<std::mutex> lock(batch->mutex);
+  if (error && !batch->error) {
+    batch->error = error;
+  }
+  batch->busy += run_time;
+  batch->longest = std::max(batch->longest, run_time);
+  if (--batch->remaining == 0) {
+    // a submitted batch is done for resize before its waiters wake up
+    if (batch->submitted) {
+      finish_submitted();
+    }
+    batch->done.notify_all();
+  }
+}
+
+void DecodePool::record_timing(const Batch &batch) {
+  Timing timing;
+  timing.num_tasks = batch.num_tasks;
+  timing.num_threads = num_queues_ + 1;
+  timing.makespan =
+      std::chrono::duration<double>(Clock::now() - batch.begin).count();
+  timing.busy = batch.busy;
+  timing.longest = batch.longest;
+  std::lock_guard<std::mutex> lock(timing_mutex_);
+  last_timing_ = timing;
+}
+
+void DecodePool::finish_submitted() {
+  std::lock_guard<std::mutex> lock(submitted_mutex_);
+  if (--num_submitted_ == 0) {
+    submitted_done_.notify_all();
+  }
+}
@@ -0,0 +1,188 @@
+#ifndef DECODE_POOL_H_
+#define DECODE_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+/* Long-lived pool of decoding threads with work-stealing queues.
+ *
+ * Meant to be created once and reused for every batch, instead of spawning
+ * and joining threads per call. Each worker has its own task queue: a batch
+ * deals its tasks out over the queues, a worker pops from the front of its
+ * own queue and, once that is empty, steals from the back of the others, so
+ * a worker stuck on a long item doesn't hold up the tasks queued behind it.
+ * The thread submitting a batch works on the queues too until its batch is
+ * done. Several threads may run batches at once.
+ *
+ * Given an estimated cost per task, a batch is dealt out most expensive
+ * first, so that long items start early and the short ones fill in the gaps
+ * (longest processing time first scheduling).
+ *
+ * A batch can also be submitted without waiting for it, to overlap its
+ * decoding with other work of the submitting thread.
+ *
+ * Example:
+ *     DecodePool pool(4);
+ *     pool.run(batch_size, [&](size_t i) { decode(i); });
+ */
+class DecodePool {
+  struct Batch;
+
+public:
+  // wall clock timing of a batch, in seconds
+  struct Timing {
+    size_t num_tasks;
+    // worker threads plus the submitting one
+    size_t num_threads;
+    // from submitting the batch to its last task finishing
+    double makespan;
+    // sum of the run times of the tasks
+    double busy;
+    // run time of the longest task
+    double longest;
+
+    // lower bound of the makespan on num_threads threads
+    double ideal_makespan() const {
+      return num_threads == 0 ? 0.0 : std::max(busy / num_threads, longest);
+    }
+  };
+
+  // a batch started by submit
+  class Pending {
+  public:
+    // whether every task of the batch has finished
+    bool done() const;
+
+    // block until every task of the batch has finished; rethrows the first
+    // exception a task threw
+    void wait() const;
+
+  private:
+    friend class DecodePool;
+    explicit Pending(std::shared_ptr<Batch> batch) : batch_(batch) {}
+
+    std::shared_ptr<Batch> batch_;
+  };
+
+  explicit DecodePool(size_t num_threads);
+  ~DecodePool();
+
+  DecodePool(const DecodePool &) = delete;
+  DecodePool &operator=(const DecodePool &) = delete;
+
+  // number of worker threads
+  size_t size() const { return num_queues_; }
+
+  // change the number of worker threads, once running and submitted batches
+  // are done
+  void resize(size_t num_threads);
+
+  // run task(0), ..., task(num_tasks - 1) and return once all have finished;
+  // rethrows the first exception a task threw. If costs is given, task i is
+  // estimated to cost (*costs)[i] and tasks start in decreasing cost order.
+  void run(size_t num_tasks,
+           const std::function<void(size_t)> &task,
+           const std::vector<double> *costs = nullptr);
+
+  // queue task(0), ..., task(num_tasks - 1) like run, but return right away
+  // instead of helping with the tasks and waiting for them. The pool keeps
+  // task until the batch is done, anything it refers to must outlive that.
+  std::shared_ptr<Pending> submit(size_t num_tasks,
+                                  std::function<void(size_t)> task,
+                                  const std::vector<double> *costs = nullptr);
+
+  // timing of the batch of run that finished last; batches started by
+  // submit, which may finish in any order with other threads' ones, are not
+  // timed
+  Timing last_timing() const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Batch {
+    std::function<void(size_t)> task;
+    size_t num_tasks;
+    // whether started by submit, see num_submitted_
+    bool submitted;
+    Clock::time_point begin;
+    size_t remaining;
+    double busy;
+    double longest;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  struct Task {
+    // the last task of a batch to finish may outlive its submitter's wait
+    std::shared_ptr<Batch> batch;
+    size_t index;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void start(size_t num_threads);
+
+  // deal the tasks of a batch out over the queues, most expensive first;
+  // returns the queue dealing started at
+  size_t enqueue(const std::shared_ptr<Batch> &batch,
+                 const std::vector<double> *costs);
+
+  void stop();
+
+  // worker loop of thread id
+  void work(size_t id);
+
+  // pop a task from the front of queue id, or steal one from the back of
+  // another queue
+  bool take(size_t id, Task *task);
+
+  void execute(const Task &task);
+
+  // record the timing of a batch of run whose last task just finished
+  void record_timing(const Batch &batch);
+
+  // count a submitted batch whose last task just finished as done, see
+  // num_submitted_
+  void finish_submitted();
+
+  std::vector<std::thread> workers_;
+  // one queue per worker
+  std::unique_ptr<Queue[]> queues_;
+  size_t num_queues_;
+  // queue the next batch starts dealing its tasks at
+  std::atomic<size_t> next_queue_;
+
+  // workers sleep on wake_ while no task is queued
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  std::atomic<size_t> num_queued_;
+  bool stopping_;
+
+  // held shared by running batches, exclusively by resize
+  std::shared_timed_mutex resize_mutex_;
+
+  // number of submitted batches not done yet, which resize waits for
+  std::mutex submitted_mutex_;
+  std::condition_variable submitted_done_;
+  size_t num_submitted_;
+
+  mutable std::mutex timing_mutex_;
+  Timing last_timing_;
+};
+
+#endif  // DECODE_POOL_H_
@@ -2,48 +2,204 @@
 
 #include <algorithm>
 #include <cmath>
+#include <functional>
 #include <limits>
 #include <bits/stdc++.h>
 using namespace std;
 
 
-std::vector<std::pair<size_t, float>> get_pruned_log_probs(
-    const std::vector<double> &prob_step,
-    double cutoff_prob,
-    size_t cutoff_top_n,
-    int log_input) {
-  std::vector<std::pair<int, double>> prob_idx;
+LogAddTable::LogAddTable() {
+  for (int i = 0; i <= LOG_ADD_TABLE_SCALE * LOG_ADD_TABLE_RANGE; ++i) {
+    double d = static_cast<double>(i) / LOG_ADD_TABLE_SCALE;
+    values[i] = static_cast<float>(std::log1p(std::exp(-d)));
+  }
+}
+
+const LogAddTable LOG_ADD_TABLE;
+
+void log_sum_exp_batch(const float *x,
+                       const float *y,
+                       float *out,
+                       size_t n,
+                       LogAddMode mode) {
+  // separate loops keep each one free of the mode branch
+  if (mode == LOG_ADD_FAST) {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = fast_log_sum_exp(x[i], y[i]);
+    }
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = log_sum_exp(x[i], y[i]);
+    }
+  }
+}
+
+// Lower bound on the k-th largest entry of a time step: the k-th largest of a
+// leading block can only be smaller or equal, so every entry that can make
+// the top k is >= this value.
+template <typename T>
+static double top_k_threshold(const T *prob_step,
+                              size_t vocab_size,
+                              ptrdiff_t stride,
+                              size_t k,
+                              std::vector<double> &block) {
+  size_t block_size = std::min(vocab_size, std::max<size_t>(4 * k, 64));
+  block.resize(block_size);
+  for (size_t i = 0; i < block_size; ++i) {
+    block[i] = prob_step[i * stride];
+  }
+  std::nth_element(block.begin(), block.begin() + (k - 1), block.end(),
+                   std::greater<double>());
+  return block[k - 1];
+}
+
+// Whether any of N contiguous entries is at or above threshold. A fixed
+// length, an int accumulator and a comparison in T let -O3 turn this into
+// packed compares for float32 input; kept rolled, as unrolled GCC leaves it
+// scalar.
+template <size_t N, typename T>
+static bool any_at_least(const T *prob_step, T threshold) {
+  int hit = 0;
+#pragma GCC unroll 1
+  for (size_t i = 0; i < N; ++i) {
+    hit |= prob_step[i] >= threshold;
+  }
+  return hit != 0;
+}
+
+// Shared by the double and strided float32 overloads below
+template <typename T>
+static void prune_log_probs(const T *prob_step,
+                            size_t vocab_size,
+                            ptrdiff_t stride,
+                            double cutoff_prob,
+                            size_t cutoff_top_n,
+                            int log_input,
+                            std::vector<std::pair<size_t, float>> &log_prob_idx,
+                            PruningScratch &scratch) {
+  log_prob_idx.clear();
   double log_cutoff_prob = log(cutoff_prob);
-  for (size_t i = 0; i < prob_step.size(); ++i) {
-    prob_idx.push_back(std::pair<int, double>(i, prob_step[i]));
-  }
-  // pruning of vacobulary
-  size_t cutoff_len = prob_step.size();
-  if (log_cutoff_prob < 0.0 || cutoff_top_n < cutoff_len) {
-    std::sort(
-        prob_idx.begin(), prob_idx.end(), pair_comp_second_rev<int, double>);
-    if (log_cutoff_prob < 0.0) {
-      double cum_prob = 0.0;
-      cutoff_len = 0;
-      for (size_t i = 0; i < prob_idx.size(); ++i) {
-        cum_prob = log_sum_exp(cum_prob, log_input ? prob_idx[i].second : log(prob_idx[i].second) );
-        cutoff_len += 1;
-        if (cum_prob >= cutoff_prob || cutoff_len >= cutoff_top_n) break;
+  if (vocab_size == 0) return;
+
+  if (log_cutoff_prob >= 0.0 && cutoff_top_n >= vocab_size) {
+    // no pruning, keep vocabulary order
+    for (size_t i = 0; i < vocab_size; ++i) {
+      double prob = prob_step[i * stride];
+      log_prob_idx.emplace_back(i, log_input ? prob : log(prob + NUM_FLT_MIN));
+    }
+    return;
+  }
+
+  // most entries either cutoff can keep; the cumulative one keeps at least one
+  size_t max_len = log_cutoff_prob < 0.0
+                       ? std::min(vocab_size, std::max<size_t>(cutoff_top_n, 1))
+                       : cutoff_top_n;
+  if (max_len == 0) return;
+
+  // pre-filter: skip whole chunks with nothing at or above the threshold.
+  // The threshold is an entry of the time step, so comparing in T is exact
+  const size_t CHUNK = 16;
+  double threshold =
+      top_k_threshold(prob_step, vocab_size, stride, max_len, scratch.block);
+  T chunk_threshold = static_cast<T>(threshold);
+  auto &candidates = scratch.candidates;
+  candidates.clear();
+  for (size_t begin = 0; begin < vocab_size; begin += CHUNK) {
+    size_t end = std::min(vocab_size, begin + CHUNK);
+    bool hit = false;
+    if (stride == 1 && end - begin == CHUNK) {
+      hit = any_at_least<CHUNK>(prob_step + begin, chunk_threshold);
+    } else {
+      for (size_t i = begin; i < end && !hit; ++i) {
+        hit = prob_step[i * stride] >= chunk_threshold;
+      }
+    }
+    if (!hit) continue;
+    for (size_t i = begin; i < end; ++i) {
+      double prob = prob_step[i * stride];
+      if (prob >= threshold) {
+        candidates.emplace_back(i, prob);
       }
-    }else{
-      cutoff_len = cutoff_top_n;
     }
-    prob_idx = std::vector<std::pair<int, double>>(
-        prob_idx.begin(), prob_idx.begin() + cutoff_len);
   }
-  std::vector<std::pair<size_t, float>> log_prob_idx;
+
+  // partial selection of the survivors, ties broken by vocabulary index
+  std::partial_sort(candidates.begin(),
+                    candidates.begin() + max_len,
+                    candidates.end(),
+                    [](const std::pair<int, double> &a,
+                       const std::pair<int, double> &b) {
+                      return a.second > b.second ||
+                             (a.second == b.second && a.first < b.first);
+                    });
+
+  size_t cutoff_len = max_len;
+  if (log_cutoff_prob < 0.0) {
+    double cum_prob = 0.0;
+    cutoff_len = 0;
+    for (size_t i = 0; i < max_len; ++i) {
+      cum_prob = log_sum_exp(cum_prob, log_input ? candidates[i].second : log(candidates[i].second));
+      cutoff_len += 1;
+      if (cum_prob >= cutoff_prob || cutoff_len >= cutoff_top_n) break;
+    }
+  }
+
   for (size_t i = 0; i < cutoff_len; ++i) {
-    log_prob_idx.push_back(std::pair<int, float>(
-        prob_idx[i].first, log_input ? prob_idx[i].second : log(prob_idx[i].second + NUM_FLT_MIN)));
+    double prob = candidates[i].second;
+    log_prob_idx.emplace_back(candidates[i].first,
+                              log_input ? prob : log(prob + NUM_FLT_MIN));
   }
+}
+
+
+std::vector<std::pair<size_t, float>> get_pruned_log_probs(
+    const std::vector<double> &prob_step,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    int log_input) {
+  std::vector<std::pair<size_t, float>> log_prob_idx;
+  PruningScratch scratch;
+  prune_log_probs(prob_step.data(), prob_step.size(), 1, cutoff_prob,
+                  cutoff_top_n, log_input, log_prob_idx, scratch);
+  return log_prob_idx;
+}
+
+std::vector<std::pair<size_t, float>> get_pruned_log_probs(
+    const float *prob_step,
+    size_t vocab_size,
+    ptrdiff_t stride,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    int log_input) {
+  std::vector<std::pair<size_t, float>> log_prob_idx;
+  PruningScratch scratch;
+  prune_log_probs(prob_step, vocab_size, stride, cutoff_prob,
+                  cutoff_top_n, log_input, log_prob_idx, scratch);
   return log_prob_idx;
 }
 
+void get_pruned_log_probs(const std::vector<double> &prob_step,
+                          double cutoff_prob,
+                          size_t cutoff_top_n,
+                          int log_input,
+                          std::vector<std::pair<size_t, float>> &log_prob_idx,
+                          PruningScratch &scratch) {
+  prune_log_probs(prob_step.data(), prob_step.size(), 1, cutoff_prob,
+                  cutoff_top_n, log_input, log_prob_idx, scratch);
+}
+
+void get_pruned_log_probs(const float *prob_step,
+                          size_t vocab_size,
+                          ptrdiff_t stride,
+                          double cutoff_prob,
+                          size_t cutoff_top_n,
+                          int log_input,
+                          std::vector<std::pair<size_t, float>> &log_prob_idx,
+                          PruningScratch &scratch) {
+  prune_log_probs(prob_step, vocab_size, stride, cutoff_prob,
+                  cutoff_top_n, log_input, log_prob_idx, scratch);
+}
+
 
 std::vector<std::pair<double, Output>> get_beam_search_result(
     const std::vector<PathTrie *> &prefixes,
@@ -161,33 +317,82 @@ void add_word_to_fst(const std::vector<int> &word,
   dictionary->SetFinal(dst, fst::StdArc::Weight::One());
 }
 
-bool add_word_to_dictionary(
+bool word_to_dictionary_labels(
     const std::string &word,
     const std::unordered_map<std::string, int> &char_map,
     bool add_space,
     int SPACE_ID,
-    fst::StdVectorFst *dictionary) {
+    std::vector<int> *labels) {
   auto characters = split_utf8_str(word);
 
-  std::vector<int> int_word;
-
+  labels->clear();
   for (auto &c : characters) {
     if (c == " ") {
-      int_word.push_back(SPACE_ID);
+      labels->push_back(SPACE_ID);
     } else {
       auto int_c = char_map.find(c);
       if (int_c != char_map.end()) {
-        int_word.push_back(int_c->second);
+        labels->push_back(int_c->second);
       } else {
-        return false;  // return without adding
+        return false;
       }
     }
   }
 
   if (add_space) {
-    int_word.push_back(SPACE_ID);
+    labels->push_back(SPACE_ID);
+  }
+  return true;
+}
+
+bool add_word_to_dictionary(
+    const std::string &word,
+    const std::unordered_map<std::string, int> &char_map,
+    bool add_space,
+    int SPACE_ID,
+    fst::StdVectorFst *dictionary) {
+  std::vector<int> int_word;
+  if (!word_to_dictionary_labels(word, char_map, add_space, SPACE_ID, &int_word)) {
+    return false;  // return without adding
   }
 
   add_word_to_fst(int_word, dictionary);
   return true;  // return with successful adding
 }
+
+size_t number_dictionary_words(fst::StdVectorFst *dictionary) {
+  if (dictionary->Start() == fst::kNoStateId) {
+    return 0;
+  }
+  bool acyclic = fst::TopSort(dictionary);
+  VALID_CHECK(acyclic, "The dictionary must be acyclic");
+
+  // every arc leads to a later state, so count the words backwards
+  std::vector<size_t> num_words(dictionary->NumStates(), 0);
+  for (int s = dictionary->NumStates() - 1; s >= 0; --s) {
+    size_t count = dictionary->Final(s) != fst::TropicalWeight::Zero() ? 1 : 0;
+    for (fst::MutableArcIterator<fst::StdVectorFst> aiter(dictionary, s);
+         !aiter.Done();
+         aiter.Next()) {
+      fst::StdArc arc = aiter.Value();
+      arc.weight = fst::TropicalWeight(count);
+      aiter.SetValue(arc);
+      count += num_words[arc.nextstate];
+    }
+    num_words[s] = count;
+  }
+  return num_words[dictionary->Start()];
+}
+
+void hash_bytes(const void *data, size_t size, uint64_t *hash) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    *hash = (*hash ^ bytes[i]) * 0x100000001B3ull;
+  }
+}
+
+void hash_string(const std::string &str, uint64_t *hash) {
+  uint64_t size = str.size();
+  hash_bytes(&size, sizeof(size), hash);
+  hash_bytes(str.data(), str.size(), hash);
+}
@@ -1,6 +1,8 @@
 #ifndef DECODER_UTILS_H_
 #define DECODER_UTILS_H_
 
+#include <cstdint>
+#include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -53,6 +55,49 @@ T log_sum_exp(const T &x, const T &y) {
   return std::log(std::exp(x - xmax) + std::exp(y - xmax)) + xmax;
 }
 
+// Precision of the log-add used while decoding
+enum LogAddMode {
+  LOG_ADD_EXACT = 0,  // log_sum_exp above
+  LOG_ADD_FAST = 1,   // fast_log_sum_exp below
+};
+
+// log(1 + exp(-d)) sampled every 1 / LOG_ADD_TABLE_SCALE on [0, LOG_ADD_TABLE_RANGE]
+const int LOG_ADD_TABLE_SCALE = 128;
+const int LOG_ADD_TABLE_RANGE = 16;
+struct LogAddTable {
+  LogAddTable();
+  float values[LOG_ADD_TABLE_SCALE * LOG_ADD_TABLE_RANGE + 1];
+};
+extern const LogAddTable LOG_ADD_TABLE;
+
+/* Approximate log_sum_exp for floats: max(x, y) plus log(1 + exp(-|x - y|))
+ * linearly interpolated from LOG_ADD_TABLE. The correction term is off by less
+ * than 2e-6 and is dropped (error < 1.2e-7) once |x - y| >= LOG_ADD_TABLE_RANGE.
+ */
+inline float fast_log_sum_exp(float x, float y) {
+  if (x <= -NUM_FLT_INF) return y;
+  if (y <= -NUM_FLT_INF) return x;
+  float xmax = std::max(x, y);
+  float pos = (xmax - std::min(x, y)) * LOG_ADD_TABLE_SCALE;
+  if (!(pos < LOG_ADD_TABLE_SCALE * LOG_ADD_TABLE_RANGE)) return xmax;
+  int i = static_cast<int>(pos);
+  float frac = pos - i;
+  const float *table = LOG_ADD_TABLE.values;
+  return xmax + table[i] + frac * (table[i + 1] - table[i]);
+}
+
+// log_sum_exp with the given precision
+inline float log_sum_exp(float x, float y, LogAddMode mode) {
+  return mode == LOG_ADD_FAST ? fast_log_sum_exp(x, y) : log_sum_exp(x, y);
+}
+
+// Element-wise log_sum_exp of n pairs, e.g. all prefixes of a frame at once
+void log_sum_exp_batch(const float *x,
+                       const float *y,
+                       float *out,
+                       size_t n,
+                       LogAddMode mode);
+
 // Get pruned probability vector for each time step's beam search
 std::vector<std::pair<size_t, float>> get_pruned_log_probs(
     const std::vector<double> &prob_step,
@@ -60,6 +105,41 @@ std::vector<std::pair<size_t, float>> get_pruned_log_probs(
     size_t cutoff_top_n,
     int log_input);
 
+// Same as above for one float32 time step read with the given element stride
+std::vector<std::pair<size_t, float>> get_pruned_log_probs(
+    const float *prob_step,
+    size_t vocab_size,
+    ptrdiff_t stride,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    int log_input);
+
+// Scratch buffers reused by get_pruned_log_probs across time steps
+struct PruningScratch {
+  std::vector<std::pair<int, double>> candidates;
+  std::vector<double> block;
+};
+
+/* Allocation-free forms of the above for the decoding loop: the result is
+ * written to log_prob_idx and both it and scratch keep their capacity from
+ * one time step to the next.
+ */
+void get_pruned_log_probs(const std::vector<double> &prob_step,
+                          double cutoff_prob,
+                          size_t cutoff_top_n,
+                          int log_input,
+                          std::vector<std::pair<size_t, float>> &log_prob_idx,
+                          PruningScratch &scratch);
+
+void get_pruned_log_probs(const float *prob_step,
+                          size_t vocab_size,
+                          ptrdiff_t stride,
+                          double cutoff_prob,
+                          size_t cutoff_top_n,
+                          int log_input,
+                          std::vector<std::pair<size_t, float>> &log_prob_idx,
+                          PruningScratch &scratch);
+
 // Get beam search result from prefixes in trie tree
 std::vector<std::pair<double, Output>> get_beam_search_result(
     const std::vector<PathTrie *> &prefixes,
@@ -92,6 +172,15 @@ std::vector<std::string> split_utf8_str(const std::string &str);
 void add_word_to_fst(const std::vector<int> &word,
                      fst::StdVectorFst *dictionary);
 
+// Convert a word in string to the labels of the dictionary fst, return false
+// if it has a character missing from char_map
+bool word_to_dictionary_labels(
+    const std::string &word,
+    const std::unordered_map<std::string, int> &char_map,
+    bool add_space,
+    int SPACE_ID,
+    std::vector<int> *labels);
+
 // Add a word in string to dictionary
 bool add_word_to_dictionary(
     const std::string &word,
@@ -99,4 +188,26 @@ bool add_word_to_dictionary(
     bool add_space,
     int SPACE_ID,
     fst::StdVectorFst *dictionary);
+
+/* Number the words of an acyclic dictionary fst
+ *
+ * Sets the weight of every arc to the number of words that leave its source
+ * state before it (the empty word first if the state is final, then the
+ * words through the preceding arcs), so the weights along the path spelling
+ * a word add up to its rank in [0, number of words). Renumbers the states in
+ * topological order.
+ *
+ * Return:
+ *     The number of words.
+ */
+size_t number_dictionary_words(fst::StdVectorFst *dictionary);
+
+// Start value of a hash_bytes fingerprint
+const uint64_t HASH_SEED = 0xCBF29CE484222325ull;
+
+// Mix size bytes of data into an FNV-1a hash
+void hash_bytes(const void *data, size_t size, uint64_t *hash);
+
+// Mix a string and its length into an FNV-1a hash
+void hash_string(const std::string &str, uint64_t *hash);
 #endif  // DECODER_UTILS_H
@@ -0,0 +1,123 @@
+#include "dictionary_builder.h"
+
+#include <cstdint>
+
+#include "decoder_utils.h"
+
+DictionaryBuilder::DictionaryBuilder()
+    : frozen_(0, StateHash{this}, StateEqual{this}), has_words_(false) {
+  path_.push_back(new_state());
+}
+
+size_t DictionaryBuilder::StateHash::operator()(int state) const {
+  const State &s = builder->states_[state];
+  uint64_t h = s.is_final ? 1 : 0;
+  for (const auto &arc : s.arcs) {
+    h = h * 0x9E3779B97F4A7C15ull ^ (static_cast<uint64_t>(arc.first) << 32) ^
+        static_cast<uint32_t>(arc.second);
+  }
+  return h ^ (h >> 29);
+}
+
+bool DictionaryBuilder::StateEqual::operator()(int a, int b) const {
+  const State &sa = builder->states_[a];
+  const State &sb = builder->states_[b];
+  return sa.is_final == sb.is_final && sa.arcs == sb.arcs;
+}
+
+int DictionaryBuilder::new_state() {
+  if (!free_states_.empty()) {
+    int state = free_states_.back();
+    free_states_.pop_back();
+    return state;
+  }
+  states_.emplace_back();
+  states_.back().is_final = false;
+  return states_.size() - 1;
+}
+
+bool DictionaryBuilder::add(const int *labels, size_t length) {
+  size_t common = 0;
+  while (common < length && common < last_word_.size() &&
+         labels[common] == last_word_[common]) {
+    ++common;
+  }
+  if (has_words_ && common == length && common == last_word_.size()) {
+    return false;
+  }
+  VALID_CHECK(!has_words_ || common == last_word_.size() ||
+                  (common < length && labels[common] > last_word_[common]),
+              "Words must be added to the dictionary in sorted order");
+
+  // the rest of the last word's path is done with
+  freeze(common);
+  for (size_t i = common; i < length; ++i) {
+    int state = new_state();
+    states_[path_.back()].arcs.emplace_back(labels[i], state);
+    path_.push_back(state);
+  }
+  states_[path_.back()].is_final = true;
+  last_word_.assign(labels, labels + length);
+  has_words_ = true;
+  return true;
+}
+
+void DictionaryBuilder::freeze(size_t depth) {
+  while (path_.size() > depth + 1) {
+    int state = path_.back();
+    path_.pop_back();
+    auto inserted = frozen_.insert(state);
+    if (!inserted.second) {
+      // an equivalent state is frozen already, point the parent to it
+      states_[path_.back()].arcs.back().second = *inserted.first;
+      states_[state].is_final = false;
+      std::vector<std::pair<int, int>>().swap(states_[state].arcs);
+      free_states_.push_back(state);
+    }
+  }
+}
+
+void DictionaryBuilder::finish(fst::StdVectorFst *dictionary) {
+  dictionary->DeleteStates();
+  if (has_words_) {
+    freeze(0);
+
+    // number the states reachable from the start in breadth first order
+    std::vector<int> ids(states_.size(), -1);
+    std::vector<int> order;
+    ids[path_[0]] = 0;
+    order.push_back(path_[0]);
+    for (size_t i = 0; i < order.size(); ++i) {
+      for (const auto &arc : states_[order[i]].arcs) {
+        if (ids[arc.second] < 0) {
+          ids[arc.second] = order.size();
+          order.push_back(arc.second);
+        }
+      }
+    }
+
+    dictionary->ReserveStates(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      dictionary->AddState();
+    }
+    dictionary->SetStart(0);
+    for (size_t i = 0; i < order.size(); ++i) {
+      const State &state = states_[order[i]];
+      if (state.is_final) {
+        dictionary->SetFinal(i, fst::StdArc::Weight::One());
+      }
+      dictionary->ReserveArcs(i, state.arcs.size());
+      for (const auto &arc : state.arcs) {
+        dictionary->AddArc(
+            i, fst::StdArc(arc.first, arc.first, 0, ids[arc.second]));
+      }
+    }
+  }
+
+  states_.clear();
+  free_states_.clear();
+  frozen_.clear();
+  path_.assign(1, new_state());
+  last_word_.clear();
+  has_words_ = false;
+}
@@ -0,0 +1,86 @@
+#ifndef DICTIONARY_BUILDER_H_
+#define DICTIONARY_BUILDER_H_
+
+#include <cstddef>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "fst/fstlib.h"
+
+/* Incremental construction of the minimal deterministic acceptor of a sorted
+ * list of words (Daciuk et al., 2000), in place of adding one chain of states
+ * per word and determinizing and minimizing the result.
+ *
+ * Only the states on the path of the last word added are open. Once a word
+ * no longer shares them with the next one, they are frozen deepest first and
+ * each is merged into an equivalent frozen state if there is one, so the
+ * automaton never grows past its minimal size plus one word's path.
+ *
+ * Example:
+ *     DictionaryBuilder builder;
+ *     builder.add({1, 2, 3});
+ *     builder.add({1, 3});
+ *     builder.finish(&dictionary);
+ */
+class DictionaryBuilder {
+public:
+  DictionaryBuilder();
+
+  DictionaryBuilder(const DictionaryBuilder &) = delete;
+  DictionaryBuilder &operator=(const DictionaryBuilder &) = delete;
+
+  /* Add a word, which must not sort before the last one added: labels are
+   * compared in order, and a word before its extensions. Return false if it
+   * is the same as the last one.
+   */
+  bool add(const std::vector<int> &word) {
+    return add(word.data(), word.size());
+  }
+
+  bool add(const int *labels, size_t length);
+
+  /* Write the automaton to dictionary, with the arcs of each state sorted
+   * by label and the start state first, and clear the builder. Without
+   * words, dictionary has no states.
+   */
+  void finish(fst::StdVectorFst *dictionary);
+
+  // states currently held, merged ones excluded
+  size_t num_states() const { return states_.size() - free_states_.size(); }
+
+private:
+  struct State {
+    bool is_final;
+    // (label, next state), by increasing label
+    std::vector<std::pair<int, int>> arcs;
+  };
+
+  struct StateHash {
+    const DictionaryBuilder *builder;
+    size_t operator()(int state) const;
+  };
+
+  struct StateEqual {
+    const DictionaryBuilder *builder;
+    bool operator()(int a, int b) const;
+  };
+
+  int new_state();
+
+  // freeze the states of the last word's path deeper than depth, merging
+  // each into an equivalent frozen state if there is one
+  void freeze(size_t depth);
+
+  std::vector<State> states_;
+  // ids of merged states, for reuse
+  std::vector<int> free_states_;
+  // frozen states, unique up to equivalence
+  std::unordered_set<int, StateHash, StateEqual> frozen_;
+  // path_[i] is the state after the first i labels of last_word_
+  std::vector<int> path_;
+  std::vector<int> last_word_;
+  bool has_words_;
+};
+
+#endif  // DICTIONARY_BUILDER_H_
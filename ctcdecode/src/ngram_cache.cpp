@@ -0,0 +1,93 @@
+#include "ngram_cache.h"
+
+#include <algorithm>
+
+NgramCache::NgramCache(size_t max_bytes, size_t num_shards)
+    : num_shards_(std::max<size_t>(num_shards, 1)),
+      num_hits_(0),
+      num_misses_(0),
+      num_evictions_(0) {
+  size_t max_entries = max_bytes / sizeof(Entry);
+  buckets_per_shard_ = std::max<size_t>(max_entries / (num_shards_ * WAYS), 1);
+
+  shards_.reset(new Shard[num_shards_]);
+  for (size_t i = 0; i < num_shards_; ++i) {
+    Entry empty = Entry();
+    shards_[i].entries.assign(buckets_per_shard_ * WAYS, empty);
+    shards_[i].hands.assign(buckets_per_shard_, 0);
+  }
+}
+
+uint64_t NgramCache::hash(const lm::ngram::State &context,
+                          lm::WordIndex word) const {
+  // splitmix64 finalizer over the context hash and the word
+  uint64_t h = hash_value(context) ^ (word * 0x9E3779B97F4A7C15ull);
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+  return h ^ (h >> 31);
+}
+
+bool NgramCache::find(const lm::ngram::State &context,
+                      lm::WordIndex word,
+                      lm::ngram::State *out_state,
+                      float *log10_prob) {
+  uint64_t h = hash(context, word);
+  Shard &shard = shards_[h % num_shards_];
+  size_t bucket = (h / num_shards_) % buckets_per_shard_;
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Entry *entries = &shard.entries[bucket * WAYS];
+    for (size_t i = 0; i < WAYS; ++i) {
+      Entry &entry = entries[i];
+      if (entry.used && entry.word == word && entry.context == context) {
+        entry.referenced = true;
+        *out_state = entry.out_state;
+        *log10_prob = entry.log10_prob;
+        num_hits_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+  }
+  num_misses_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void NgramCache::insert(const lm::ngram::State &context,
+                        lm::WordIndex word,
+                        const lm::ngram::State &out_state,
+                        float log10_prob) {
+  uint64_t h = hash(context, word);
+  Shard &shard = shards_[h % num_shards_];
+  size_t bucket = (h / num_shards_) % buckets_per_shard_;
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  Entry *entries = &shard.entries[bucket * WAYS];
+  Entry *victim = nullptr;
+  for (size_t i = 0; i < WAYS; ++i) {
+    if (!entries[i].used) {
+      victim = &entries[i];
+      break;
+    }
+    // another thread got here first
+    if (entries[i].word == word && entries[i].context == context) {
+      return;
+    }
+  }
+  if (victim == nullptr) {
+    unsigned char &hand = shard.hands[bucket];
+    while (entries[hand].referenced) {
+      entries[hand].referenced = false;
+      hand = (hand + 1) % WAYS;
+    }
+    victim = &entries[hand];
+    hand = (hand + 1) % WAYS;
+    num_evictions_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  victim->context = context;
+  victim->out_state = out_state;
+  victim->word = word;
+  victim->log10_prob = log10_prob;
+  victim->used = true;
+  victim->referenced = false;
+}
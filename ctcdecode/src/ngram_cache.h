@@ -0,0 +1,89 @@
+#ifndef NGRAM_CACHE_H_
+#define NGRAM_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "lm/state.hh"
+#include "lm/word_index.hh"
+
+/* Bounded cache of language model queries: (context state, word) to the
+ * query's log10 probability and out state.
+ *
+ * Shared by every thread decoding with the same Scorer. Entries are spread
+ * over independently locked shards, each a set-associative table whose
+ * buckets evict with the CLOCK algorithm: a hit marks its entry referenced
+ * and an insert into a full bucket evicts the first unreferenced entry from
+ * the bucket's hand, clearing reference marks as it passes them. Keys are
+ * compared in full, so a hit always returns what the model would.
+ */
+class NgramCache {
+public:
+  // entries per bucket
+  static const size_t WAYS = 8;
+
+  // a cache taking at most about max_bytes of memory for its entries, and at
+  // least one bucket per shard
+  explicit NgramCache(size_t max_bytes, size_t num_shards = 64);
+
+  NgramCache(const NgramCache &) = delete;
+  NgramCache &operator=(const NgramCache &) = delete;
+
+  // look a query up, filling out_state and log10_prob on a hit
+  bool find(const lm::ngram::State &context,
+            lm::WordIndex word,
+            lm::ngram::State *out_state,
+            float *log10_prob);
+
+  // remember a query's result, evicting an entry if its bucket is full
+  void insert(const lm::ngram::State &context,
+              lm::WordIndex word,
+              const lm::ngram::State &out_state,
+              float log10_prob);
+
+  // number of entries the cache can hold
+  size_t capacity() const { return num_shards_ * buckets_per_shard_ * WAYS; }
+
+  size_t num_hits() const { return num_hits_.load(std::memory_order_relaxed); }
+
+  size_t num_misses() const {
+    return num_misses_.load(std::memory_order_relaxed);
+  }
+
+  size_t num_evictions() const {
+    return num_evictions_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Entry {
+    lm::ngram::State context;
+    lm::ngram::State out_state;
+    lm::WordIndex word;
+    float log10_prob;
+    bool used;
+    bool referenced;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::vector<Entry> entries;
+    // CLOCK hand of each bucket
+    std::vector<unsigned char> hands;
+  };
+
+  uint64_t hash(const lm::ngram::State &context, lm::WordIndex word) const;
+
+  size_t num_shards_;
+  size_t buckets_per_shard_;
+  std::unique_ptr<Shard[]> shards_;
+
+  std::atomic<size_t> num_hits_;
+  std::atomic<size_t> num_misses_;
+  std::atomic<size_t> num_evictions_;
+};
+
+#endif  // NGRAM_CACHE_H_
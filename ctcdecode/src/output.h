@@ -1,6 +1,9 @@
 #ifndef OUTPUT_H_
 #define OUTPUT_H_
 
+#include <cstddef>
+#include <vector>
+
 /* Struct for the beam search output, containing the tokens based on the vocabulary indices, and the timesteps
  * for each token in the beam search output
  */
@@ -8,4 +11,20 @@ struct Output {
     std::vector<int> tokens, timesteps;
 };
 
+/* Interim result of a decoding stream, see DecoderState::partial: the best hypothesis so far, with how much of it
+ * is settled
+ */
+struct PartialOutput {
+    // tokens of the hypothesis and their timesteps, from token num_unchanged on if only the changes were asked for
+    std::vector<int> tokens, timesteps;
+    // number of tokens of the hypothesis
+    size_t length;
+    // leading tokens shared by every hypothesis of the beam: no later frame changes them
+    size_t num_committed;
+    // leading tokens the same as in the previous partial result of the stream
+    size_t num_unchanged;
+    // beam score of the hypothesis, without the lm score of an unfinished last word
+    double score;
+};
+
 #endif  // OUTPUT_H_
@@ -1,6 +1,7 @@
 #include "path_trie.h"
 
 #include <algorithm>
+#include <cstring>
 #include <limits>
 #include <memory>
 #include <utility>
@@ -19,88 +20,119 @@ PathTrie::PathTrie() {
   ROOT_ = -1;
   character = ROOT_;
   timestep = 0;
+  depth = 0;
+  in_beam = false;
   exists_ = true;
   parent = nullptr;
 
+  has_lm_state = false;
+  lm_oov_horizon = 0;
+  lm_log_cond_prob = 0.0;
+  lm_log_prob_sum = 0.0;
+
   dictionary_ = nullptr;
   dictionary_state_ = 0;
+  dictionary_rank_ = 0;
+  dictionary_word_ = -1;
   has_dictionary_ = false;
 
-  matcher_ = nullptr;
+  pool_ = nullptr;
 }
 
 PathTrie::~PathTrie() {
-  for (auto child : children_) {
-    delete child.second;
+  free_children();
+}
+
+void PathTrie::free_children() {
+  if (children_.empty()) {
+    return;
+  }
+  // free the subtree iteratively, so deep tries can't overflow the call stack
+  std::vector<PathTrie*> stack;
+  auto push = [&stack](int, PathTrie* child) { stack.push_back(child); };
+  children_.for_each(push);
+  while (!stack.empty()) {
+    PathTrie* node = stack.back();
+    stack.pop_back();
+    node->children_.for_each(push);
+    node->children_.clear();
+    free_node(node);
+  }
+  children_.clear();
+}
+
+PathTrie* PathTrie::new_child(int new_char, int new_timestep, float cur_log_prob_c) {
+  PathTrie* new_path = pool_ != nullptr ? pool_->acquire() : new PathTrie;
+  new_path->character = new_char;
+  new_path->timestep = new_timestep;
+  new_path->depth = depth + 1;
+  new_path->parent = this;
+  new_path->log_prob_c = cur_log_prob_c;
+  new_path->pool_ = pool_;
+  return new_path;
+}
+
+void PathTrie::free_node(PathTrie* node) {
+  if (pool_ != nullptr) {
+    pool_->release(node);
+  } else {
+    delete node;
   }
 }
 
 PathTrie* PathTrie::get_path_trie(int new_char, int new_timestep, float cur_log_prob_c, bool reset) {
-  auto child = children_.begin();
-  for (child = children_.begin(); child != children_.end(); ++child) {
-    if (child->first == new_char) {
-      if (child->second->log_prob_c < cur_log_prob_c) {
-	child->second->log_prob_c = cur_log_prob_c;
-	child->second->timestep = new_timestep;
-      }
-      break;
+  PathTrie* child = children_.find(new_char);
+  if (child != nullptr) {
+    if (child->log_prob_c < cur_log_prob_c) {
+      child->log_prob_c = cur_log_prob_c;
+      child->timestep = new_timestep;
     }
-  }
-  if (child != children_.end()) {
-    if (!child->second->exists_) {
-      child->second->exists_ = true;
-      child->second->log_prob_b_prev = -NUM_FLT_INF;
-      child->second->log_prob_nb_prev = -NUM_FLT_INF;
-      child->second->log_prob_b_cur = -NUM_FLT_INF;
-      child->second->log_prob_nb_cur = -NUM_FLT_INF;
+    if (!child->exists_) {
+      child->exists_ = true;
+      child->log_prob_b_prev = -NUM_FLT_INF;
+      child->log_prob_nb_prev = -NUM_FLT_INF;
+      child->log_prob_b_cur = -NUM_FLT_INF;
+      child->log_prob_nb_cur = -NUM_FLT_INF;
     }
-    return (child->second);
+    return child;
   } else {
     if (has_dictionary_) {
-      matcher_->SetState(dictionary_state_);
-      bool found = matcher_->Find(new_char + 1);
+      int next_state;
+      int weight;
+      bool found =
+          dictionary_->find(dictionary_state_, new_char + 1, &next_state, &weight);
       if (!found) {
         // Adding this character causes word outside dictionary
-        auto FSTZERO = fst::TropicalWeight::Zero();
-        auto final_weight = dictionary_->Final(dictionary_state_);
-        bool is_final = (final_weight != FSTZERO);
+        bool is_final = dictionary_->is_final(dictionary_state_);
         if (is_final && reset) {
-          dictionary_state_ = dictionary_->Start();
+          dictionary_state_ = dictionary_->start();
         }
         return nullptr;
       } else {
-        PathTrie* new_path = new PathTrie;
-        new_path->character = new_char;
-        new_path->timestep = new_timestep;
-        new_path->parent = this;
+        PathTrie* new_path = new_child(new_char, new_timestep, cur_log_prob_c);
         new_path->dictionary_ = dictionary_;
         new_path->has_dictionary_ = true;
-        new_path->matcher_ = matcher_;
-	new_path->log_prob_c = cur_log_prob_c;
 
         // set spell checker state
         // check to see if next state is final
-        auto FSTZERO = fst::TropicalWeight::Zero();
-        auto final_weight = dictionary_->Final(matcher_->Value().nextstate);
-        bool is_final = (final_weight != FSTZERO);
+        bool is_final = dictionary_->is_final(next_state);
+        int rank = dictionary_rank_ + weight;
         if (is_final && reset) {
 	  // restart spell checker at the start state
-          new_path->dictionary_state_ = dictionary_->Start();
+          new_path->dictionary_state_ = dictionary_->start();
+          new_path->dictionary_word_ = rank;
         } else {
 	  // go to next state
-          new_path->dictionary_state_ = matcher_->Value().nextstate;
+          new_path->dictionary_state_ = next_state;
+          new_path->dictionary_rank_ = rank;
         }
 
-        children_.push_back(std::make_pair(new_char, new_path));
+        children_.insert(new_char, new_path);
         return new_path;
       }
     } else {
-      PathTrie* new_path = new PathTrie;
-      new_path->character = new_char;
-      new_path->timestep = new_timestep;
-      new_path->parent = this;
-      new_path->log_prob_c = cur_log_prob_c;
-      children_.push_back(std::make_pair(new_char, new_path));
+      PathTrie* new_path = new_child(new_char, new_timestep, cur_log_prob_c);
+      children_.insert(new_char, new_path);
       return new_path;
     }
   }
@@ -114,61 +146,201 @@ PathTrie* PathTrie::get_path_vec(std::vector<int>& output,
                                  std::vector<int>& timesteps,
                                  int stop,
                                  size_t max_steps) {
-  if (character == stop || character == ROOT_ || output.size() == max_steps) {
-    std::reverse(output.begin(), output.end());
-    std::reverse(timesteps.begin(), timesteps.end());
-    return this;
-  } else {
-    output.push_back(character);
-    timesteps.push_back(timestep);
-    return parent->get_path_vec(output, timesteps, stop, max_steps);
+  PathTrie* node = this;
+  while (node->character != stop && node->parent != nullptr &&
+         output.size() != max_steps) {
+    output.push_back(node->character);
+    timesteps.push_back(node->timestep);
+    node = node->parent;
   }
+  std::reverse(output.begin(), output.end());
+  std::reverse(timesteps.begin(), timesteps.end());
+  return node;
 }
 
-void PathTrie::iterate_to_vec(std::vector<PathTrie*>& output) {
-  if (exists_) {
-    log_prob_b_prev = log_prob_b_cur;
-    log_prob_nb_prev = log_prob_nb_cur;
+void PathTrie::shift_log_probs() {
+  shift_log_probs(log_sum_exp(log_prob_b_cur, log_prob_nb_cur));
+}
 
-    log_prob_b_cur = -NUM_FLT_INF;
-    log_prob_nb_cur = -NUM_FLT_INF;
+void PathTrie::shift_log_probs(float new_score) {
+  log_prob_b_prev = log_prob_b_cur;
+  log_prob_nb_prev = log_prob_nb_cur;
 
-    score = log_sum_exp(log_prob_b_prev, log_prob_nb_prev);
-    output.push_back(this);
-  }
-  for (auto child : children_) {
-    child.second->iterate_to_vec(output);
+  log_prob_b_cur = -NUM_FLT_INF;
+  log_prob_nb_cur = -NUM_FLT_INF;
+
+  score = new_score;
+}
+
+void PathTrie::iterate_to_vec(std::vector<PathTrie*>& output) {
+  // explicit stack, so deep tries can't overflow the call stack
+  std::vector<PathTrie*> stack(1, this);
+  while (!stack.empty()) {
+    PathTrie* node = stack.back();
+    stack.pop_back();
+    if (node->exists_) {
+      node->shift_log_probs();
+      output.push_back(node);
+    }
+    node->children_.for_each(
+        [&stack](int, PathTrie* child) { stack.push_back(child); });
   }
 }
 
 void PathTrie::remove() {
   exists_ = false;
 
-  if (children_.size() == 0) {
-    auto child = parent->children_.begin();
-    for (child = parent->children_.begin(); child != parent->children_.end();
-         ++child) {
-      if (child->first == character) {
-        parent->children_.erase(child);
-        break;
-      }
-    }
+  // drop this node, then every ancestor left without children or a hypothesis
+  PathTrie* node = this;
+  while (node->children_.empty() && !node->exists_ &&
+         node->parent != nullptr) {
+    PathTrie* parent_node = node->parent;
+    parent_node->children_.erase(node->character);
+    parent_node->free_node(node);
+    node = parent_node;
+  }
+}
 
-    if (parent->children_.size() == 0 && !parent->exists_) {
-      parent->remove();
-    }
+void PathTrie::reroot(PathTrie* node) {
+  // detach node, so that freeing the old subtree leaves it alone
+  node->parent->children_.erase(node->character);
+  free_children();
+
+  log_prob_b_prev = node->log_prob_b_prev;
+  log_prob_nb_prev = node->log_prob_nb_prev;
+  log_prob_b_cur = node->log_prob_b_cur;
+  log_prob_nb_cur = node->log_prob_nb_cur;
+  log_prob_c = node->log_prob_c;
+  score = node->score;
+  approx_ctc = node->approx_ctc;
+  // keeping the label, so that a repeat of it collapses as before
+  character = node->character;
+  timestep = node->timestep;
+  depth = node->depth;
+  in_beam = node->in_beam;
+  exists_ = node->exists_;
+
+  has_lm_state = node->has_lm_state;
+  lm_oov_horizon = node->lm_oov_horizon;
+  lm_log_cond_prob = node->lm_log_cond_prob;
+  lm_log_prob_sum = node->lm_log_prob_sum;
+  lm_state = node->lm_state;
 
-    delete this;
+  has_dictionary_ = node->has_dictionary_;
+  dictionary_ = node->dictionary_;
+  dictionary_state_ = node->dictionary_state_;
+  dictionary_rank_ = node->dictionary_rank_;
+  dictionary_word_ = node->dictionary_word_;
+
+  children_.swap(node->children_);
+  children_.for_each([this](int, PathTrie* child) { child->parent = this; });
+  free_node(node);
+}
+
+void PathTrie::collect(std::vector<const PathTrie*>& output) const {
+  std::vector<const PathTrie*> stack(1, this);
+  while (!stack.empty()) {
+    const PathTrie* node = stack.back();
+    stack.pop_back();
+    output.push_back(node);
+    node->children_.for_each(
+        [&stack](int, PathTrie* child) { stack.push_back(child); });
   }
 }
 
-void PathTrie::set_dictionary(fst::StdVectorFst* dictionary) {
+void PathTrie::get_record(PathTrieRecord* record) const {
+  // zero the padding too, so equal states give equal snapshots
+  std::memset(record, 0, sizeof(*record));
+  record->parent = -1;
+  record->character = character;
+  record->timestep = timestep;
+  record->depth = depth;
+  record->log_prob_b_prev = log_prob_b_prev;
+  record->log_prob_nb_prev = log_prob_nb_prev;
+  record->log_prob_b_cur = log_prob_b_cur;
+  record->log_prob_nb_cur = log_prob_nb_cur;
+  record->log_prob_c = log_prob_c;
+  record->score = score;
+  record->approx_ctc = approx_ctc;
+  record->exists = exists_;
+  record->has_dictionary = has_dictionary_;
+  record->has_lm_state = has_lm_state;
+  record->lm_oov_horizon = lm_oov_horizon;
+  record->dictionary_state = dictionary_state_;
+  record->dictionary_rank = dictionary_rank_;
+  record->dictionary_word = dictionary_word_;
+  record->lm_log_cond_prob = lm_log_cond_prob;
+  record->lm_log_prob_sum = lm_log_prob_sum;
+  record->lm_state = lm_state;
+}
+
+void PathTrie::set_record(const PathTrieRecord& record) {
+  character = record.character;
+  timestep = record.timestep;
+  depth = record.depth;
+  log_prob_b_prev = record.log_prob_b_prev;
+  log_prob_nb_prev = record.log_prob_nb_prev;
+  log_prob_b_cur = record.log_prob_b_cur;
+  log_prob_nb_cur = record.log_prob_nb_cur;
+  log_prob_c = record.log_prob_c;
+  score = record.score;
+  approx_ctc = record.approx_ctc;
+  exists_ = record.exists != 0;
+  has_dictionary_ = record.has_dictionary != 0 && dictionary_ != nullptr;
+  has_lm_state = record.has_lm_state != 0;
+  lm_oov_horizon = record.lm_oov_horizon;
+  dictionary_state_ = record.dictionary_state;
+  dictionary_rank_ = record.dictionary_rank;
+  dictionary_word_ = record.dictionary_word;
+  lm_log_cond_prob = record.lm_log_cond_prob;
+  lm_log_prob_sum = record.lm_log_prob_sum;
+  lm_state = record.lm_state;
+}
+
+PathTrie* PathTrie::add_child(const PathTrieRecord& record) {
+  if (children_.find(record.character) != nullptr) {
+    return nullptr;
+  }
+  PathTrie* child =
+      new_child(record.character, record.timestep, record.log_prob_c);
+  child->dictionary_ = dictionary_;
+  child->set_record(record);
+  children_.insert(record.character, child);
+  return child;
+}
+
+void PathTrie::set_dictionary(const CompactDictionary* dictionary) {
   dictionary_ = dictionary;
-  dictionary_state_ = dictionary->Start();
+  dictionary_state_ = dictionary->start();
   has_dictionary_ = true;
 }
 
-using FSTMATCH = fst::SortedMatcher<fst::StdVectorFst>;
-void PathTrie::set_matcher(std::shared_ptr<FSTMATCH> matcher) {
-  matcher_ = matcher;
+PathTriePool::PathTriePool(size_t block_size)
+  : block_size_(std::max<size_t>(block_size, 1))
+  , next_in_block_(block_size_)
+  , num_allocated_(0)
+  , num_recycled_(0)
+{
+}
+
+PathTrie* PathTriePool::acquire() {
+  void* slot = nullptr;
+  if (!free_list_.empty()) {
+    slot = free_list_.back();
+    free_list_.pop_back();
+    ++num_recycled_;
+  } else {
+    if (next_in_block_ == block_size_) {
+      blocks_.emplace_back(new Slot[block_size_]);
+      next_in_block_ = 0;
+    }
+    slot = &blocks_.back()[next_in_block_++];
+    ++num_allocated_;
+  }
+  return new (slot) PathTrie;
+}
+
+void PathTriePool::release(PathTrie* node) {
+  node->~PathTrie();
+  free_list_.push_back(node);
 }
@@ -2,12 +2,48 @@
 #define PATH_TRIE_H
 
 #include <algorithm>
+#include <cstdint>
 #include <limits>
 #include <memory>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-#include "fst/fstlib.h"
+#include "lm/state.hh"
+
+#include "child_index.h"
+#include "compact_dictionary.h"
+
+class PathTriePool;
+
+/* State of one PathTrie node as DecoderState snapshots store it, written and
+ * read back as raw bytes on the same platform. Whether the node is in the
+ * beam is stored with the beam instead.
+ */
+struct PathTrieRecord {
+  // index of the parent's record, -1 for the root
+  int32_t parent;
+  int32_t character;
+  int32_t timestep;
+  int32_t depth;
+  float log_prob_b_prev;
+  float log_prob_nb_prev;
+  float log_prob_b_cur;
+  float log_prob_nb_cur;
+  float log_prob_c;
+  float score;
+  float approx_ctc;
+  uint8_t exists;
+  uint8_t has_dictionary;
+  uint8_t has_lm_state;
+  uint8_t lm_oov_horizon;
+  int32_t dictionary_state;
+  int32_t dictionary_rank;
+  int32_t dictionary_word;
+  double lm_log_cond_prob;
+  double lm_log_prob_sum;
+  lm::ngram::State lm_state;
+};
 
 /* Trie tree for prefix storing and manipulating, with a dictionary in
  * finite-state transducer for spelling correction.
@@ -29,19 +65,53 @@ public:
                          int stop,
                          size_t max_steps = std::numeric_limits<size_t>::max());
 
-  // update log probs
+  // move this frame's log probs to prev and recompute the score
+  void shift_log_probs();
+
+  // same, with the score log_sum_exp(log_prob_b_cur, log_prob_nb_cur) given
+  void shift_log_probs(float new_score);
+
+  // update log probs of every existing node below this one and collect them
   void iterate_to_vec(std::vector<PathTrie*>& output);
 
-  // set dictionary for FST
-  void set_dictionary(fst::StdVectorFst* dictionary);
+  // collect this node and every node below it, each after its parent
+  void collect(std::vector<const PathTrie*>& output) const;
+
+  // fill record with the state of this node, leaving its parent to the
+  // caller
+  void get_record(PathTrieRecord* record) const;
 
-  void set_matcher(std::shared_ptr<fst::SortedMatcher<fst::StdVectorFst>>);
+  // set the state of this node from record, keeping its parent, children,
+  // pool and dictionary
+  void set_record(const PathTrieRecord& record);
+
+  // add a child with the state in record, or return nullptr if there is one
+  // for its label already
+  PathTrie* add_child(const PathTrieRecord& record);
+
+  // set dictionary for spelling constraints, shared read-only by all nodes
+  void set_dictionary(const CompactDictionary* dictionary);
+
+  // set the pool that new child nodes are allocated from
+  void set_pool(PathTriePool* pool) { pool_ = pool; }
 
   bool is_empty() { return ROOT_ == character; }
 
+  // rank in the dictionary (see number_dictionary_words) of the word this
+  // node completes, or -1 if it doesn't complete one
+  int dictionary_word() const { return dictionary_word_; }
+
   // remove current path from root
   void remove();
 
+  /* Make this root node take the place of node, a descendant of it that
+   * every remaining prefix descends from: node's state and children move
+   * here, and the path down to node is freed. The labels on that path are
+   * the caller's to keep; depth still counts them, while get_path_vec stops
+   * at the root.
+   */
+  void reroot(PathTrie* node);
+
   float log_prob_b_prev;
   float log_prob_nb_prev;
   float log_prob_b_cur;
@@ -51,20 +121,89 @@ public:
   float approx_ctc;
   int character;
   int timestep;
+  // number of labels from the root to this node, including any folded
+  // into the root by reroot
+  int depth;
+  // true while listed among the decoder's live prefixes
+  bool in_beam;
   PathTrie* parent;
 
+  // Set by Scorer on word boundaries (the root, and the spaces of a word
+  // based lm or every node of a character based one): the lm state after the
+  // word ending here, the word's log conditional probability, the sum of the
+  // log conditional probabilities of all words up to here, and how many
+  // following words still have an OOV word in their n-gram
+  bool has_lm_state;
+  unsigned char lm_oov_horizon;
+  double lm_log_cond_prob;
+  double lm_log_prob_sum;
+  lm::ngram::State lm_state;
+
 private:
+  // allocate a child node from the pool, or the heap if there is no pool
+  PathTrie* new_child(int new_char, int new_timestep, float cur_log_prob_c);
+
+  // free a node previously returned by new_child
+  void free_node(PathTrie* node);
+
+  // free every node below this one
+  void free_children();
+
   int ROOT_;
   bool exists_;
   bool has_dictionary_;
 
-  std::vector<std::pair<int, PathTrie*>> children_;
+  ChildIndex<PathTrie*> children_;
+
+  // pointer to dictionary
+  const CompactDictionary* dictionary_;
+  int dictionary_state_;
+  // sum of the arc weights spelling the current word so far
+  int dictionary_rank_;
+  int dictionary_word_;
+
+  // pool owning this node's children, nullptr to use new/delete
+  PathTriePool* pool_;
+};
+
+/* Free-list pool of PathTrie nodes owned by a single DecoderState.
+ *
+ * Nodes are carved out of fixed-size blocks and returned to a free list when
+ * pruned, so steady-state decoding does not touch the heap. All blocks are
+ * released at once when the pool is destroyed; every node handed out must
+ * have been released (or the owning trie destroyed) before that.
+ * Not thread-safe: a pool belongs to one stream.
+ */
+class PathTriePool {
+public:
+  explicit PathTriePool(size_t block_size = 256);
+  ~PathTriePool() = default;
+
+  PathTriePool(const PathTriePool&) = delete;
+  PathTriePool& operator=(const PathTriePool&) = delete;
+
+  // construct a fresh node, reusing a released slot when possible
+  PathTrie* acquire();
+
+  // destroy a node and put its slot on the free list
+  void release(PathTrie* node);
+
+  // number of nodes served from newly carved slots
+  size_t num_allocated() const { return num_allocated_; }
+
+  // number of nodes served from the free list
+  size_t num_recycled() const { return num_recycled_; }
+
+private:
+  using Slot = std::aligned_storage<sizeof(PathTrie), alignof(PathTrie)>::type;
+
+  size_t block_size_;
+  size_t next_in_block_;
+  std::vector<std::unique_ptr<Slot[]>> blocks_;
+  std::vector<void*> free_list_;
 
-  // pointer to dictionary of FST
-  fst::StdVectorFst* dictionary_;
-  fst::StdVectorFst::StateId dictionary_state_;
-  // true if finding ars in FST
-  std::shared_ptr<fst::SortedMatcher<fst::StdVectorFst>> matcher_;
+  size_t num_allocated_;
+  size_t num_recycled_;
 };
 
 #endif  // PATH_TRIE_H
@@ -0,0 +1,21 @@
+#ifndef PROBS_VIEW_H_
+#define PROBS_VIEW_H_
+
+#include <cstddef>
+
+/* Read-only view of a time x vocabulary matrix of float32 (log) probabilities,
+ * e.g. one batch item of a [B, T, V] tensor, read in place through strides
+ * (counted in elements, not bytes) instead of being copied into vectors.
+ */
+struct ProbsView {
+    const float *data;
+    size_t num_time_steps;
+    size_t vocab_size;
+    ptrdiff_t time_stride;
+    ptrdiff_t vocab_stride;
+
+    // pointer to the first element of time step t
+    const float *frame(size_t t) const { return data + t * time_stride; }
+};
+
+#endif  // PROBS_VIEW_H_
@@ -1,7 +1,19 @@
 #include "scorer.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <tuple>
 
 #include "lm/config.hh"
 #include "lm/model.hh"
@@ -10,69 +22,158 @@
 #include "util/tokenize_piece.hh"
 
 #include "decoder_utils.h"
+#include "dictionary_builder.h"
 
 using namespace lm::ngram;
 
+namespace {
+
+const char DICTIONARY_CACHE_MAGIC[8] = {'C', 'T', 'C', 'D', 'I', 'C', 'T', '\0'};
+// bump on any change to the layout below or to how the dictionary is built
+const uint32_t DICTIONARY_CACHE_VERSION = 1;
+const uint32_t DICTIONARY_CACHE_BYTE_ORDER = 0x01020304;
+
+// start of a dictionary cache file, followed by the lm word index of each
+// dictionary word and the CompactDictionary tables, each padded to 8 bytes
+struct DictionaryCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t key;
+  uint64_t dict_size;
+  uint64_t num_words;
+};
+
+}  // namespace
+
 Scorer::Scorer(double alpha,
                double beta,
                const std::string& lm_path,
-               const std::vector<std::string>& vocab_list) {
+               const std::vector<std::string>& vocab_list,
+               const std::string& dictionary_cache_dir,
+               util::LoadMethod lm_load_method) {
   this->alpha = alpha;
   this->beta = beta;
 
   dictionary = nullptr;
   is_character_based_ = true;
-  language_model_ = nullptr;
 
   max_order_ = 0;
   dict_size_ = 0;
+  model_key_ = 0;
   SPACE_ID_ = -1;
+  dictionary_seconds_ = 0.0;
+  dictionary_from_cache_ = false;
 
-  setup(lm_path, vocab_list);
+  setup(lm_path, vocab_list, dictionary_cache_dir, lm_load_method);
 }
 
 Scorer::~Scorer() {
-  if (language_model_ != nullptr) {
-    delete static_cast<lm::base::Model*>(language_model_);
-  }
   if (dictionary != nullptr) {
     delete static_cast<fst::StdVectorFst*>(dictionary);
   }
 }
 
 void Scorer::setup(const std::string& lm_path,
-                   const std::vector<std::string>& vocab_list) {
+                   const std::vector<std::string>& vocab_list,
+                   const std::string& dictionary_cache_dir,
+                   util::LoadMethod lm_load_method) {
   // load language model
-  load_lm(lm_path);
+  load_lm(lm_path, lm_load_method);
   // set char map for scorer
   set_char_map(vocab_list);
+  model_key_ = get_dictionary_key(true);
   // fill the dictionary for FST
   if (!is_character_based()) {
-    fill_dictionary(true);
+    auto start = std::chrono::steady_clock::now();
+    if (dictionary_cache_dir.empty()) {
+      fill_dictionary(true);
+    } else {
+      uint64_t key = model_key_;
+      char name[32];
+      std::snprintf(name, sizeof(name), "dictionary-%016llx.bin",
+                    static_cast<unsigned long long>(key));
+      std::string path = dictionary_cache_dir + "/" + name;
+      dictionary_from_cache_ = load_dictionary(path, key);
+      if (!dictionary_from_cache_) {
+        fill_dictionary(true);
+        // a cache that can't be written only costs the next load its speedup
+        save_dictionary(path, key);
+      }
+    }
+    dictionary_seconds_ = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
   }
 }
 
-void Scorer::load_lm(const std::string& lm_path) {
+void Scorer::load_lm(const std::string& lm_path,
+                     util::LoadMethod load_method) {
   const char* filename = lm_path.c_str();
   VALID_CHECK_EQ(access(filename, F_OK), 0, "Invalid language model path");
 
-  RetriveStrEnumerateVocab enumerate;
-  lm::ngram::Config config;
-  config.enumerate_vocab = &enumerate;
-  language_model_ = lm::ngram::LoadVirtual(filename, config);
-  max_order_ = static_cast<lm::base::Model*>(language_model_)->Order();
-  vocabulary_ = enumerate.vocabulary;
-  for (size_t i = 0; i < vocabulary_.size(); ++i) {
-    if (is_character_based_ && vocabulary_[i] != UNK_TOKEN &&
-        vocabulary_[i] != START_TOKEN && vocabulary_[i] != END_TOKEN &&
-        get_utf8_str_len(enumerate.vocabulary[i]) > 1) {
+  language_model_ = load_shared_model(lm_path, load_method);
+  max_order_ = language_model_->model->Order();
+  const auto& vocabulary = language_model_->vocabulary;
+  for (size_t i = 0; i < vocabulary.size(); ++i) {
+    if (is_character_based_ && vocabulary[i] != UNK_TOKEN &&
+        vocabulary[i] != START_TOKEN && vocabulary[i] != END_TOKEN &&
+        get_utf8_str_len(vocabulary[i]) > 1) {
       is_character_based_ = false;
     }
   }
 }
 
+std::mutex& Scorer::models_mutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+std::map<Scorer::ModelId, std::weak_ptr<const Scorer::LoadedModel>>&
+Scorer::loaded_models() {
+  static std::map<ModelId, std::weak_ptr<const LoadedModel>> models;
+  return models;
+}
+
+size_t Scorer::num_loaded_models() {
+  std::lock_guard<std::mutex> lock(models_mutex());
+  const auto& models = loaded_models();
+  return std::count_if(models.begin(), models.end(), [](const auto& entry) {
+    return !entry.second.expired();
+  });
+}
+
+std::shared_ptr<const Scorer::LoadedModel> Scorer::load_shared_model(
+    const std::string& lm_path, util::LoadMethod load_method) {
+  struct stat st;
+  VALID_CHECK_EQ(stat(lm_path.c_str(), &st), 0, "Invalid language model path");
+  ModelId id(st.st_dev, st.st_ino, st.st_size, st.st_mtime, load_method);
+
+  // loading under the lock keeps two Scorers from loading the same file at
+  // once; Scorers are rarely created concurrently
+  std::lock_guard<std::mutex> lock(models_mutex());
+  auto& models = loaded_models();
+  std::shared_ptr<const LoadedModel> loaded = models[id].lock();
+  if (loaded == nullptr) {
+    std::shared_ptr<LoadedModel> model = std::make_shared<LoadedModel>();
+    RetriveStrEnumerateVocab enumerate;
+    lm::ngram::Config config;
+    config.enumerate_vocab = &enumerate;
+    config.load_method = load_method;
+    model->model.reset(lm::ngram::LoadVirtual(lm_path.c_str(), config));
+    model->vocabulary = std::move(enumerate.vocabulary);
+    loaded = model;
+    models[id] = loaded;
+  }
+  // drop the entries of models released since
+  for (auto it = models.begin(); it != models.end();) {
+    it = it->second.expired() ? models.erase(it) : std::next(it);
+  }
+  return loaded;
+}
+
 double Scorer::get_log_cond_prob(const std::vector<std::string>& words) {
-  lm::base::Model* model = static_cast<lm::base::Model*>(language_model_);
+  lm::base::Model* model = language_model_->model.get();
   double cond_prob;
   lm::ngram::State state, tmp_state, out_state;
   // avoid to inserting <s> in begin
@@ -83,7 +184,7 @@ double Scorer::get_log_cond_prob(const std::vector<std::string>& words) {
     if (word_index == 0) {
       return OOV_SCORE;
     }
-    cond_prob = model->BaseScore(&state, word_index, &out_state);
+    cond_prob = base_score(state, word_index, &out_state);
     tmp_state = state;
     state = out_state;
     out_state = tmp_state;
@@ -92,6 +193,178 @@ double Scorer::get_log_cond_prob(const std::vector<std::string>& words) {
   return cond_prob/NUM_FLT_LOGE;
 }
 
+double Scorer::get_log_cond_prob(PathTrie* node) {
+  if (node->has_lm_state) {
+    return node->lm_log_cond_prob;
+  }
+
+  // boundaries back to the last one with a state, usually just node
+  std::vector<PathTrie*> boundaries;
+  std::vector<lm::WordIndex> words;
+  boundaries.push_back(node);
+  while (!boundaries.back()->has_lm_state) {
+    PathTrie* boundary = boundaries.back();
+    if (boundary->parent == nullptr) {
+      set_start_state(boundary);
+      break;
+    }
+    words.emplace_back();
+    boundaries.push_back(get_word_start(boundary, &words.back()));
+  }
+
+  // score them oldest first, each from the state of the one before
+  for (size_t i = words.size(); i-- > 0;) {
+    PathTrie* boundary = boundaries[i];
+    const PathTrie* start = boundaries[i + 1];
+    boundary->lm_log_cond_prob = score_word(start->lm_state,
+                                            start->lm_oov_horizon,
+                                            words[i],
+                                            &boundary->lm_state,
+                                            &boundary->lm_oov_horizon);
+    boundary->lm_log_prob_sum =
+        start->lm_log_prob_sum + boundary->lm_log_cond_prob;
+    boundary->has_lm_state = true;
+  }
+  return node->lm_log_cond_prob;
+}
+
+double Scorer::get_last_word_log_cond_prob(PathTrie* node) {
+  std::vector<int> labels;
+  std::vector<int> timesteps;
+  PathTrie* start = node->get_path_vec(labels, timesteps, SPACE_ID_);
+  get_log_cond_prob(start);
+
+  auto model = language_model_->model.get();
+  lm::ngram::State out_state;
+  unsigned char out_horizon;
+  return score_word(start->lm_state,
+                    start->lm_oov_horizon,
+                    model->BaseVocabulary().Index(vec2str(labels)),
+                    &out_state,
+                    &out_horizon);
+}
+
+double Scorer::get_sent_log_prob(PathTrie* node) {
+  auto model = language_model_->model.get();
+  lm::WordIndex end_index = model->BaseVocabulary().Index(END_TOKEN);
+  lm::ngram::State out_state;
+  unsigned char out_horizon;
+
+  if (node->is_empty()) {
+    // make_ngram pads an empty sentence with one more start token
+    get_log_cond_prob(node);
+    double score = 0.0;
+    score += score_word(node->lm_state,
+                        0,
+                        model->BaseVocabulary().Index(START_TOKEN),
+                        &out_state,
+                        &out_horizon);
+    score += score_word(node->lm_state, 0, end_index, &out_state, &out_horizon);
+    return score;
+  }
+
+  // sum of the finished words, plus the unfinished one of a word based lm
+  double score;
+  lm::ngram::State state;
+  unsigned char horizon;
+  if (is_character_based_ || node->character == SPACE_ID_) {
+    get_log_cond_prob(node);
+    score = node->lm_log_prob_sum;
+    state = node->lm_state;
+    horizon = node->lm_oov_horizon;
+  } else {
+    std::vector<int> labels;
+    std::vector<int> timesteps;
+    PathTrie* start = node->get_path_vec(labels, timesteps, SPACE_ID_);
+    get_log_cond_prob(start);
+    score = start->lm_log_prob_sum;
+    score += score_word(start->lm_state,
+                        start->lm_oov_horizon,
+                        model->BaseVocabulary().Index(vec2str(labels)),
+                        &state,
+                        &horizon);
+  }
+  score += score_word(state, horizon, end_index, &out_state, &out_horizon);
+  return score;
+}
+
+PathTrie* Scorer::get_word_start(PathTrie* node, lm::WordIndex* word_index) {
+  if (is_character_based_) {
+    *word_index = char_word_indices_[node->character];
+    return node->parent;
+  }
+  // the word ends at the node before the space
+  int rank = node->dictionary_word();
+  if (rank < 0) {
+    // spelled outside the dictionary, look the word up by its string
+    std::vector<int> labels;
+    std::vector<int> timesteps;
+    PathTrie* start = node->parent->get_path_vec(labels, timesteps, SPACE_ID_);
+    auto model = language_model_->model.get();
+    *word_index = model->BaseVocabulary().Index(vec2str(labels));
+    return start;
+  }
+  *word_index = dictionary_word_indices_[rank];
+  PathTrie* start = node->parent;
+  while (start->character != SPACE_ID_ && !start->is_empty()) {
+    start = start->parent;
+  }
+  return start;
+}
+
+bool Scorer::is_valid_state(const lm::ngram::State& state) const {
+  if (state.length >= max_order_) {
+    return false;
+  }
+  lm::WordIndex bound = language_model_->model->BaseVocabulary().Bound();
+  for (unsigned char i = 0; i < state.length; ++i) {
+    if (state.words[i] >= bound) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Scorer::set_start_state(PathTrie* root) {
+  lm::base::Model* model = language_model_->model.get();
+  // as if preceded by the max_order_ - 1 start tokens make_ngram pads with
+  lm::ngram::State state, out_state;
+  model->NullContextWrite(&state);
+  lm::WordIndex start_index = model->BaseVocabulary().Index(START_TOKEN);
+  for (size_t i = 0; i + 1 < max_order_; ++i) {
+    base_score(state, start_index, &out_state);
+    state = out_state;
+  }
+  root->lm_state = state;
+  root->lm_oov_horizon = 0;
+  root->lm_log_cond_prob = 0.0;
+  root->lm_log_prob_sum = 0.0;
+  root->has_lm_state = true;
+}
+
+double Scorer::score_word(const lm::ngram::State& in_state,
+                          unsigned char in_horizon,
+                          lm::WordIndex word_index,
+                          lm::ngram::State* out_state,
+                          unsigned char* out_horizon) {
+  lm::base::Model* model = language_model_->model.get();
+  if (word_index == 0) {
+    // an OOV word gets OOV_SCORE, and so do the following words whose
+    // n-gram still reaches back to it; their context restarts after it
+    model->NullContextWrite(out_state);
+    *out_horizon = max_order_ - 1;
+    return OOV_SCORE;
+  }
+  double cond_prob = base_score(in_state, word_index, out_state);
+  if (in_horizon > 0) {
+    *out_horizon = in_horizon - 1;
+    return OOV_SCORE;
+  }
+  *out_horizon = 0;
+  // return  loge prob
+  return cond_prob / NUM_FLT_LOGE;
+}
+
 double Scorer::get_sent_log_prob(const std::vector<std::string>& words) {
   std::vector<std::string> sentence;
   if (words.size() == 0) {
@@ -124,6 +397,26 @@ void Scorer::reset_params(float alpha, float beta) {
   this->beta = beta;
 }
 
+void Scorer::set_cache(size_t max_bytes) {
+  cache_.reset(max_bytes > 0 ? new NgramCache(max_bytes) : nullptr);
+}
+
+float Scorer::base_score(const lm::ngram::State& in_state,
+                         lm::WordIndex word,
+                         lm::ngram::State* out_state) {
+  float log10_prob;
+  if (cache_ != nullptr &&
+      cache_->find(in_state, word, out_state, &log10_prob)) {
+    return log10_prob;
+  }
+  lm::base::Model* model = language_model_->model.get();
+  log10_prob = model->BaseScore(&in_state, word, out_state);
+  if (cache_ != nullptr) {
+    cache_->insert(in_state, word, *out_state, log10_prob);
+  }
+  return log10_prob;
+}
+
 std::string Scorer::vec2str(const std::vector<int>& input) {
   std::string word;
   for (auto ind : input) {
@@ -158,6 +451,12 @@ void Scorer::set_char_map(const std::vector<std::string>& char_list) {
     // state, otherwise wrong decoding results would be given.
     char_map_[char_list_[i]] = i + 1;
   }
+
+  auto model = language_model_->model.get();
+  char_word_indices_.clear();
+  for (const auto& c : char_list_) {
+    char_word_indices_.push_back(model->BaseVocabulary().Index(c));
+  }
 }
 
 std::vector<std::string> Scorer::make_ngram(PathTrie* prefix) {
@@ -181,7 +480,7 @@ std::vector<std::string> Scorer::make_ngram(PathTrie* prefix) {
     std::string word = vec2str(prefix_vec);
     ngram.push_back(word);
 
-    if (new_node->character == -1) {
+    if (new_node->parent == nullptr) {
       // No more spaces, but still need order
       for (int i = 0; i < max_order_ - order - 1; i++) {
         ngram.push_back(START_TOKEN);
@@ -194,37 +493,194 @@ std::vector<std::string> Scorer::make_ngram(PathTrie* prefix) {
 }
 
 void Scorer::fill_dictionary(bool add_space) {
-  fst::StdVectorFst dictionary;
-  // For each unigram convert to ints and put in trie
-  int dict_size = 0;
-  for (const auto& word : vocabulary_) {
-    bool added = add_word_to_dictionary(
-        word, char_map_, add_space, SPACE_ID_ + 1, &dictionary);
-    dict_size += added ? 1 : 0;
+  auto model = language_model_->model.get();
+
+  // the labels of every word, one after the other, and the lm index each
+  // is scored as: an entry with spaces as its last word, like make_ngram
+  // splits it
+  std::vector<int> all_labels;
+  std::vector<size_t> word_starts;
+  std::vector<lm::WordIndex> word_indices;
+  std::vector<int> labels;
+  for (const auto& word : language_model_->vocabulary) {
+    if (!word_to_dictionary_labels(
+            word, char_map_, add_space, SPACE_ID_ + 1, &labels)) {
+      continue;
+    }
+    word_starts.push_back(all_labels.size());
+    all_labels.insert(all_labels.end(), labels.begin(), labels.end());
+    word_indices.push_back(
+        model->BaseVocabulary().Index(word.substr(word.rfind(' ') + 1)));
   }
+  word_starts.push_back(all_labels.size());
+  size_t num_words = word_indices.size();
+  dict_size_ = num_words;
 
-  dict_size_ = dict_size;
-
-  /* Simplify FST
-
-   * This gets rid of "epsilon" transitions in the FST.
-   * These are transitions that don't require a string input to be taken.
-   * Getting rid of them is necessary to make the FST determinisitc, but
-   * can greatly increase the size of the FST
+  std::vector<size_t> order(num_words);
+  for (size_t i = 0; i < num_words; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return std::lexicographical_compare(all_labels.begin() + word_starts[a],
+                                        all_labels.begin() + word_starts[a + 1],
+                                        all_labels.begin() + word_starts[b],
+                                        all_labels.begin() + word_starts[b + 1]);
+  });
+
+  /* Build the minimal deterministic fst accepting the words straight from
+   * the sorted list: for any string input there's only one possible state
+   * the fst could be in, as the decoder assumes, and it has no more states
+   * than necessary.
+   *
+   * The words are numbered so that the decoder finds the lm index of a word
+   * from the fst path that spells it, without building the word's string
+   * (see number_dictionary_words). Arcs are sorted by label, so the rank of
+   * a word is its position in the sorted list, duplicates left out.
    */
-  fst::RmEpsilon(&dictionary);
+  DictionaryBuilder builder;
+  dictionary_word_indices_.clear();
+  for (size_t i : order) {
+    const int* word = all_labels.data() + word_starts[i];
+    if (builder.add(word, word_starts[i + 1] - word_starts[i])) {
+      dictionary_word_indices_.push_back(word_indices[i]);
+    }
+  }
   fst::StdVectorFst* new_dict = new fst::StdVectorFst;
+  builder.finish(new_dict);
+  size_t num_ranks = number_dictionary_words(new_dict);
+  VALID_CHECK_EQ(num_ranks,
+                 dictionary_word_indices_.size(),
+                 "Dictionary words numbered inconsistently");
 
-  /* This makes the FST deterministic, meaning for any string input there's
-   * only one possible state the FST could be in.  It is assumed our
-   * dictionary is deterministic when using it.
-   * (lest we'd have to check for multiple transitions at each state)
-   */
-  fst::Determinize(dictionary, new_dict);
-
-  /* Finds the simplest equivalent fst. This is unnecessary but decreases
-   * memory usage of the dictionary
-   */
-  fst::Minimize(new_dict);
   this->dictionary = new_dict;
+  compact_dictionary_.reset(new CompactDictionary(*new_dict));
+}
+
+Scorer::DictionaryStats Scorer::get_dictionary_stats() const {
+  DictionaryStats stats{dictionary_seconds_, dictionary_from_cache_, 0, 0};
+  if (compact_dictionary_ != nullptr) {
+    stats.num_states = compact_dictionary_->num_states();
+    stats.num_arcs = compact_dictionary_->num_arcs();
+  }
+  return stats;
+}
+
+uint64_t Scorer::get_dictionary_key(bool add_space) const {
+  auto model = language_model_->model.get();
+  uint64_t hash = HASH_SEED;
+  uint64_t count = language_model_->vocabulary.size();
+  hash_bytes(&count, sizeof(count), &hash);
+  for (const auto& word : language_model_->vocabulary) {
+    hash_string(word, &hash);
+    lm::WordIndex index = model->BaseVocabulary().Index(word);
+    hash_bytes(&index, sizeof(index), &hash);
+  }
+  count = char_list_.size();
+  hash_bytes(&count, sizeof(count), &hash);
+  for (const auto& label : char_list_) {
+    hash_string(label, &hash);
+  }
+  unsigned char space = add_space ? 1 : 0;
+  hash_bytes(&space, sizeof(space), &hash);
+  return hash;
+}
+
+bool Scorer::load_dictionary(const std::string& path, uint64_t key) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(DictionaryCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  // unmapped once the file and the dictionary using it are both released
+  std::shared_ptr<const void> mapping(
+      data, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+
+  const char* bytes = static_cast<const char*>(data);
+  const DictionaryCacheHeader* header =
+      reinterpret_cast<const DictionaryCacheHeader*>(bytes);
+  if (std::memcmp(header->magic, DICTIONARY_CACHE_MAGIC,
+                  sizeof(header->magic)) != 0 ||
+      header->version != DICTIONARY_CACHE_VERSION ||
+      header->byte_order != DICTIONARY_CACHE_BYTE_ORDER ||
+      header->key != key) {
+    return false;
+  }
+  size_t offset = sizeof(DictionaryCacheHeader);
+  size_t indices_size =
+      (header->num_words * sizeof(lm::WordIndex) + 7) / 8 * 8;
+  if (header->num_words > size / sizeof(lm::WordIndex) ||
+      size - offset < indices_size) {
+    return false;
+  }
+  const lm::WordIndex* indices =
+      reinterpret_cast<const lm::WordIndex*>(bytes + offset);
+  offset += indices_size;
+
+  size_t table_size;
+  std::unique_ptr<CompactDictionary> compact = CompactDictionary::from_tables(
+      bytes + offset, size - offset, mapping, &table_size);
+  if (compact == nullptr || offset + table_size != size) {
+    return false;
+  }
+  dictionary_word_indices_.assign(indices, indices + header->num_words);
+  dict_size_ = header->dict_size;
+  compact_dictionary_ = std::move(compact);
+  return true;
+}
+
+bool Scorer::save_dictionary(const std::string& path, uint64_t key) const {
+  if (compact_dictionary_ == nullptr) {
+    return false;
+  }
+  DictionaryCacheHeader header;
+  std::memcpy(header.magic, DICTIONARY_CACHE_MAGIC, sizeof(header.magic));
+  header.version = DICTIONARY_CACHE_VERSION;
+  header.byte_order = DICTIONARY_CACHE_BYTE_ORDER;
+  header.key = key;
+  header.dict_size = dict_size_;
+  header.num_words = dictionary_word_indices_.size();
+
+  // written aside and renamed, so that concurrent loads never see a partial
+  // file; each call gets its own temporary file, so that concurrent saves,
+  // from other threads too, never write into the same one
+  std::string tmp_path = path + ".tmpXXXXXX";
+  int fd = mkstemp(&tmp_path[0]);
+  if (fd < 0) {
+    return false;
+  }
+  // mkstemp makes it readable by its owner only, the cache is for all users
+  // of the directory
+  fchmod(fd, 0644);
+  close(fd);
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    size_t indices_size = header.num_words * sizeof(lm::WordIndex);
+    out.write(reinterpret_cast<const char*>(dictionary_word_indices_.data()),
+              indices_size);
+    static const char zeros[8] = {0};
+    out.write(zeros, (indices_size + 7) / 8 * 8 - indices_size);
+    compact_dictionary_->write(out);
+    out.close();
+    if (!out) {
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
 }
@@ -1,16 +1,23 @@
 #ifndef SCORER_H_
 #define SCORER_H_
 
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
 #include "lm/enumerate_vocab.hh"
 #include "lm/virtual_interface.hh"
 #include "lm/word_index.hh"
+#include "util/mmap.hh"
 #include "util/string_piece.hh"
 
+#include "compact_dictionary.h"
+#include "ngram_cache.h"
 #include "path_trie.h"
 
 const double OOV_SCORE = -1000.0;
@@ -40,16 +47,59 @@ public:
  */
 class Scorer {
 public:
+  // how the dictionary of a word based lm was set up
+  struct DictionaryStats {
+    // wall clock seconds spent building it, or loading it from the cache
+    double seconds;
+    bool from_cache;
+    size_t num_states;
+    size_t num_arcs;
+  };
+
+  /* With a dictionary_cache_dir, the dictionary of a word based lm is
+   * loaded from a file in that directory when one was written for the same
+   * lm vocabulary and labels, and written there after building it otherwise.
+   *
+   * lm_load_method is how a binary lm gets into memory: mapped and paged in
+   * on use (util::LAZY), mapped and prefaulted (util::POPULATE_OR_LAZY), or
+   * copied (util::READ); see util::LoadMethod. A mapped lm is shared through
+   * the page cache by all processes using the same file. Within a process,
+   * Scorers of the same lm file and load method share one loaded model; a
+   * Scorer asking for another load method loads its own.
+   */
   Scorer(double alpha,
          double beta,
          const std::string &lm_path,
-         const std::vector<std::string> &vocabulary);
+         const std::vector<std::string> &vocabulary,
+         const std::string &dictionary_cache_dir = "",
+         util::LoadMethod lm_load_method = util::POPULATE_OR_READ);
   ~Scorer();
 
   double get_log_cond_prob(const std::vector<std::string> &words);
 
+  /* Log conditional probability of the word that ends on entering node: a
+   * space for a word based lm, any character for a character based one.
+   * Scored with a single lm query from the state cached on the previous word
+   * boundary; the result and the new state are cached on node. Same value as
+   * get_log_cond_prob(make_ngram(...)) on the word's n-gram.
+   */
+  double get_log_cond_prob(PathTrie *node);
+
+  /* Log conditional probability of the unfinished word at the end of node's
+   * prefix, for a word based lm: a single lm query from the state cached on
+   * the word's start. Same value as get_log_cond_prob(make_ngram(node)).
+   */
+  double get_last_word_log_cond_prob(PathTrie *node);
+
   double get_sent_log_prob(const std::vector<std::string> &words);
 
+  /* Log probability of the sentence spelled by node's prefix. Sums the scores
+   * accumulated on its word boundaries, so only the unfinished last word and
+   * the end of sentence are queried. Same value as get_sent_log_prob on the
+   * prefix's split_labels.
+   */
+  double get_sent_log_prob(PathTrie *node);
+
   // return the max order
   size_t get_max_order() const { return max_order_; }
 
@@ -59,9 +109,27 @@ public:
   // retrun true if the language model is character based
   bool is_character_based() const { return is_character_based_; }
 
+  // fingerprint of the lm vocabulary and labels, which the lm and dictionary
+  // states a decoder keeps refer to
+  uint64_t get_model_key() const { return model_key_; }
+
+  // whether state could have come from this lm, e.g. from a DecoderState
+  // snapshot
+  bool is_valid_state(const lm::ngram::State &state) const;
+
+  // number of lms the Scorers of the process have loaded and still use
+  static size_t num_loaded_models();
+
   // reset params alpha & beta
   void reset_params(float alpha, float beta);
 
+  // cache lm queries in at most about max_bytes, shared by all threads
+  // decoding with this scorer; 0 disables the cache. Not while decoding.
+  void set_cache(size_t max_bytes);
+
+  // the lm query cache, nullptr if disabled
+  const NgramCache *get_cache() const { return cache_.get(); }
+
   // make ngram for a given prefix
   std::vector<std::string> make_ngram(PathTrie *prefix);
 
@@ -74,20 +142,44 @@ public:
   // word insertion weight
   double beta;
 
-  // pointer to the dictionary of FST
+  // pointer to the dictionary of FST, nullptr if the dictionary was loaded
+  // from the cache
   void *dictionary;
 
+  // the dictionary frozen for the decoder's lookups, nullptr for a
+  // character based lm
+  const CompactDictionary *get_compact_dictionary() const {
+    return compact_dictionary_.get();
+  }
+
+  // all zero for a character based lm
+  DictionaryStats get_dictionary_stats() const;
+
 protected:
   // necessary setup: load language model, set char map, fill FST's dictionary
   void setup(const std::string &lm_path,
-             const std::vector<std::string> &vocab_list);
+             const std::vector<std::string> &vocab_list,
+             const std::string &dictionary_cache_dir,
+             util::LoadMethod lm_load_method);
 
-  // load language model from given path
-  void load_lm(const std::string &lm_path);
+  // load language model from given path, or share the one loaded already
+  void load_lm(const std::string &lm_path, util::LoadMethod load_method);
 
   // fill dictionary for FST
   void fill_dictionary(bool add_space);
 
+  // fingerprint of what fill_dictionary builds from: the lm vocabulary and
+  // word indices, the labels and add_space
+  uint64_t get_dictionary_key(bool add_space) const;
+
+  // load the dictionary from a cache file written under key, mapping its
+  // tables; return false if the file is missing, stale or malformed
+  bool load_dictionary(const std::string &path, uint64_t key);
+
+  // write the dictionary to a cache file under key, replacing the file
+  // atomically; return false on failure
+  bool save_dictionary(const std::string &path, uint64_t key) const;
+
   // set char map
   void set_char_map(const std::vector<std::string> &char_list);
 
@@ -96,17 +188,65 @@ protected:
   // translate the vector in index to string
   std::string vec2str(const std::vector<int> &input);
 
+  // return the word boundary before the word that ends on entering node and
+  // store that word's index in word_index
+  PathTrie *get_word_start(PathTrie *node, lm::WordIndex *word_index);
+
+  // set the lm state of a trie root, i.e. the start of a sentence
+  void set_start_state(PathTrie *root);
+
+  // lm query through the cache: log10 prob of word after in_state
+  float base_score(const lm::ngram::State &in_state,
+                   lm::WordIndex word,
+                   lm::ngram::State *out_state);
+
+  // loge prob of word after in_state, in_horizon words after an OOV word;
+  // stores the state and horizon following it
+  double score_word(const lm::ngram::State &in_state,
+                    unsigned char in_horizon,
+                    lm::WordIndex word_index,
+                    lm::ngram::State *out_state,
+                    unsigned char *out_horizon);
+
 private:
-  void *language_model_;
+  // a loaded lm with the words of its vocabulary, in the lm's order
+  struct LoadedModel {
+    std::unique_ptr<lm::base::Model> model;
+    std::vector<std::string> vocabulary;
+  };
+
+  // loaded models by the identity of their file, so that a file replaced on
+  // disk is loaded again, and their load method
+  using ModelId = std::tuple<uint64_t, uint64_t, uint64_t, int64_t, int>;
+
+  static std::mutex &models_mutex();
+  static std::map<ModelId, std::weak_ptr<const LoadedModel>> &loaded_models();
+
+  // the model loaded from lm_path, shared with the other Scorers of the
+  // process using the same file and load method while any of them is alive
+  static std::shared_ptr<const LoadedModel> load_shared_model(
+      const std::string &lm_path, util::LoadMethod load_method);
+
+  std::shared_ptr<const LoadedModel> language_model_;
   bool is_character_based_;
   size_t max_order_;
   size_t dict_size_;
+  uint64_t model_key_;
 
   int SPACE_ID_;
   std::vector<std::string> char_list_;
   std::unordered_map<std::string, int> char_map_;
+  // lm word index of each label, for a character based lm
+  std::vector<lm::WordIndex> char_word_indices_;
+  // lm word index of the last word of each dictionary entry, by the entry's
+  // rank in the dictionary fst, for a word based lm
+  std::vector<lm::WordIndex> dictionary_word_indices_;
+
+  std::unique_ptr<CompactDictionary> compact_dictionary_;
+  double dictionary_seconds_;
+  bool dictionary_from_cache_;
 
-  std::vector<std::string> vocabulary_;
+  std::unique_ptr<NgramCache> cache_;
 };
 
 #endif  // SCORER_H_
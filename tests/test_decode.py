@@ -1,12 +1,21 @@
 """Test decoders."""
 from __future__ import absolute_import, division, print_function
 
+import math
 import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
 import unittest
 
 import ctcdecode
 import torch
 
+FLT_MIN = 1.1754943508222875e-38
+
 
 class TestDecoders(unittest.TestCase):
     def setUp(self):
@@ -63,6 +72,201 @@ class TestDecoders(unittest.TestCase):
         output_str = self.convert_to_string(beam_result[0][0], self.vocab_list, out_seq_len[0][0])
         self.assertEqual(output_str, self.beam_search_result[2])
 
+    def test_beam_search_decoder_lm_cache(self):
+        lm_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_"), model_path=lm_path
+        )
+        cached_decoder = ctcdecode.CTCBeamDecoder(
+            self.vocab_list,
+            beam_width=self.beam_size,
+            blank_id=self.vocab_list.index("_"),
+            model_path=lm_path,
+            lm_cache_mb=1,
+        )
+        self.assertEqual(decoder.lm_cache_stats()["capacity"], 0)
+
+        beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+        for _ in range(2):
+            cached_results, cached_scores, cached_timesteps, cached_seq_len = cached_decoder.decode(probs_seq)
+            self.assertTrue(torch.equal(cached_scores, beam_scores))
+            self.assertTrue(torch.equal(cached_seq_len, out_seq_len))
+            for b in range(2):
+                length = out_seq_len[b][0]
+                self.assertTrue(torch.equal(cached_results[b][0][:length], beam_results[b][0][:length]))
+        stats = cached_decoder.lm_cache_stats()
+        self.assertGreater(stats["capacity"], 0)
+        self.assertGreater(stats["misses"], 0)
+        # the second pass queries exactly what the first one did
+        self.assertGreaterEqual(stats["hits"], stats["misses"])
+
+    def test_beam_search_decoder_dictionary(self):
+        lm_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
+        labels = ["_", " ", "'"] + [chr(c) for c in range(ord("a"), ord("z") + 1)]
+        space = labels.index(" ")
+        decoder = ctcdecode.CTCBeamDecoder(labels, model_path=lm_path)
+
+        # the lm words spelled by the labels, each followed by a space
+        with open(lm_path) as f:
+            lines = f.read().split("\\1-grams:\n")[1].split("\n\n")[0].splitlines()
+        lm_words = [line.split("\t")[1] for line in lines]
+        words = sorted(
+            set(tuple(labels.index(c) for c in word) + (space,) for word in lm_words if all(c in labels for c in word))
+        )
+        self.assertEqual(decoder.dict_size(), len(words))
+
+        # the minimal deterministic acceptor of the words, which determinizing
+        # and minimizing one chain of states per word used to build: one state
+        # per distinct set of suffixes
+        trie = {}
+        for word in words:
+            node = trie
+            for label in word:
+                node = node.setdefault(label, {})
+            node[None] = {}
+        states = {}
+
+        def state_of(node):
+            arcs = tuple((label, state_of(node[label])) for label in sorted(k for k in node if k is not None))
+            return states.setdefault((None in node, arcs), len(states))
+
+        state_of(trie)
+        stats = decoder.dictionary_stats()
+        self.assertEqual(stats["num_states"], len(states))
+        self.assertEqual(stats["num_arcs"], sum(len(arcs) for _, arcs in states))
+
+        # words are numbered in sorted order, and only they are accepted
+        ranks = {word: rank for rank, word in enumerate(words)}
+
+        def rank_of(word):
+            return ctcdecode.ctc_decode._dictionary_word_rank(decoder._scorer, list(word))
+
+        for word, rank in ranks.items():
+            self.assertEqual(rank_of(word), rank)
+            self.assertEqual(rank_of(word[:-1]), -1)
+            extended = word[:-1] + (labels.index("s"), space)
+            self.assertEqual(rank_of(extended), ranks.get(extended, -1))
+
+    def test_beam_search_decoder_dictionary_cache(self):
+        lm_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_"), model_path=lm_path
+        )
+        beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+
+        cache_dir = tempfile.mkdtemp()
+        try:
+            # the first decoder builds and saves the dictionary, the second loads it
+            for from_cache in [False, True]:
+                cached_decoder = ctcdecode.CTCBeamDecoder(
+                    self.vocab_list,
+                    beam_width=self.beam_size,
+                    blank_id=self.vocab_list.index("_"),
+                    model_path=lm_path,
+                    dictionary_cache_dir=cache_dir,
+                )
+                self.assertEqual(len(os.listdir(cache_dir)), 1)
+                self.assertEqual(cached_decoder.dict_size(), decoder.dict_size())
+                stats = cached_decoder.dictionary_stats()
+                self.assertEqual(stats["from_cache"], from_cache)
+                self.assertEqual(stats["num_states"], decoder.dictionary_stats()["num_states"])
+                self.assertEqual(stats["num_arcs"], decoder.dictionary_stats()["num_arcs"])
+                cached_results, cached_scores, cached_timesteps, cached_seq_len = cached_decoder.decode(probs_seq)
+                self.assertTrue(torch.equal(cached_scores, beam_scores))
+                self.assertTrue(torch.equal(cached_seq_len, out_seq_len))
+                for b in range(2):
+                    length = out_seq_len[b][0]
+                    self.assertTrue(torch.equal(cached_results[b][0][:length], beam_results[b][0][:length]))
+
+            # a label bit set in the last state's mask without a matching arc
+            # makes the cache inconsistent, it is rebuilt instead of used
+            cache_path = os.path.join(cache_dir, os.listdir(cache_dir)[0])
+            with open(cache_path, "r+b") as f:
+                f.seek(-1, os.SEEK_END)
+                last = f.read(1)[0]
+                f.seek(-1, os.SEEK_END)
+                f.write(bytes([last ^ 0x80]))
+            rebuilt_decoder = ctcdecode.CTCBeamDecoder(
+                self.vocab_list,
+                beam_width=self.beam_size,
+                blank_id=self.vocab_list.index("_"),
+                model_path=lm_path,
+                dictionary_cache_dir=cache_dir,
+            )
+            self.assertFalse(rebuilt_decoder.dictionary_stats()["from_cache"])
+            rebuilt_results, rebuilt_scores, rebuilt_timesteps, rebuilt_seq_len = rebuilt_decoder.decode(probs_seq)
+            self.assertTrue(torch.equal(rebuilt_scores, beam_scores))
+        finally:
+            shutil.rmtree(cache_dir)
+
+        # decoders built at the same time save through their own temporary
+        # files, leaving one whole cache file
+        cache_dir = tempfile.mkdtemp()
+        try:
+            def build():
+                ctcdecode.CTCBeamDecoder(self.vocab_list, model_path=lm_path, dictionary_cache_dir=cache_dir)
+
+            threads = [threading.Thread(target=build) for _ in range(4)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            self.assertEqual(len(os.listdir(cache_dir)), 1)
+            cached_decoder = ctcdecode.CTCBeamDecoder(
+                self.vocab_list, model_path=lm_path, dictionary_cache_dir=cache_dir
+            )
+            self.assertTrue(cached_decoder.dictionary_stats()["from_cache"])
+        finally:
+            shutil.rmtree(cache_dir)
+
+    def test_beam_search_decoder_lm_load_method(self):
+        arpa_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
+        probs_seq = torch.FloatTensor([self.probs_seq2])
+        lm_paths = [arpa_path]
+        binary_dir = tempfile.mkdtemp()
+        try:
+            # the load methods only differ on binary models, built when KenLM's tools are around
+            build_binary = shutil.which("build_binary")
+            if build_binary is not None:
+                binary_path = os.path.join(binary_dir, "test.binary")
+                subprocess.check_call([build_binary, arpa_path, binary_path], stdout=subprocess.DEVNULL)
+                lm_paths.append(binary_path)
+
+            def decoder(lm_path, method):
+                return ctcdecode.CTCBeamDecoder(
+                    self.vocab_list,
+                    beam_width=self.beam_size,
+                    blank_id=self.vocab_list.index("_"),
+                    model_path=lm_path,
+                    lm_load_method=method,
+                )
+
+            num_loaded = ctcdecode.num_loaded_lms()
+            for lm_path in lm_paths:
+                for method in ["lazy", "populate", "read"]:
+                    # each method loads the model anew, decoders of the same method share it
+                    decoders = [decoder(lm_path, method), decoder(lm_path, method)]
+                    self.assertEqual(ctcdecode.num_loaded_lms(), num_loaded + 1)
+                    for d in decoders:
+                        beam_result, beam_scores, timesteps, out_seq_len = d.decode(probs_seq)
+                        output_str = self.convert_to_string(beam_result[0][0], self.vocab_list, out_seq_len[0][0])
+                        self.assertEqual(output_str, self.beam_search_result[2])
+                    del decoders, d
+                    self.assertEqual(ctcdecode.num_loaded_lms(), num_loaded)
+
+            # another load method gets its own model instead of the one already loaded
+            lazy, read = decoder(arpa_path, "lazy"), decoder(arpa_path, "read")
+            self.assertEqual(ctcdecode.num_loaded_lms(), num_loaded + 2)
+            del lazy, read
+            self.assertEqual(ctcdecode.num_loaded_lms(), num_loaded)
+        finally:
+            shutil.rmtree(binary_dir)
+
+        with self.assertRaises(ValueError):
+            ctcdecode.CTCBeamDecoder(self.vocab_list, model_path=arpa_path, lm_load_method="mmap")
+
     def test_beam_search_decoder_batch(self):
         probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
         decoder = ctcdecode.CTCBeamDecoder(
@@ -75,6 +279,72 @@ class TestDecoders(unittest.TestCase):
         self.assertEqual(output_str2, self.beam_search_result[1])
         del decoder
 
+    def test_beam_search_decoder_resize_pool(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2] * 4)
+        decoder = ctcdecode.CTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_"), num_processes=3
+        )
+        self.assertEqual(decoder.num_processes(), 3)
+        for num_processes in [1, 8, 3]:
+            decoder.set_num_processes(num_processes)
+            self.assertEqual(decoder.num_processes(), num_processes)
+            beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+            for b in range(probs_seq.size(0)):
+                output_str = self.convert_to_string(beam_results[b][0], self.vocab_list, out_seq_len[b][0])
+                self.assertEqual(output_str, self.beam_search_result[b % 2])
+
+    def test_beam_search_decoder_mixed_lengths(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2] * 4)
+        seq_lens = torch.IntTensor([1, 5, 2, 5, 3, 5, 4, 5])
+        decoder = ctcdecode.CTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_"), num_processes=2
+        )
+        beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq, seq_lens)
+        for b in range(probs_seq.size(0)):
+            item_results, _, _, item_seq_len = decoder.decode(probs_seq[b:b + 1, :seq_lens[b]])
+            length = item_seq_len[0][0]
+            self.assertEqual(out_seq_len[b][0], length)
+            self.assertTrue(torch.equal(beam_results[b][0][:length], item_results[0][0][:length]))
+        decoder.decode(probs_seq, seq_lens)
+        timing = decoder.last_batch_timing()
+        self.assertEqual(timing["num_items"], probs_seq.size(0))
+        self.assertGreater(timing["ideal_makespan"], 0)
+        self.assertGreaterEqual(timing["makespan"], timing["ideal_makespan"])
+
+    def test_beam_search_decoder_packed(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2] * 2)
+        seq_lens = torch.IntTensor([6, 5, 2, 1])
+        decoder = ctcdecode.CTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_"), num_processes=2
+        )
+        beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq, seq_lens)
+        for top_k in [None, 3]:
+            packed = decoder.decode_packed(probs_seq, seq_lens, top_k=top_k)
+            packed_results, packed_scores, packed_timesteps, packed_lens, offsets = packed
+            num_beams = top_k or self.beam_size
+            self.assertEqual(packed_scores.size(), (probs_seq.size(0), num_beams))
+            self.assertEqual(packed_results.size(0), packed_lens.sum().item())
+            for b in range(probs_seq.size(0)):
+                for p in range(num_beams):
+                    length = packed_lens[b][p].item()
+                    if math.isinf(packed_scores[b][p].item()):
+                        self.assertEqual(length, 0)
+                        continue
+                    start = offsets[b][p].item()
+                    self.assertEqual(length, out_seq_len[b][p])
+                    self.assertEqual(packed_scores[b][p], beam_scores[b][p])
+                    self.assertTrue(torch.equal(packed_results[start : start + length], beam_results[b][p][:length]))
+                    self.assertTrue(torch.equal(packed_timesteps[start : start + length], timesteps[b][p][:length]))
+
+        online_decoder = ctcdecode.OnlineCTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_")
+        )
+        state = ctcdecode.DecoderState(online_decoder)
+        online_decoder.decode_packed(probs_seq[:1, :3], [state], [False])
+        online_results, _, _, online_lens, _ = online_decoder.decode_packed(probs_seq[:1, 3:], [state], [True], top_k=1)
+        self.assertEqual(online_lens.size(), (1, 1))
+        self.assertTrue(torch.equal(online_results, beam_results[0][0][: out_seq_len[0][0]]))
+
     def test_beam_search_decoder_batch_log(self):
         probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2]).log()
         decoder = ctcdecode.CTCBeamDecoder(
@@ -90,6 +360,164 @@ class TestDecoders(unittest.TestCase):
         self.assertEqual(output_str1, self.beam_search_result[0])
         self.assertEqual(output_str2, self.beam_search_result[1])
 
+    def test_beam_search_decoder_fast_log_add(self):
+        lm_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        for model_path in [None, lm_path]:
+            exact = ctcdecode.CTCBeamDecoder(
+                self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_"), model_path=model_path
+            )
+            fast = ctcdecode.CTCBeamDecoder(
+                self.vocab_list,
+                beam_width=self.beam_size,
+                blank_id=self.vocab_list.index("_"),
+                model_path=model_path,
+                fast_log_add=True,
+            )
+            exact_results, exact_scores, _, exact_lens = exact.decode(probs_seq)
+            fast_results, fast_scores, _, fast_lens = fast.decode(probs_seq)
+            for b in range(2):
+                self.assertEqual(
+                    self.convert_to_string(fast_results[b][0], self.vocab_list, fast_lens[b][0]),
+                    self.convert_to_string(exact_results[b][0], self.vocab_list, exact_lens[b][0]),
+                )
+            self.assertTrue(torch.allclose(fast_scores[:, 0], exact_scores[:, 0], atol=1e-4))
+
+    def test_beam_search_decoder_blank_skip(self):
+        # three confidently blank frames after every frame of probs_seq1
+        blank_id = self.vocab_list.index("_")
+        blank_frame = [1e-5] * len(self.vocab_list)
+        blank_frame[blank_id] = 1.0 - 1e-5 * (len(self.vocab_list) - 1)
+        frames = []
+        for frame in self.probs_seq1:
+            frames += [frame, blank_frame, blank_frame, blank_frame]
+        probs_seq = torch.FloatTensor([frames])
+
+        results = []
+        for threshold in [1.0, 0.999]:
+            decoder = ctcdecode.CTCBeamDecoder(
+                self.vocab_list, beam_width=self.beam_size, blank_id=blank_id, blank_skip_threshold=threshold
+            )
+            beam_result, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+            results.append(
+                (
+                    self.convert_to_string(beam_result[0][0], self.vocab_list, out_seq_len[0][0]),
+                    timesteps[0][0][: out_seq_len[0][0]].tolist(),
+                    decoder.num_skipped_frames().tolist(),
+                )
+            )
+        self.assertEqual(results[0][:2], results[1][:2])
+        self.assertTrue(all(t % 4 == 0 for t in results[1][1]))
+        self.assertEqual(results[0][2], [0])
+        self.assertEqual(results[1][2], [3 * len(self.probs_seq1)])
+
+        decoder = ctcdecode.OnlineCTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=blank_id, blank_skip_threshold=0.999
+        )
+        state = ctcdecode.DecoderState(decoder)
+        decoder.decode(probs_seq[:, :12], [state], [False])
+        beam_result, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq[:, 12:], [state], [True])
+        self.assertEqual(self.convert_to_string(beam_result[0][0], self.vocab_list, out_seq_len[0][0]), results[1][0])
+        self.assertEqual(timesteps[0][0][: out_seq_len[0][0]].tolist(), results[1][1])
+        self.assertEqual(state.num_skipped_frames(), 3 * len(self.probs_seq1))
+
+    def test_greedy_decoder(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCGreedyDecoder(self.vocab_list, blank_id=self.vocab_list.index("_"), num_processes=2)
+        results, scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+        self.assertEqual(results.size(), (2, 1, probs_seq.size(1)))
+        for b, probs in enumerate([self.probs_seq1, self.probs_seq2]):
+            output_str = self.convert_to_string(results[b][0], self.vocab_list, out_seq_len[b][0])
+            self.assertEqual(output_str, self.greedy_result[b])
+            best_path_log_prob = sum(math.log(max(frame)) for frame in probs)
+            self.assertAlmostEqual(scores[b][0].item(), -best_path_log_prob, places=4)
+        self.assertEqual(timesteps[0][0][: out_seq_len[0][0]].tolist(), [0, 1, 2, 3, 4, 5])
+
+        # log probabilities, a vocabulary strided in memory and mixed lengths
+        log_probs = probs_seq.log().transpose(1, 2).contiguous().transpose(1, 2)
+        seq_lens = torch.IntTensor([3, 5])
+        log_decoder = ctcdecode.CTCGreedyDecoder(
+            self.vocab_list, blank_id=self.vocab_list.index("_"), log_probs_input=True
+        )
+        log_results, log_scores, _, log_seq_len = log_decoder.decode(log_probs, seq_lens)
+        for b in range(2):
+            item_results, item_scores, _, item_seq_len = decoder.decode(probs_seq[b : b + 1, : seq_lens[b]])
+            length = item_seq_len[0][0]
+            self.assertEqual(log_seq_len[b][0], length)
+            self.assertTrue(torch.equal(log_results[b][0][:length], item_results[0][0][:length]))
+            self.assertAlmostEqual(log_scores[b][0].item(), item_scores[0][0].item(), places=4)
+
+        # 29 labels take the vectorized argmax: maxima in its first and later
+        # blocks of four and in the scalar tail, ties within a lane, across
+        # lanes and between the blocks and the tail, all kept on the first
+        labels = ["_", " ", "'"] + [chr(c) for c in range(ord("a"), ord("z") + 1)]
+        peaks = [[2], [13], [28], [28], [0], [6, 9], [5, 9], [7, 8], [10, 28], [27, 28], [1]]
+        generator = torch.Generator().manual_seed(0)
+        wide_probs = torch.rand(1, len(peaks), len(labels), generator=generator) * 0.5
+        for t, frame_peaks in enumerate(peaks):
+            for label in frame_peaks:
+                wide_probs[0, t, label] = 1.0
+        best = torch.argmax(wide_probs[0], dim=1).tolist()
+        self.assertEqual(best, [frame_peaks[0] for frame_peaks in peaks])
+        expected = [label for t, label in enumerate(best) if label != 0 and (t == 0 or label != best[t - 1])]
+        wide_decoder = ctcdecode.CTCGreedyDecoder(labels)
+        wide_results, _, _, wide_seq_len = wide_decoder.decode(wide_probs)
+        self.assertEqual(wide_results[0][0][: wide_seq_len[0][0]].tolist(), expected)
+
+    def test_beam_search_decoder_async(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2] * 4)
+        seq_lens = torch.IntTensor([6, 5, 2, 1, 4, 3, 6, 5])
+        decoder = ctcdecode.CTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_"), num_processes=2
+        )
+        beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq, seq_lens)
+        timing = decoder.last_batch_timing()
+        futures = [decoder.decode_async(probs_seq, seq_lens) for _ in range(3)]
+        for future in futures:
+            async_results, async_scores, async_timesteps, async_seq_len = future.result()
+            # background batches leave the timing of the last decode call alone
+            self.assertEqual(decoder.last_batch_timing(), timing)
+            self.assertTrue(future.done())
+            self.assertTrue(torch.equal(async_seq_len, out_seq_len))
+            for b in range(probs_seq.size(0)):
+                for p in range(self.beam_size):
+                    length = out_seq_len[b][p]
+                    if length == 0:
+                        continue
+                    self.assertEqual(async_scores[b][p], beam_scores[b][p])
+                    self.assertTrue(torch.equal(async_results[b][p][:length], beam_results[b][p][:length]))
+                    self.assertTrue(torch.equal(async_timesteps[b][p][:length], timesteps[b][p][:length]))
+        # dropped before its results are read
+        decoder.decode_async(probs_seq, seq_lens)
+
+        # decoding in other Python threads at once
+        outputs = [None] * 4
+
+        def decode(i):
+            outputs[i] = decoder.decode(probs_seq, seq_lens)[0]
+
+        threads = [threading.Thread(target=decode, args=(i,)) for i in range(len(outputs))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for output in outputs:
+            self.assertEqual(
+                self.convert_to_string(output[0][0], self.vocab_list, out_seq_len[0][0]), self.beam_search_result[0]
+            )
+
+        online_decoder = ctcdecode.OnlineCTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_")
+        )
+        state = ctcdecode.DecoderState(online_decoder)
+        online_decoder.decode_async(probs_seq[:1, :3], [state], [False]).result()
+        future = online_decoder.decode_async(probs_seq[:1, 3:], [state], [True])
+        online_results, _, _, online_seq_len = future.result()
+        self.assertEqual(
+            self.convert_to_string(online_results[0][0], self.vocab_list, online_seq_len[0][0]),
+            self.beam_search_result[0],
+        )
+
     def test_online_decoder_decoding(self):
         lm_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
         decoder = ctcdecode.OnlineCTCBeamDecoder(
@@ -114,6 +542,41 @@ class TestDecoders(unittest.TestCase):
         self.assertEqual(output_str1, self.beam_search_result[2])
         self.assertEqual(output_str2, self.beam_search_result[2])
 
+    def test_online_decoder_partial(self):
+        lm_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
+        decoder = ctcdecode.OnlineCTCBeamDecoder(
+            self.vocab_list,
+            beam_width=self.beam_size,
+            blank_id=self.vocab_list.index("_"),
+            model_path=lm_path,
+        )
+        state = ctcdecode.DecoderState(decoder)
+        changes_state = ctcdecode.DecoderState(decoder)
+        probs_seq = torch.FloatTensor([self.probs_seq2])
+
+        committed = []
+        transcript = []
+        for t in range(probs_seq.size(1)):
+            is_eos = t == probs_seq.size(1) - 1
+            beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(
+                probs_seq[:, t : t + 1], [state], [is_eos]
+            )
+            decoder.decode(probs_seq[:, t : t + 1], [changes_state], [is_eos])
+            partial = state.partial()
+            changes = changes_state.partial(changes_only=True)
+            self.assertEqual(len(partial["tokens"]), partial["length"])
+            self.assertLessEqual(partial["num_committed"], partial["length"])
+            # committed tokens stay
+            self.assertEqual(partial["tokens"][: len(committed)], committed)
+            committed = partial["tokens"][: partial["num_committed"]]
+            # the changes rebuild the whole hypothesis
+            self.assertEqual(changes["num_unchanged"], partial["num_unchanged"])
+            transcript = transcript[: changes["num_unchanged"]] + changes["tokens"]
+            self.assertEqual(transcript, partial["tokens"])
+
+        output = beam_results[0][0][: out_seq_len[0][0]].tolist()
+        self.assertEqual(output[: len(committed)], committed)
+
     def test_online_decoder_decoding_no_lm(self):
         decoder = ctcdecode.OnlineCTCBeamDecoder(
             self.vocab_list,
@@ -210,6 +673,193 @@ class TestDecoders(unittest.TestCase):
         del state1
         self.assertGreaterEqual(beam_results.shape[2], out_seq_len.max())
 
+    def test_online_decoder_releases_scorer(self):
+        lm_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
+        num_loaded = ctcdecode.num_loaded_lms()
+        decoder = ctcdecode.OnlineCTCBeamDecoder(
+            self.vocab_list,
+            beam_width=self.beam_size,
+            blank_id=self.vocab_list.index("_"),
+            model_path=lm_path,
+        )
+        state = ctcdecode.DecoderState(decoder)
+        decoder.decode(torch.FloatTensor([self.probs_seq1]), [state], [False])
+        self.assertEqual(ctcdecode.num_loaded_lms(), num_loaded + 1)
+        # the state's config holds on to the scorer, which goes with the state
+        del decoder
+        self.assertEqual(ctcdecode.num_loaded_lms(), num_loaded + 1)
+        del state
+        self.assertEqual(ctcdecode.num_loaded_lms(), num_loaded)
+
+    def test_online_decoder_snapshot(self):
+        lm_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
+        decoder = ctcdecode.OnlineCTCBeamDecoder(
+            self.vocab_list,
+            beam_width=self.beam_size,
+            blank_id=self.vocab_list.index("_"),
+            model_path=lm_path,
+        )
+        probs_seq = torch.FloatTensor([self.probs_seq1 + self.probs_seq2])
+        half = len(self.probs_seq1)
+
+        state = ctcdecode.DecoderState(decoder)
+        decoder.decode(probs_seq[:, :half], [state], [False])
+        snapshot = state.snapshot()
+        restored = ctcdecode.DecoderState(decoder, snapshot)
+        self.assertEqual(len(restored.snapshot()), len(snapshot))
+        self.assertEqual(restored.partial(), state.partial())
+
+        beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq[:, half:], [state], [True])
+        restored_results, restored_scores, restored_timesteps, restored_seq_len = decoder.decode(
+            probs_seq[:, half:], [restored], [True]
+        )
+        self.assertTrue(torch.equal(restored_seq_len, out_seq_len))
+        self.assertEqual(restored_scores[0][0], beam_scores[0][0])
+        for k in range(self.beam_size):
+            length = out_seq_len[0][k]
+            self.assertTrue(torch.equal(restored_results[0][k][:length], beam_results[0][k][:length]))
+            self.assertTrue(torch.equal(restored_timesteps[0][k][:length], timesteps[0][k][:length]))
+
+        # a snapshot only restores under the same settings, and must be whole
+        other_decoder = ctcdecode.OnlineCTCBeamDecoder(
+            self.vocab_list,
+            beam_width=self.beam_size + 1,
+            blank_id=self.vocab_list.index("_"),
+            model_path=lm_path,
+        )
+        with self.assertRaises(ValueError):
+            ctcdecode.DecoderState(other_decoder, snapshot)
+        with self.assertRaises(ValueError):
+            ctcdecode.DecoderState(decoder, snapshot[:-1])
+
+    def test_online_decoder_recycles_nodes(self):
+        decoder = ctcdecode.OnlineCTCBeamDecoder(
+            self.vocab_list, beam_width=self.beam_size, blank_id=self.vocab_list.index("_")
+        )
+        state = ctcdecode.DecoderState(decoder)
+        stats = state.memory_stats()
+        self.assertEqual(stats["num_nodes_recycled"], 0)
+
+        # prefixes pruned from the beam on one frame give their nodes to the next one's
+        probs_seq = torch.FloatTensor([self.probs_seq1 + self.probs_seq2])
+        decoder.decode(probs_seq, [state], [True])
+        stats = state.memory_stats()
+        self.assertGreater(stats["num_nodes_allocated"], 0)
+        self.assertGreater(stats["num_nodes_recycled"], 0)
+
+    def test_online_decoder_long_stream_memory(self):
+        # two hours of speech at 25 frames per second, fed a minute at a time
+        lm_path = os.path.join(os.path.dirname(os.path.realpath(__file__)), "test.arpa")
+        num_frames = 2 * 3600 * 25
+        chunk_size = 1440
+        for model_path, text in ((None, "abc dab cad "), (lm_path, "a ")):
+            decoder = ctcdecode.OnlineCTCBeamDecoder(
+                self.vocab_list,
+                beam_width=self.beam_size,
+                blank_id=self.vocab_list.index("_"),
+                model_path=model_path,
+            )
+            state = ctcdecode.DecoderState(decoder)
+
+            # each label confidently, then a blank
+            labels = []
+            for char in text:
+                labels += [self.vocab_list.index(char), self.vocab_list.index("_")]
+            chunk = torch.full((1, chunk_size, len(self.vocab_list)), 0.1 / (len(self.vocab_list) - 1))
+            for t in range(chunk_size):
+                chunk[0, t, labels[t % len(labels)]] = 0.9
+
+            first_chunk_stats = None
+            for start in range(0, num_frames, chunk_size):
+                is_eos = start + chunk_size >= num_frames
+                beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(chunk, [state], [is_eos])
+                if first_chunk_stats is None:
+                    first_chunk_stats = state.memory_stats()
+
+            # the prefix tree holds no more than after the first minute
+            stats = state.memory_stats()
+            self.assertEqual(stats["num_nodes_allocated"], first_chunk_stats["num_nodes_allocated"])
+            self.assertGreater(stats["num_folded_tokens"], first_chunk_stats["num_folded_tokens"])
+
+            output = self.convert_to_string(beam_results[0][0], self.vocab_list, out_seq_len[0][0])
+            self.assertGreaterEqual(len(output), stats["num_folded_tokens"])
+            expected = text * (num_frames // len(labels))
+            if model_path is None:
+                self.assertEqual(output, expected)
+            else:
+                # the pruned beam drops the odd word under the LM
+                self.assertEqual(output, expected[: len(output)])
+
+                # streaming a few minutes, folded every 128 frames, gives the words of decoding them in one call
+                num_reference_frames = 4 * chunk_size
+                reference_state = ctcdecode.DecoderState(decoder)
+                for start in range(0, num_reference_frames, chunk_size):
+                    is_eos = start + chunk_size >= num_reference_frames
+                    beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(
+                        chunk, [reference_state], [is_eos]
+                    )
+                self.assertGreater(reference_state.memory_stats()["num_folded_tokens"], 0)
+                output = self.convert_to_string(beam_results[0][0], self.vocab_list, out_seq_len[0][0])
+                reference_decoder = ctcdecode.CTCBeamDecoder(
+                    self.vocab_list,
+                    beam_width=self.beam_size,
+                    blank_id=self.vocab_list.index("_"),
+                    model_path=model_path,
+                )
+                beam_results, beam_scores, timesteps, out_seq_len = reference_decoder.decode(
+                    chunk.repeat(1, num_reference_frames // chunk_size, 1)
+                )
+                reference = self.convert_to_string(beam_results[0][0], self.vocab_list, out_seq_len[0][0])
+                self.assertEqual(output, reference)
+
+    def reference_pruned_log_probs(self, probs, cutoff_prob, cutoff_top_n, log_input):
+        # Straightforward full-sort pruning the decoder used to do, rounded to float32 like its output
+        def log_sum_exp(x, y):
+            if x <= -sys.float_info.max:
+                return y
+            if y <= -sys.float_info.max:
+                return x
+            xmax = max(x, y)
+            return math.log(math.exp(x - xmax) + math.exp(y - xmax)) + xmax
+
+        def safe_log(x):
+            return math.log(x) if x > 0 else -math.inf
+
+        def to_float32(x):
+            return struct.unpack("f", struct.pack("f", x))[0]
+
+        prob_idx = list(enumerate(probs))
+        cutoff_len = len(probs)
+        if math.log(cutoff_prob) < 0.0 or cutoff_top_n < cutoff_len:
+            prob_idx.sort(key=lambda pair: -pair[1])
+            if math.log(cutoff_prob) < 0.0:
+                cum_prob = 0.0
+                cutoff_len = 0
+                for _, prob in prob_idx:
+                    cum_prob = log_sum_exp(cum_prob, prob if log_input else safe_log(prob))
+                    cutoff_len += 1
+                    if cum_prob >= cutoff_prob or cutoff_len >= cutoff_top_n:
+                        break
+            else:
+                cutoff_len = cutoff_top_n
+        return [
+            (i, to_float32(prob if log_input else math.log(prob + FLT_MIN))) for i, prob in prob_idx[:cutoff_len]
+        ]
+
+    def test_pruned_log_probs_match_reference(self):
+        torch.manual_seed(0)
+        for vocab_size in [1, 7, 40, 500, 5000]:
+            for peakiness in [0.5, 4.0]:
+                probs = torch.softmax(torch.randn(vocab_size) * peakiness, dim=0)
+                for log_input in [0, 1]:
+                    step = probs.log() if log_input else probs
+                    for cutoff_prob, cutoff_top_n in [(1.0, 40), (1.0, vocab_size + 1), (0.6, 40), (0.99, 3), (1.0, 1)]:
+                        result = ctcdecode.ctc_decode._pruned_log_probs(step, cutoff_prob, cutoff_top_n, log_input)
+                        expected = self.reference_pruned_log_probs(
+                            step.tolist(), cutoff_prob, cutoff_top_n, log_input
+                        )
+                        self.assertEqual([(i, p) for i, p in result], expected)
+
 
 if __name__ == "__main__":
     unittest.main()